@@ -0,0 +1,88 @@
+#include "autotune.h"
+
+#include <algorithm>
+
+#include "utils.h"
+
+
+BufferAutotuner &BufferAutotuner::instance() {
+    static BufferAutotuner tuner;
+    return tuner;
+}
+
+void BufferAutotuner::start(SSL *connection, std::function<void()> applyDatagramSize) {
+    if (!_enabled || _started || (_forwarderFixed && _datagramFixed)) {
+        return;
+    }
+
+    uint64_t rtt = 0;
+    if (!SSL_get_handshake_rtt(connection, &rtt) || !rtt) {
+        ERR_clear_error();
+        log(LOG_FWD, "autotune: no handshake rtt available, keeping buffer sizes\n");
+        return;
+    }
+
+    _started = true;
+    _applyDatagramSize = applyDatagramSize;
+    _rtt = std::chrono::microseconds(rtt);
+    _lastSample = std::chrono::steady_clock::now();
+    _egressBytes = 0;
+    _ingressBytes = 0;
+    log(LOG_FWD, "autotune: handshake rtt {}us\n", rtt);
+    g_timeout_add(1000, wrap_sample, this);
+}
+
+void BufferAutotuner::pathChanged() {
+    if (!_started) {
+        return;
+    }
+    _rtt = std::chrono::microseconds(0);
+    log(LOG_FWD, "autotune: path changed, waiting for its rtt\n");
+}
+
+gboolean BufferAutotuner::wrap_sample(gpointer user_data) {
+    reinterpret_cast<BufferAutotuner*>(user_data)->sample();
+    return G_SOURCE_CONTINUE;
+}
+
+void BufferAutotuner::sample() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - _lastSample).count();
+    _lastSample = now;
+    if (seconds <= 0) {
+        return;
+    }
+
+    double rate = std::max(_egressBytes, _ingressBytes) / seconds;
+    _egressBytes = 0;
+    _ingressBytes = 0;
+    // the peak decays slowly, so buffers shrink again after the connection went idle or got slower
+    _peakRate = std::max(_peakRate * 0.8, rate);
+
+    if (_rttSource) {
+        if (uint64_t rtt = _rttSource()) {
+            _rtt = std::chrono::microseconds(rtt);
+        }
+    }
+    if (!_rtt.count()) {
+        return;
+    }
+
+    double bdp = _peakRate * std::chrono::duration<double>(_rtt).count();
+    size_t target = std::clamp(size_t(2 * bdp), _minSize, _maxSize);
+    target = (target + BufferPool::slabSize - 1) / BufferPool::slabSize * BufferPool::slabSize;
+
+    if (!_forwarderFixed && target != bufferSizes.localToQuic) {
+        log(LOG_FWD, "autotune: {:.0f} bytes/s, bdp {:.0f} bytes, forwarder buffers {} -> {}\n",
+            _peakRate, bdp, bufferSizes.localToQuic, target);
+        bufferSizes.localToQuic = target;
+        bufferSizes.quicToLocal = target;
+    }
+    if (!_datagramFixed && target != bufferSizes.datagram) {
+        log(LOG_FWD, "autotune: datagram buffers {} -> {}\n", bufferSizes.datagram, target);
+        bufferSizes.datagram = target;
+        if (_applyDatagramSize) {
+            _applyDatagramSize();
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include <openssl/ssl.h>
+
+#include <glib.h>
+
+#include "buffers.h"
+
+// Tracks the bandwidth-delay product of the QUIC connection and sizes the buffers to twice of it.
+// The round trip time is taken from the handshake until the RTT source measures it on the live connection, the
+// delivery rate is the decaying peak of the datagram rate in either direction, sampled every second. Sizes fixed by
+// configuration are left alone.
+class BufferAutotuner {
+public:
+    static BufferAutotuner &instance();
+
+    void setEnabled(bool enabled) { _enabled = enabled; }
+    void setForwarderFixed(bool fixed) { _forwarderFixed = fixed; }
+    void setDatagramFixed(bool fixed) { _datagramFixed = fixed; }
+
+    // starts sampling once the handshake of connection is done, applyDatagramSize is called when
+    // bufferSizes.datagram changed.
+    void start(SSL *connection, std::function<void()> applyDatagramSize);
+
+    // smoothed round trip time of the live connection in microseconds, 0 while unknown
+    void setRttSource(std::function<uint64_t()> source) { _rttSource = source; }
+    // The connection moved to another path, the buffers keep their sizes until the RTT source measured the new one.
+    void pathChanged();
+
+    void countEgress(size_t bytes) { _egressBytes += bytes; }
+    void countIngress(size_t bytes) { _ingressBytes += bytes; }
+
+private:
+    BufferAutotuner() = default;
+
+    static gboolean wrap_sample(gpointer user_data);
+    void sample();
+
+    static constexpr size_t _minSize = 256*1024;
+    static constexpr size_t _maxSize = 64*1024*1024;
+
+    bool _enabled = false;
+    bool _forwarderFixed = false;
+    bool _datagramFixed = false;
+    bool _started = false;
+
+    std::function<void()> _applyDatagramSize;
+    std::function<uint64_t()> _rttSource;
+    // 0 while unknown
+    std::chrono::microseconds _rtt{0};
+    std::chrono::steady_clock::time_point _lastSample;
+    size_t _egressBytes = 0;
+    size_t _ingressBytes = 0;
+    // bytes per second
+    double _peakRate = 0;
+};
@@ -0,0 +1,216 @@
+#include "buffers.h"
+
+#include "utils.h"
+
+
+BufferSizes bufferSizes;
+
+WriteBatchLimits writeBatchLimits;
+
+RingBuffer::RingBuffer(size_t size) : _data(new std::byte[size]), _size(size) {
+}
+
+std::pair<std::byte*, size_t> RingBuffer::readable() {
+    size_t len = std::min(_used, _size - _readPos);
+    return { _data.get() + _readPos, len };
+}
+
+std::pair<std::byte*, size_t> RingBuffer::writable() {
+    size_t writePos = (_readPos + _used) % _size;
+    size_t len;
+    if (full()) {
+        len = 0;
+    } else if (writePos >= _readPos) {
+        len = _size - writePos;
+    } else {
+        len = _readPos - writePos;
+    }
+    return { _data.get() + writePos, len };
+}
+
+void RingBuffer::commit(size_t len) {
+    if (len > _size - _used) {
+        fatal("RingBuffer::commit overflow {} > {}\n", len, _size - _used);
+    }
+    _used += len;
+}
+
+void RingBuffer::consume(size_t len) {
+    if (len > _used) {
+        fatal("RingBuffer::consume underflow {} > {}\n", len, _used);
+    }
+    _readPos = (_readPos + len) % _size;
+    _used -= len;
+}
+
+BufferPool &BufferPool::instance() {
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool::~BufferPool() {
+    for (std::byte *slab : _cached) {
+        delete[] slab;
+    }
+}
+
+std::byte *BufferPool::acquire() {
+    if (!available()) {
+        if (!_denied++) {
+            log(LOG_FWD, "buffer pool limit of {} bytes reached, connections are throttled\n", limit());
+        }
+        return nullptr;
+    }
+    if (!_statsScheduled) {
+        _statsScheduled = true;
+        atexit([] {
+            instance().logStats();
+        });
+    }
+    _inUse++;
+    _peakInUse = std::max(_peakInUse, _inUse);
+    if (_cached.size()) {
+        std::byte *slab = _cached.back();
+        _cached.pop_back();
+        return slab;
+    }
+    return new std::byte[slabSize];
+}
+
+void BufferPool::release(std::byte *slab) {
+    if (!_inUse) {
+        fatal("BufferPool::release without matching acquire\n");
+    }
+    _inUse--;
+    if (_cached.size() < _maxCachedSlabs) {
+        _cached.push_back(slab);
+    } else {
+        delete[] slab;
+    }
+}
+
+void BufferPool::setLimit(size_t bytes) {
+    _maxSlabs = std::max<size_t>(1, bytes / slabSize);
+}
+
+void BufferPool::logStats() const {
+    log(LOG_FWD, "buffer pool: {} KiB in use, peak {} KiB, {} KiB cached, limit {} KiB, {} denied\n",
+        _inUse * slabSize / 1024, _peakInUse * slabSize / 1024, _cached.size() * slabSize / 1024,
+        limit() / 1024, _denied);
+}
+
+SlabBuffer::SlabBuffer(size_t capacity) : _capacity(capacity) {
+}
+
+SlabBuffer::~SlabBuffer() {
+    for (std::byte *slab : _slabs) {
+        BufferPool::instance().release(slab);
+    }
+}
+
+std::pair<std::byte*, size_t> SlabBuffer::readable() {
+    if (!_used) {
+        return { nullptr, 0 };
+    }
+    size_t len = std::min(_used, BufferPool::slabSize - _readPos);
+    return { _slabs.front() + _readPos, len };
+}
+
+std::pair<std::byte*, size_t> SlabBuffer::writable() {
+    if (_used >= _capacity) {
+        return { nullptr, 0 };
+    }
+    if (_slabs.empty() || _writePos == BufferPool::slabSize) {
+        std::byte *slab = BufferPool::instance().acquire();
+        if (!slab) {
+            return { nullptr, 0 };
+        }
+        if (_slabs.empty()) {
+            _readPos = 0;
+        }
+        _slabs.push_back(slab);
+        _writePos = 0;
+    }
+    size_t len = std::min(BufferPool::slabSize - _writePos, _capacity - _used);
+    return { _slabs.back() + _writePos, len };
+}
+
+int SlabBuffer::readableIov(struct iovec *iov, int maxIov, size_t maxBytes) {
+    size_t remaining = std::min(_used, maxBytes);
+    size_t offset = _readPos;
+    int count = 0;
+    for (auto it = _slabs.begin(); remaining && count < maxIov && it != _slabs.end(); ++it) {
+        size_t len = std::min(remaining, BufferPool::slabSize - offset);
+        iov[count++] = { *it + offset, len };
+        remaining -= len;
+        offset = 0;
+    }
+    return count;
+}
+
+void SlabBuffer::commit(size_t len) {
+    // not checked against the capacity, it might have shrunk while a read into the region was in flight
+    if (_slabs.empty() || len > BufferPool::slabSize - _writePos) {
+        fatal("SlabBuffer::commit overflow {}\n", len);
+    }
+    _writePos += len;
+    _used += len;
+}
+
+void SlabBuffer::consume(size_t len) {
+    if (len > _used) {
+        fatal("SlabBuffer::consume underflow {} > {}\n", len, _used);
+    }
+    while (len) {
+        size_t chunk = std::min(len, BufferPool::slabSize - _readPos);
+        _readPos += chunk;
+        _used -= chunk;
+        len -= chunk;
+        if (_readPos == BufferPool::slabSize) {
+            // fully written as well, so no region from writable() can point into it
+            BufferPool::instance().release(_slabs.front());
+            _slabs.pop_front();
+            _readPos = 0;
+        }
+    }
+}
+
+void SlabBuffer::trim() {
+    if (_used) {
+        return;
+    }
+    for (std::byte *slab : _slabs) {
+        BufferPool::instance().release(slab);
+    }
+    _slabs.clear();
+    _readPos = 0;
+    _writePos = 0;
+}
+
+bool SlabBuffer::full() const {
+    if (_used >= _capacity) {
+        return true;
+    }
+    if (_slabs.size() && _writePos < BufferPool::slabSize) {
+        return false;
+    }
+    return !BufferPool::instance().available();
+}
+
+void ThroughputCounter::add(size_t bytes) {
+    auto now = std::chrono::steady_clock::now();
+    if (!_bytes) {
+        _start = now;
+    }
+    _bytes += bytes;
+    _last = now;
+}
+
+void ThroughputCounter::logSummary(std::string_view direction) const {
+    if (!_bytes) {
+        return;
+    }
+    double seconds = std::chrono::duration<double>(_last - _start).count();
+    double rate = seconds > 0 ? _bytes / seconds / (1024 * 1024) : 0;
+    log(LOG_FWD, "{}: forwarded {} bytes in {:.3f}s ({:.2f} MiB/s)\n", direction, _bytes, seconds, rate);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+
+// Single producer, single consumer byte ring buffer.
+// The producer fills the region returned by writable() and commits it, the consumer drains the region returned by
+// readable() and consumes it. Both regions are contiguous and never overlap, so one side can have an asynchronous
+// operation in flight on its region while the other side continues.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t size);
+
+    std::pair<std::byte*, size_t> readable();
+    std::pair<std::byte*, size_t> writable();
+
+    void commit(size_t len);
+    void consume(size_t len);
+
+    std::byte *data() { return _data.get(); }
+    size_t size() const { return _size; }
+    size_t used() const { return _used; }
+    bool empty() const { return _used == 0; }
+    bool full() const { return _used == _size; }
+
+private:
+    std::unique_ptr<std::byte[]> _data;
+    size_t _size = 0;
+    size_t _readPos = 0;
+    size_t _used = 0;
+};
+
+// Process wide pool of fixed size slabs backing the forwarder buffers.
+// Slabs are only borrowed while data is buffered, so idle connections hold (almost) no buffer memory. The total of
+// borrowed slabs is capped by limit(), a SlabBuffer that can't get a slab reports itself as full until other
+// connections returned some.
+class BufferPool {
+public:
+    static constexpr size_t slabSize = 16*1024;
+
+    static BufferPool &instance();
+
+    // returns nullptr when the limit is reached
+    std::byte *acquire();
+    void release(std::byte *slab);
+    bool available() const { return _inUse < _maxSlabs; }
+
+    void setLimit(size_t bytes);
+    size_t limit() const { return _maxSlabs * slabSize; }
+
+    size_t slabsInUse() const { return _inUse; }
+    size_t peakSlabsInUse() const { return _peakInUse; }
+    size_t slabsCached() const { return _cached.size(); }
+    size_t deniedAcquires() const { return _denied; }
+
+    // logged at exit once slabs were used
+    void logStats() const;
+
+private:
+    BufferPool() = default;
+    ~BufferPool();
+
+    // released slabs kept for reuse instead of going back to the allocator
+    static constexpr size_t _maxCachedSlabs = 256;
+
+    size_t _maxSlabs = 256*1024*1024 / slabSize;
+    std::vector<std::byte*> _cached;
+    size_t _inUse = 0;
+    size_t _peakInUse = 0;
+    size_t _denied = 0;
+    bool _statsScheduled = false;
+};
+
+// Byte FIFO with the same producer/consumer interface as RingBuffer, but made of slabs borrowed from BufferPool up
+// to a capacity. Slabs are returned once they are fully consumed, and by trim() when the buffer is empty.
+// A region returned by writable() stays valid until it is committed, even if everything before it is consumed, so a
+// read can be in flight while the consumer drains the buffer.
+class SlabBuffer {
+public:
+    explicit SlabBuffer(size_t capacity);
+    ~SlabBuffer();
+
+    SlabBuffer(const SlabBuffer&) = delete;
+    SlabBuffer &operator=(const SlabBuffer&) = delete;
+
+    std::pair<std::byte*, size_t> readable();
+    std::pair<std::byte*, size_t> writable();
+
+    // Fills up to maxIov iovecs covering at most maxBytes of readable data, returns the number of iovecs used.
+    int readableIov(struct iovec *iov, int maxIov, size_t maxBytes);
+
+    void commit(size_t len);
+    void consume(size_t len);
+
+    // Returns all slabs to the pool if the buffer is empty. Only call when no region from writable() is in use.
+    void trim();
+
+    // a smaller capacity than used() takes effect once enough data was consumed
+    void setCapacity(size_t capacity) { _capacity = capacity; }
+    size_t capacity() const { return _capacity; }
+    size_t used() const { return _used; }
+    bool empty() const { return _used == 0; }
+    // also true while the pool can't provide another slab
+    bool full() const;
+
+private:
+    size_t _capacity = 0;
+    std::deque<std::byte*> _slabs;
+    // offset in the first slab
+    size_t _readPos = 0;
+    // offset in the last slab
+    size_t _writePos = 0;
+    size_t _used = 0;
+};
+
+// Buffer sizes used for new and running connections. Fixed by peersock.conf or adjusted by BufferAutotuner.
+struct BufferSizes {
+    // capacity of the forwarder buffers of each bridged connection
+    size_t localToQuic = 1024*1024;
+    size_t quicToLocal = 2*1024*1024;
+    // bytes of received datagrams queued between ICE and QUIC until QUIC reads them
+    size_t datagram = 1024*1024;
+};
+
+extern BufferSizes bufferSizes;
+
+// Limits for coalescing data of several QUIC reads into one vectored local write.
+struct WriteBatchLimits {
+    // upper bound for the bytes passed to one write
+    size_t maxBytes = 256*1024;
+    // how long a batch smaller than maxBytes is held back waiting for more data, 0 writes right away
+    std::chrono::milliseconds maxDelay{0};
+};
+
+extern WriteBatchLimits writeBatchLimits;
+
+// Counts forwarded bytes of one direction and logs the achieved rate, used to compare forwarder changes.
+class ThroughputCounter {
+public:
+    void add(size_t bytes);
+    void logSummary(std::string_view direction) const;
+
+private:
+    size_t _bytes = 0;
+    std::chrono::steady_clock::time_point _start;
+    std::chrono::steady_clock::time_point _last;
+};
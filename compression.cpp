@@ -0,0 +1,172 @@
+#include "compression.h"
+
+#include <algorithm>
+
+#ifdef PEERSOCK_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "utils.h"
+
+
+bool streamCompression = false;
+CompressionStats compressionStats;
+
+bool compressionAvailable() {
+#ifdef PEERSOCK_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+void CompressionStats::logSummary() const {
+    if (!input) {
+        return;
+    }
+    log(LOG_FWD, "compression: {} bytes sent as {} bytes ({:.1f}%), {} chunks compressed, {} sent raw\n",
+        input, output, output * 100.0 / input, compressedChunks, rawChunks);
+}
+
+#ifdef PEERSOCK_HAVE_ZSTD
+
+static constexpr size_t frameHeaderSize = 4;
+
+static void writeFrameHeader(char *header, char type, size_t len) {
+    header[0] = type;
+    header[1] = (char)(len >> 16);
+    header[2] = (char)(len >> 8);
+    header[3] = (char)len;
+}
+
+StreamCompressor::StreamCompressor() {
+    _ctx = ZSTD_createCCtx();
+    if (!_ctx) {
+        fatal("ZSTD_createCCtx failed\n");
+    }
+    // favor speed, the point is to save bandwidth on slow paths without becoming the bottleneck on fast ones
+    ZSTD_CCtx_setParameter(_ctx, ZSTD_c_compressionLevel, 1);
+}
+
+StreamCompressor::~StreamCompressor() {
+    ZSTD_freeCCtx(_ctx);
+}
+
+void StreamCompressor::compress(const void *data, size_t len, std::string &out) {
+    if (len > maxCompressionChunk) {
+        fatal("compression chunk too large: {}\n", len);
+    }
+    size_t start = out.size();
+
+    if (_skip) {
+        --_skip;
+    } else {
+        out.resize(start + frameHeaderSize + ZSTD_compressBound(len));
+        size_t compressed = ZSTD_compress2(_ctx, out.data() + start + frameHeaderSize, ZSTD_compressBound(len),
+                                           data, len);
+        if (ZSTD_isError(compressed)) {
+            fatal("ZSTD_compress2 failed: {}\n", ZSTD_getErrorName(compressed));
+        }
+        // less than 1/16 saved is not worth the cpu time on the other side
+        if (compressed < len - len / 16) {
+            _backoff = 0;
+            writeFrameHeader(out.data() + start, 'z', compressed);
+            out.resize(start + frameHeaderSize + compressed);
+            ++compressionStats.compressedChunks;
+        } else {
+            out.resize(start);
+            _backoff = std::min(std::max(_backoff * 2, 1u), _maxBackoff);
+            _skip = _backoff;
+        }
+    }
+
+    if (out.size() == start) {
+        out.resize(start + frameHeaderSize);
+        writeFrameHeader(out.data() + start, 'r', len);
+        out.append((const char*)data, len);
+        ++compressionStats.rawChunks;
+    }
+
+    _input += len;
+    _output += out.size() - start;
+    compressionStats.input += len;
+    compressionStats.output += out.size() - start;
+}
+
+StreamDecompressor::StreamDecompressor() {
+    _ctx = ZSTD_createDCtx();
+    if (!_ctx) {
+        fatal("ZSTD_createDCtx failed\n");
+    }
+}
+
+StreamDecompressor::~StreamDecompressor() {
+    ZSTD_freeDCtx(_ctx);
+}
+
+bool StreamDecompressor::decompress(const void *data, size_t len, std::string &out) {
+    _pending.append((const char*)data, len);
+
+    size_t offset = 0;
+    while (_pending.size() - offset >= frameHeaderSize) {
+        const unsigned char *header = (const unsigned char*)_pending.data() + offset;
+        size_t frameLen = header[1] << 16 | header[2] << 8 | header[3];
+        if (frameLen > ZSTD_compressBound(maxCompressionChunk)) {
+            log(LOG_FWD, "compressed stream: frame too large: {}\n", frameLen);
+            return false;
+        }
+        if (_pending.size() - offset - frameHeaderSize < frameLen) {
+            break;
+        }
+        const char *payload = _pending.data() + offset + frameHeaderSize;
+
+        if (header[0] == 'r') {
+            out.append(payload, frameLen);
+        } else if (header[0] == 'z') {
+            unsigned long long contentSize = ZSTD_getFrameContentSize(payload, frameLen);
+            if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR
+                    || contentSize > maxCompressionChunk) {
+                log(LOG_FWD, "compressed stream: bad frame content size\n");
+                return false;
+            }
+            size_t outStart = out.size();
+            out.resize(outStart + contentSize);
+            size_t result = ZSTD_decompressDCtx(_ctx, out.data() + outStart, contentSize, payload, frameLen);
+            if (ZSTD_isError(result) || result != contentSize) {
+                log(LOG_FWD, "compressed stream: decompression failed\n");
+                return false;
+            }
+        } else {
+            log(LOG_FWD, "compressed stream: unknown frame type {}\n", header[0]);
+            return false;
+        }
+        offset += frameHeaderSize + frameLen;
+    }
+    _pending.erase(0, offset);
+    return true;
+}
+
+#else
+
+StreamCompressor::StreamCompressor() {
+    fatal("Built without compression support\n");
+}
+
+StreamCompressor::~StreamCompressor() {
+}
+
+void StreamCompressor::compress(const void *data, size_t len, std::string &out) {
+}
+
+StreamDecompressor::StreamDecompressor() {
+    fatal("Built without compression support\n");
+}
+
+StreamDecompressor::~StreamDecompressor() {
+}
+
+bool StreamDecompressor::decompress(const void *data, size_t len, std::string &out) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+// Set during rendezvous if compression is enabled on both sides, applies to all payload streams of the connection.
+extern bool streamCompression;
+
+// false if built without zstd
+bool compressionAvailable();
+
+// Totals over all compressed streams of this side.
+struct CompressionStats {
+    // payload bytes passed to compressors
+    uint64_t input = 0;
+    // bytes written to streams, including frame headers
+    uint64_t output = 0;
+    uint64_t compressedChunks = 0;
+    uint64_t rawChunks = 0;
+
+    void logSummary() const;
+};
+
+extern CompressionStats compressionStats;
+
+// Compressed streams carry a sequence of frames: a type byte ('r' raw, 'z' zstd) and the 24 bit big endian length
+// of the frame payload. Each 'z' frame is an independent zstd frame, so any chunk can be sent raw instead.
+// The compressor and decompressor can only be created if compressionAvailable().
+static constexpr size_t maxCompressionChunk = 64*1024;
+
+class StreamCompressor {
+public:
+    StreamCompressor();
+    ~StreamCompressor();
+
+    StreamCompressor(const StreamCompressor&) = delete;
+    StreamCompressor &operator=(const StreamCompressor&) = delete;
+
+    // Appends the frame for len (at most maxCompressionChunk) bytes of data to out. If a chunk doesn't compress it
+    // is sent raw and the following chunks are sent raw without trying, for twice as many chunks each time.
+    void compress(const void *data, size_t len, std::string &out);
+
+    int64_t saved() const { return (int64_t)_input - (int64_t)_output; }
+
+private:
+    static constexpr unsigned _maxBackoff = 64;
+
+    ZSTD_CCtx_s *_ctx = nullptr;
+    unsigned _skip = 0;
+    unsigned _backoff = 0;
+    uint64_t _input = 0;
+    uint64_t _output = 0;
+};
+
+class StreamDecompressor {
+public:
+    StreamDecompressor();
+    ~StreamDecompressor();
+
+    StreamDecompressor(const StreamDecompressor&) = delete;
+    StreamDecompressor &operator=(const StreamDecompressor&) = delete;
+
+    // Takes len bytes of stream data and appends the payload of all completed frames to out.
+    // Returns false if the data is not a valid frame sequence.
+    bool decompress(const void *data, size_t len, std::string &out);
+
+    // true if a frame is incomplete
+    bool pending() const { return !_pending.empty(); }
+
+private:
+    ZSTD_DCtx_s *_ctx = nullptr;
+    std::string _pending;
+};
@@ -0,0 +1,215 @@
+#include "control.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <openssl/err.h>
+
+#include "utils.h"
+
+
+static constexpr char pingType = 'P';
+static constexpr char pongType = 'p';
+static constexpr char statsType = 'S';
+static constexpr size_t pingSize = 13;
+static constexpr size_t statsSize = 33;
+
+static void write32(std::string &out, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+        out.push_back((char)(value >> (i * 8)));
+    }
+}
+
+static void write64(std::string &out, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        out.push_back((char)(value >> (i * 8)));
+    }
+}
+
+static uint64_t read64(const unsigned char *in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+ControlChannel &ControlChannel::instance() {
+    static ControlChannel channel;
+    return channel;
+}
+
+void ControlChannel::start(SSL *stream, std::function<void()> tick) {
+    if (_stream) {
+        return;
+    }
+    _stream = stream;
+    _tick = tick;
+    // messages held back by flow control are written by the next poll
+    SSL_set_mode(_stream, SSL_MODE_ENABLE_PARTIAL_WRITE);
+    log(LOG_QUIC, "control: started\n");
+    _lastPong = g_get_monotonic_time();
+    _timer = g_timeout_add(_pingIntervalMs, wrap_tick, this);
+    atexit([] {
+        instance().exportStats();
+    });
+    // also opens the stream on the other side if this side opened it
+    ping();
+}
+
+void ControlChannel::pathChanged() {
+    _srtt = -1;
+    _minRtt = -1;
+    _lastRtt = -1;
+    _jitter = 0;
+    resetStall();
+}
+
+void ControlChannel::stop() {
+    if (_timer) {
+        g_source_remove(_timer);
+        _timer = 0;
+    }
+}
+
+gboolean ControlChannel::wrap_tick(gpointer user_data) {
+    ControlChannel *that = reinterpret_cast<ControlChannel*>(user_data);
+    that->ping();
+    that->_tick();
+    if (that->_onStall && g_get_monotonic_time() - that->_lastPong > _stallUs) {
+        that->_onStall();
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+void ControlChannel::ping() {
+    std::string ping(1, pingType);
+    write32(ping, ++_pingSeq);
+    write64(ping, g_get_monotonic_time());
+    send(ping);
+
+    if (++_ticks % _statsInterval == 0) {
+        std::string stats(1, statsType);
+        write64(stats, _sentBytes);
+        write64(stats, _receivedBytes);
+        write64(stats, _sentDatagrams);
+        write64(stats, _receivedDatagrams);
+        send(stats);
+    }
+}
+
+void ControlChannel::send(const std::string &message) {
+    _pending.push_back((char)(message.size() >> 8));
+    _pending.push_back((char)message.size());
+    _pending += message;
+    flush();
+}
+
+void ControlChannel::flush() {
+    while (!_pending.empty()) {
+        size_t written = 0;
+        if (!SSL_write_ex(_stream, _pending.data(), _pending.size(), &written)) {
+            // blocked by flow control or the connection is shutting down, the next poll retries
+            ERR_clear_error();
+            return;
+        }
+        _pending.erase(0, written);
+    }
+}
+
+void ControlChannel::poll() {
+    if (!_stream) {
+        return;
+    }
+    bool gotMessage;
+    do {
+        gotMessage = false;
+        quicReadFramedMessageOrDie(_stream, _readBuffer, [&] (unsigned char *message, ssize_t len) {
+            gotMessage = true;
+            handleMessage(message, len);
+        });
+    } while (gotMessage);
+    flush();
+}
+
+void ControlChannel::handleMessage(const unsigned char *message, size_t len) {
+    if (!len) {
+        return;
+    }
+    if (message[0] == pingType && len == pingSize) {
+        std::string pong((const char*)message, len);
+        pong[0] = pongType;
+        send(pong);
+    } else if (message[0] == pongType && len == pingSize) {
+        handlePong(read64(message + 5));
+    } else if (message[0] == statsType && len == statsSize) {
+        _peerSentBytes = read64(message + 1);
+        _peerReceivedBytes = read64(message + 9);
+        _peerSentDatagrams = read64(message + 17);
+        _peerReceivedDatagrams = read64(message + 25);
+        _peerStats = true;
+        exportStats();
+    } else {
+        // later versions may add message types
+        log(LOG_QUIC, "control: ignoring message of type {} with {} bytes\n", (int)message[0], len);
+    }
+}
+
+void ControlChannel::handlePong(uint64_t sentTime) {
+    gint64 now = g_get_monotonic_time();
+    if ((gint64)sentTime > now) {
+        return;
+    }
+    double rtt = (double)(now - (gint64)sentTime);
+    if (_srtt < 0) {
+        _srtt = rtt;
+        _minRtt = rtt;
+    } else {
+        _srtt = _srtt * 7 / 8 + rtt / 8;
+        _minRtt = std::min(_minRtt, rtt);
+        // interarrival jitter as in RFC 3550, from the difference of consecutive round trips
+        _jitter += (std::fabs(rtt - _lastRtt) - _jitter) / 16;
+    }
+    _lastRtt = rtt;
+    _lastPong = now;
+    _pongs++;
+}
+
+void ControlChannel::exportStats() const {
+    if (!_stream) {
+        return;
+    }
+    uint64_t rtt = _srtt < 0 ? 0 : (uint64_t)_srtt;
+    uint64_t minRtt = _minRtt < 0 ? 0 : (uint64_t)_minRtt;
+    std::string text = fmt::format("link: rtt {}us (min {}us, jitter {}us), sent {} datagrams ({} bytes), "
+                                   "received {} datagrams ({} bytes)\n",
+                                   rtt, minRtt, (uint64_t)_jitter, _sentDatagrams, _sentBytes, _receivedDatagrams,
+                                   _receivedBytes);
+    if (_peerStats) {
+        text += fmt::format("link: other side sent {} datagrams ({} bytes), received {} datagrams ({} bytes)\n",
+                            _peerSentDatagrams, _peerSentBytes, _peerReceivedDatagrams, _peerReceivedBytes);
+    }
+
+    if (peersockJsonOutputMode) {
+        nlohmann::json event = {
+            {"event", "link-stats"},
+            {"rtt_us", rtt},
+            {"min_rtt_us", minRtt},
+            {"jitter_us", (uint64_t)_jitter},
+            {"pongs", _pongs},
+            {"sent_datagrams", _sentDatagrams},
+            {"sent_bytes", _sentBytes},
+            {"received_datagrams", _receivedDatagrams},
+            {"received_bytes", _receivedBytes},
+        };
+        if (_peerStats) {
+            event["peer_sent_datagrams"] = _peerSentDatagrams;
+            event["peer_sent_bytes"] = _peerSentBytes;
+            event["peer_received_datagrams"] = _peerReceivedDatagrams;
+            event["peer_received_bytes"] = _peerReceivedBytes;
+        }
+        writeUserMessage(event, "{}", text);
+    } else {
+        log(LOG_QUIC, "{}", text);
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <openssl/ssl.h>
+
+#include <glib.h>
+
+// Control protocol on stream 0 if both sides support it, in place of the plain keepalive bytes. Messages use the
+// framing of the auth stream, a 16 bit big endian length followed by the message, which starts with a type byte:
+//   'P' seq(32) time(64)        ping, time is the sender's monotonic clock in microseconds
+//   'p' seq(32) time(64)        pong, echoes a ping
+//   'S' sent(64) received(64) sentDatagrams(64) receivedDatagrams(64)
+//                               totals of the sender on the ICE path
+// Both sides ping every second, which also keeps the path warm, and send their totals every 5 seconds. RTT, jitter
+// and the totals of both sides are logged when the totals of the other side arrive, as link-stats event in json mode.
+class ControlChannel {
+public:
+    static ControlChannel &instance();
+
+    // stream 0, opened by the code side, the first ping opens it on the other side. tick is called after messages
+    // were queued from the timer.
+    void start(SSL *stream, std::function<void()> tick);
+    bool started() const { return _stream != nullptr; }
+    // ends the pings when the connection shuts down
+    void stop();
+    // called every second while no pong arrived for 3 seconds
+    void setStallHandler(std::function<void()> handler) { _onStall = handler; }
+    // gives pongs on a new path time to arrive
+    void resetStall() { _lastPong = g_get_monotonic_time(); }
+    // the round trip times start over on the new path
+    void pathChanged();
+
+    // smoothed round trip time in microseconds, 0 before the first pong
+    uint64_t smoothedRtt() const { return _srtt < 0 ? 0 : (uint64_t)_srtt; }
+
+    // reads and answers messages, writes what flow control held back
+    void poll();
+
+    void countSent(size_t bytes, size_t datagrams) { _sentBytes += bytes; _sentDatagrams += datagrams; }
+    void countReceived(size_t bytes) { _receivedBytes += bytes; _receivedDatagrams++; }
+
+    // logs the current picture, as link-stats event in json mode
+    void exportStats() const;
+
+private:
+    ControlChannel() = default;
+
+    static gboolean wrap_tick(gpointer user_data);
+    // sends a ping and every few seconds the totals
+    void ping();
+    void send(const std::string &message);
+    void flush();
+    void handleMessage(const unsigned char *message, size_t len);
+    void handlePong(uint64_t sentTime);
+
+    static constexpr guint _pingIntervalMs = 1000;
+    static constexpr int _statsInterval = 5;
+    static constexpr gint64 _stallUs = 3 * G_USEC_PER_SEC;
+
+    SSL *_stream = nullptr;
+    std::function<void()> _tick;
+    std::function<void()> _onStall;
+    guint _timer = 0;
+    std::string _readBuffer;
+    // framed messages not yet accepted by the stream
+    std::string _pending;
+    uint32_t _pingSeq = 0;
+    int _ticks = 0;
+
+    uint64_t _sentBytes = 0;
+    uint64_t _receivedBytes = 0;
+    uint64_t _sentDatagrams = 0;
+    uint64_t _receivedDatagrams = 0;
+
+    // round trip times in microseconds, -1 before the first pong
+    double _srtt = -1;
+    double _minRtt = -1;
+    double _jitter = 0;
+    double _lastRtt = -1;
+    uint64_t _pongs = 0;
+    // monotonic time of the last pong, or of the start before the first
+    gint64 _lastPong = 0;
+
+    bool _peerStats = false;
+    uint64_t _peerSentBytes = 0;
+    uint64_t _peerReceivedBytes = 0;
+    uint64_t _peerSentDatagrams = 0;
+    uint64_t _peerReceivedDatagrams = 0;
+};
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <charconv>
+#include <string_view>
 
 #include <glib.h>
 
@@ -7,6 +9,7 @@
 #include "utils.h"
 
 using namespace std::string_literals;
+using namespace std::string_view_literals;
 
 
 void applyConfig(PeersockConfig &config) {
@@ -118,6 +121,158 @@ void applyConfig(PeersockConfig &config) {
     } else if (config.turnPassword.empty() && turnPassword && *turnPassword) {
         config.turnPassword = turnPassword;
     }
+
+    guint64 size = g_key_file_get_uint64(configFile, "buffers", "forwarder", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting forwarder buffer size from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (!config.forwarderBufferSize && size) {
+        config.forwarderBufferSize = size;
+    }
+
+    size = g_key_file_get_uint64(configFile, "buffers", "datagram", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting datagram buffer size from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (!config.datagramBufferSize && size) {
+        config.datagramBufferSize = size;
+    }
+
+    tmp = g_key_file_get_integer(configFile, "quic", "keepalive", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting keepalive from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else {
+        if (!config.keepaliveInterval) {
+            config.keepaliveInterval = tmp;
+        }
+    }
+
+    bool multipath = g_key_file_get_boolean(configFile, "ice", "multipath", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting multipath from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (multipath) {
+        config.multipath = true;
+    }
+
+    bool pmtud = g_key_file_get_boolean(configFile, "ice", "pmtud", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting pmtud from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (pmtud) {
+        config.pathMtuDiscovery = true;
+    }
+
+    bool threads = g_key_file_get_boolean(configFile, "quic", "threads", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting threads from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (threads) {
+        config.quicThread = true;
+    }
+
+    bool resume = g_key_file_get_boolean(configFile, "quic", "resume", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting resume from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (resume) {
+        config.resumeSessions = true;
+    }
+
+    guint64 parallel = g_key_file_get_uint64(configFile, "quic", "parallel", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting parallel from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (config.parallelConnections == 1 && parallel > 1) {
+        config.parallelConnections = std::min<guint64>(parallel, maxParallelConnections);
+    }
+
+    bool autotune = g_key_file_get_boolean(configFile, "buffers", "autotune", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting autotune from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (autotune) {
+        config.autotuneBuffers = true;
+    }
+
+    bool compress = g_key_file_get_boolean(configFile, "streams", "compress", &error);
+
+    if (error) {
+        if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+            && !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+
+            g_printerr("error getting compress from config: %s\n", error->message);
+            return;
+        } else {
+            g_clear_error(&error);
+        }
+    } else if (compress) {
+        config.compressStreams = true;
+    }
 }
 
 int main(int argc, char **argv) {
@@ -173,10 +328,97 @@ int main(int argc, char **argv) {
     std::unique_ptr<ModeBase> mode;
 
     std::vector<std::string> remainingArgs;
+    bool autotune = false;
+    bool compress = false;
+    bool threads = false;
+    bool multipath = false;
+    bool pmtud = false;
+    bool resume = false;
+    unsigned parallel = 1;
+    std::optional<unsigned> socketMode;
+    bool allowRemoteBind = false;
+    std::vector<ForwardSpec> forwardSpecs;
 
     for (int i = 1; i < argc; i++) {
         if (argv[i] == "--json"s) {
             setJsonOutputMode(true);
+        } else if (argv[i] == "--autotune"s) {
+            autotune = true;
+        } else if (argv[i] == "--threads"s) {
+            threads = true;
+        } else if (argv[i] == "--multipath"s) {
+            multipath = true;
+        } else if (argv[i] == "--pmtud"s) {
+            pmtud = true;
+        } else if (argv[i] == "--allow-remote-bind"s) {
+            allowRemoteBind = true;
+        } else if (argv[i] == "--resume"s) {
+            resume = true;
+        } else if (argv[i] == "--compress"s) {
+            if (!compressionAvailable()) {
+                fatal("--compress needs a build with zstd\n");
+            }
+            compress = true;
+        } else if (argv[i] == "--profile=standard"s) {
+            trafficProfile = TrafficProfile::standard;
+        } else if (argv[i] == "--profile=interactive"s) {
+            trafficProfile = TrafficProfile::interactive;
+        } else if (argv[i] == "--profile=bulk"s) {
+            trafficProfile = TrafficProfile::bulk;
+        } else if (argv[i] == "--profile=auto"s) {
+            trafficProfile = TrafficProfile::automatic;
+        } else if (argv[i] == "--forwarder=gio"s) {
+            forwarderBackend = ForwarderBackend::gio;
+        } else if (argv[i] == "--forwarder=native"s) {
+            forwarderBackend = ForwarderBackend::native;
+        } else if (argv[i] == "--forwarder=uring"s) {
+            forwarderBackend = ForwarderBackend::uring;
+        } else if (std::string_view(argv[i]).substr(0, 14) == "--batch-bytes="sv) {
+            std::string_view arg = std::string_view(argv[i]).substr(14);
+            size_t bytes = 0;
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), bytes);
+            if (ec != std::errc{} || ptr != arg.data() + arg.size() || !bytes) {
+                fatal("Can't parse batch size '{}'\n", arg);
+            }
+            writeBatchLimits.maxBytes = bytes;
+        } else if (std::string_view(argv[i]).substr(0, 14) == "--batch-delay="sv) {
+            std::string_view arg = std::string_view(argv[i]).substr(14);
+            unsigned int milliSeconds = 0;
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), milliSeconds);
+            if (ec != std::errc{} || ptr != arg.data() + arg.size()) {
+                fatal("Can't parse batch delay '{}'\n", arg);
+            }
+            writeBatchLimits.maxDelay = std::chrono::milliseconds(milliSeconds);
+        } else if (std::string_view(argv[i]).substr(0, 11) == "--parallel="sv) {
+            std::string_view arg = std::string_view(argv[i]).substr(11);
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), parallel);
+            if (ec != std::errc{} || ptr != arg.data() + arg.size() || !parallel || parallel > maxParallelConnections) {
+                fatal("Can't parse parallel connections '{}', expected 1 to {}\n", arg, maxParallelConnections);
+            }
+        } else if (std::string_view(argv[i]).substr(0, 14) == "--socket-mode="sv) {
+            std::string_view arg = std::string_view(argv[i]).substr(14);
+            unsigned mode = 0;
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), mode, 8);
+            if (ec != std::errc{} || ptr != arg.data() + arg.size() || mode > 0777) {
+                fatal("Can't parse socket mode '{}'\n", arg);
+            }
+            socketMode = mode;
+        } else if (std::string_view(argv[i]).substr(0, 15) == "--buffer-limit="sv) {
+            std::string_view arg = std::string_view(argv[i]).substr(15);
+            size_t mebiBytes = 0;
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), mebiBytes);
+            if (ec != std::errc{} || ptr != arg.data() + arg.size() || !mebiBytes) {
+                fatal("Can't parse buffer limit '{}'\n", arg);
+            }
+            BufferPool::instance().setLimit(mebiBytes * 1024 * 1024);
+        } else if ((argv[i] == "-L"s || argv[i] == "-R"s) && i + 1 < argc) {
+            bool remote = argv[i] == "-R"s;
+            i++;
+            std::optional<ForwardSpec> spec = parseForwardSpec(remote, argv[i]);
+            if (!spec) {
+                fatal("Can't parse forwarding '{}', expected [bind:]port:host:hostport\n", argv[i]);
+            }
+            forwardSpecs.push_back(*spec);
         } else {
             remainingArgs.push_back(std::string(argv[i]));
         }
@@ -207,11 +449,76 @@ int main(int argc, char **argv) {
 
             std::string arg = remainingArgs[1];
 
-            mode = std::make_unique<ConnectMode>(arg);
+            GError *error = nullptr;
+            GSocketConnectable *target = g_network_address_parse(arg.data(), 443, &error);
+            if (!target) {
+                fatal("Can't parse host and port '{}': {}\n", arg, error->message);
+            }
+            mode = std::make_unique<ConnectMode>(target);
+
+            if (remainingArgs.size() == 3) {
+                code = remainingArgs[2];
+            }
+        } else if (command == "unix-listen"s && (remainingArgs.size() == 2 || remainingArgs.size() == 3)) {
+            ok = true;
+            mode = std::make_unique<ListenMode>(unixSocketAddress(remainingArgs[1]), socketMode);
+
+            if (remainingArgs.size() == 3) {
+                code = remainingArgs[2];
+            }
+        } else if (command == "unix-connect"s && (remainingArgs.size() == 2 || remainingArgs.size() == 3)) {
+            ok = true;
+            mode = std::make_unique<ConnectMode>(G_SOCKET_CONNECTABLE(unixSocketAddress(remainingArgs[1])));
+
+            if (remainingArgs.size() == 3) {
+                code = remainingArgs[2];
+            }
+        } else if (command == "udp-listen"s && (remainingArgs.size() == 2 || remainingArgs.size() == 3)) {
+            uint16_t port;
+
+            std::string arg = remainingArgs[1];
+
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), port);
+            if (ec == std::errc{}) {
+                ok = true;
+                mode = std::make_unique<UdpListenMode>(port);
+            } else {
+                fatal("Can't parse port '{}'\n", arg);
+            }
 
             if (remainingArgs.size() == 3) {
                 code = remainingArgs[2];
             }
+        } else if (command == "udp-connect"s && (remainingArgs.size() == 2 || remainingArgs.size() == 3)) {
+            ok = true;
+
+            std::string arg = remainingArgs[1];
+
+            GError *error = nullptr;
+            GSocketConnectable *target = g_network_address_parse(arg.data(), 443, &error);
+            if (!target) {
+                fatal("Can't parse host and port '{}': {}\n", arg, error->message);
+            }
+            mode = std::make_unique<UdpConnectMode>(target);
+
+            if (remainingArgs.size() == 3) {
+                code = remainingArgs[2];
+            }
+        } else if (command == "socks"s && (remainingArgs.size() == 2 || remainingArgs.size() == 3)) {
+            ok = true;
+            mode = std::make_unique<SocksMode>(remainingArgs[1]);
+
+            if (remainingArgs.size() == 3) {
+                code = remainingArgs[2];
+            }
+        } else if (command == "forward"s && (remainingArgs.size() == 1 || remainingArgs.size() == 2)) {
+            ok = true;
+            mode = std::make_unique<ForwardMode>(forwardSpecs, allowRemoteBind);
+            forwardSpecs.clear();
+
+            if (remainingArgs.size() == 2) {
+                code = remainingArgs[1];
+            }
         } else if (command == "stdio-a"s && (remainingArgs.size() == 1 || remainingArgs.size() == 2)) {
             ok = true;
             mode = std::make_unique<StdioModeA>();
@@ -228,6 +535,10 @@ int main(int argc, char **argv) {
             }
         }
 
+        if (forwardSpecs.size()) {
+            fatal("-L and -R can only be used with forward\n");
+        }
+
         if (code.size()) {
             if (std::string(code).find_first_of('-') == std::string::npos) {
                 fatal("Code format invalid\n");
@@ -238,8 +549,18 @@ int main(int argc, char **argv) {
     if (!ok) {
         fmt::print(stderr, "Usage: {} listen port [connect code]\n", argv[0]);
         fmt::print(stderr, "       {} connect host:port [connect code]\n", argv[0]);
+        fmt::print(stderr, "       {} unix-listen path [connect code]\n", argv[0]);
+        fmt::print(stderr, "       {} unix-connect path [connect code]\n", argv[0]);
+        fmt::print(stderr, "       {} udp-listen port [connect code]\n", argv[0]);
+        fmt::print(stderr, "       {} udp-connect host:port [connect code]\n", argv[0]);
+        fmt::print(stderr, "       {} forward [-L [bind:]port:host:hostport]... [-R [bind:]port:host:hostport]... [connect code]\n", argv[0]);
+        fmt::print(stderr, "       {} socks [bind:]port [connect code]\n", argv[0]);
         fmt::print(stderr, "       {} stdio-a [connect code]\n", argv[0]);
         fmt::print(stderr, "       {} stdio-b [connect code]\n", argv[0]);
+        fmt::print(stderr, "Options: --json --autotune --compress --threads --multipath --pmtud --forwarder=gio|native|uring\n");
+        fmt::print(stderr, "         --profile=standard|interactive|bulk|auto\n");
+        fmt::print(stderr, "         --batch-bytes=N --batch-delay=MS --buffer-limit=MIB --socket-mode=OCTAL\n");
+        fmt::print(stderr, "         --parallel=N --resume --allow-remote-bind\n");
         return 1;
     }
 
@@ -247,6 +568,13 @@ int main(int argc, char **argv) {
 
 
     PeersockConfig config;
+    config.autotuneBuffers = autotune;
+    config.compressStreams = compress;
+    config.quicThread = threads;
+    config.multipath = multipath;
+    config.pathMtuDiscovery = pmtud;
+    config.resumeSessions = resume;
+    config.parallelConnections = parallel;
     applyConfig(config);
 
     if (code.size()) {
@@ -1,271 +1,2341 @@
 #include "modes.h"
 
+#include <algorithm>
+#include <charconv>
+#include <tuple>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
 #include <glib.h>
+#include <glib-unix.h>
 #include <gio/gunixoutputstream.h>
 #include <gio/gunixinputstream.h>
+#include <gio/gunixsocketaddress.h>
+
+#include "utils.h"
+
+using namespace std::string_view_literals;
+
+ForwarderBackend forwarderBackend = ForwarderBackend::gio;
+TrafficProfile trafficProfile = TrafficProfile::standard;
+
+WriteBatchTimer::WriteBatchTimer(std::function<void()> flush) : _flush(flush) {
+}
+
+WriteBatchTimer::~WriteBatchTimer() {
+    if (_timer) {
+        g_source_remove(_timer);
+    }
+}
+
+bool WriteBatchTimer::hold(size_t buffered, bool more, const WriteBatchLimits &limits) {
+    if (_due || !more || !limits.maxDelay.count() || buffered >= limits.maxBytes) {
+        if (_timer) {
+            g_source_remove(_timer);
+            _timer = 0;
+        }
+        _due = false;
+        return false;
+    }
+    if (!_timer) {
+        _timer = g_timeout_add(limits.maxDelay.count(), wrap_timeout, this);
+    }
+    return true;
+}
+
+gboolean WriteBatchTimer::wrap_timeout(gpointer user_data) {
+    auto that = reinterpret_cast<WriteBatchTimer*>(user_data);
+    that->_timer = 0;
+    that->_due = true;
+    that->_flush();
+    return G_SOURCE_REMOVE;
+}
+
+ConnectionProfile::ConnectionProfile(TrafficProfile profile)
+    : _profile(profile), _current(profile == TrafficProfile::automatic ? TrafficProfile::interactive : profile) {
+}
+
+void ConnectionProfile::setSocket(GSocket *socket) {
+    GSocketFamily family = g_socket_get_family(socket);
+    if (g_socket_get_socket_type(socket) != G_SOCKET_TYPE_STREAM
+            || (family != G_SOCKET_FAMILY_IPV4 && family != G_SOCKET_FAMILY_IPV6)) {
+        return;
+    }
+    _tcpFd = g_socket_get_fd(socket);
+    applySocketOptions();
+}
+
+size_t ConnectionProfile::localToQuic() const {
+    if (_current == TrafficProfile::interactive) {
+        return std::min(bufferSizes.localToQuic, _interactiveBufferSize);
+    } else if (_current == TrafficProfile::bulk) {
+        return std::max(bufferSizes.localToQuic, _bulkBufferSize);
+    }
+    return bufferSizes.localToQuic;
+}
+
+size_t ConnectionProfile::quicToLocal() const {
+    if (_current == TrafficProfile::interactive) {
+        return std::min(bufferSizes.quicToLocal, _interactiveBufferSize);
+    } else if (_current == TrafficProfile::bulk) {
+        return std::max(bufferSizes.quicToLocal, _bulkBufferSize);
+    }
+    return bufferSizes.quicToLocal;
+}
+
+WriteBatchLimits ConnectionProfile::batchLimits() const {
+    WriteBatchLimits limits = writeBatchLimits;
+    if (_current == TrafficProfile::interactive) {
+        limits.maxDelay = std::chrono::milliseconds(0);
+    } else if (_current == TrafficProfile::bulk) {
+        limits.maxBytes = std::max(limits.maxBytes, size_t(1024*1024));
+        if (!limits.maxDelay.count()) {
+            limits.maxDelay = std::chrono::milliseconds(2);
+        }
+    }
+    return limits;
+}
+
+void ConnectionProfile::observeRead(size_t bytes, size_t offered) {
+    if (_profile != TrafficProfile::automatic) {
+        return;
+    }
+    // a read that fills all offered space was limited by the buffer, not by the sender
+    if (bytes >= _largeRead || (bytes == offered && bytes >= _smallRead)) {
+        _smallReads = 0;
+        ++_largeReads;
+    } else if (bytes < _smallRead) {
+        _largeReads = 0;
+        ++_smallReads;
+    } else {
+        return;
+    }
+
+    if (_current == TrafficProfile::interactive && _largeReads >= _readsToSwitch) {
+        log(LOG_FWD, "Connection looks like bulk transfer, switching profile\n");
+        _current = TrafficProfile::bulk;
+        applySocketOptions();
+    } else if (_current == TrafficProfile::bulk && _smallReads >= _readsToSwitch) {
+        log(LOG_FWD, "Connection looks interactive, switching profile\n");
+        _current = TrafficProfile::interactive;
+        applySocketOptions();
+    }
+}
+
+void ConnectionProfile::setMoreToWrite(bool more) {
+    bool cork = more && _current == TrafficProfile::bulk && _tcpFd >= 0;
+    if (cork == _corked) {
+        return;
+    }
+    _corked = cork;
+    int value = cork;
+    setsockopt(_tcpFd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+void ConnectionProfile::applySocketOptions() {
+    if (_tcpFd < 0 || _profile == TrafficProfile::standard) {
+        return;
+    }
+    int noDelay = _current == TrafficProfile::interactive;
+    setsockopt(_tcpFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    if (_current != TrafficProfile::bulk) {
+        setMoreToWrite(false);
+    }
+}
+
+SslToOutputStreamForwarder::SslToOutputStreamForwarder(std::function<void()> tick, ConnectionProfile &profile,
+                                                       SSL *ssl_stream, GOutputStream *output_stream)
+    : _tick(tick), _profile(profile), _ssl_stream(ssl_stream), _output_stream(output_stream) {
+    if (streamCompression) {
+        _decompressor.emplace();
+    }
+}
+
+void SslToOutputStreamForwarder::quicPoll() {
+    if (_closed) {
+        return;
+    }
+    _buffer.setCapacity(_profile.quicToLocal());
+
+    while (!_buffer.full()) {
+        if (!_decompressed.empty()) {
+            auto [ptr, len] = _buffer.writable();
+            len = std::min(len, _decompressed.size());
+            memcpy(ptr, _decompressed.data(), len);
+            _buffer.commit(len);
+            _decompressed.erase(0, len);
+            continue;
+        }
+        if (_remoteConcluded) {
+            break;
+        }
+
+        log(LOG_FWD, "Looking for data...\n");
+        int read = 0;
+        if (_decompressor) {
+            char buf[16384];
+            read = quicReadOrEof(_ssl_stream, buf, sizeof(buf));
+            if (read > 0) {
+                _profile.observeRead(read, sizeof(buf));
+            }
+            if (read > 0 && !_decompressor->decompress(buf, read, _decompressed)) {
+                log(LOG_FWD, "Bridge stream data can't be decompressed, closing.\n");
+                _remoteConcluded = true;
+                break;
+            }
+        } else {
+            auto [ptr, len] = _buffer.writable();
+            read = quicReadOrEof(_ssl_stream, (char*)ptr, len);
+            if (read > 0) {
+                _profile.observeRead(read, len);
+                _buffer.commit(read);
+            }
+        }
+
+        if (read < 0) {
+            log(LOG_FWD, "Bridge stream closed by remote.\n");
+            _remoteConcluded = true;
+            if (_decompressor && _decompressor->pending()) {
+                log(LOG_FWD, "Bridge stream ended within a compressed frame.\n");
+            }
+        } else if (read) {
+            log(LOG_FWD, "Got {} bytes data from bridge.\n", read);
+        } else {
+            break;
+        }
+    }
+    // don't keep the slab for the last (empty) read
+    _buffer.trim();
+
+    startAsyncWrite();
+
+    if (_remoteConcluded && _decompressed.empty() && !_write_busy) {
+        close();
+    }
+}
+
+void SslToOutputStreamForwarder::startAsyncWrite() {
+    if (_write_busy || _buffer.empty()) {
+        return;
+    }
+    WriteBatchLimits limits = _profile.batchLimits();
+    if (_batch.hold(_buffer.used(), !_remoteConcluded && !_buffer.full(), limits)) {
+        return;
+    }
+
+    auto callback = [](GObject* source_object, GAsyncResult* res, gpointer data) {
+        (void)source_object;
+        auto that = reinterpret_cast<SslToOutputStreamForwarder*>(data);
+
+        gsize bytesWritten = -1;
+        GError *error = nullptr;
+        bool ok = g_output_stream_writev_all_finish(that->_output_stream, res, &bytesWritten, &error);
+        that->_write_busy = false;
+        if (!ok) {
+            log(LOG_FWD, "local write failed: after {} bytes: {}\n", bytesWritten, error->message);
+            g_error_free(error);
+            that->close();
+            that->_tick();
+            return;
+        }
+        if (bytesWritten != that->_write_len) {
+            fatal("local write failed to write all bytes {} != {}\n", bytesWritten, that->_write_len);
+        }
+
+        that->_buffer.consume(bytesWritten);
+        that->_buffer.trim();
+        that->_throughput.add(bytesWritten);
+        that->_profile.setMoreToWrite(!that->_buffer.empty());
+        log(LOG_FWD, "Local write done, {} bytes still buffered.\n", that->_buffer.used());
+        that->startAsyncWrite();
+        that->_tick();
+    };
+
+    // data of all QUIC reads since the last write, one vector per slab
+    struct iovec iov[_maxVectors];
+    int count = _buffer.readableIov(iov, _maxVectors, limits.maxBytes);
+    _write_len = 0;
+    for (int i = 0; i < count; i++) {
+        _vectors[i] = { iov[i].iov_base, iov[i].iov_len };
+        _write_len += iov[i].iov_len;
+    }
+    _profile.setMoreToWrite(_buffer.used() > _write_len);
+    _write_busy = true;
+    log(LOG_FWD, "Local write of {} bytes in {} vectors.\n", _write_len, count);
+    g_output_stream_writev_all_async(_output_stream, _vectors, count, G_PRIORITY_DEFAULT,
+                                     nullptr, callback, this);
+}
+
+void SslToOutputStreamForwarder::close() {
+    if (_closed) {
+        return;
+    }
+    _closed = true;
+    _throughput.logSummary("bridge to local");
+    if (onClose) {
+        onClose();
+    }
+}
+
+InputStreamToSslForwarder::InputStreamToSslForwarder(std::function<void()> tick, ConnectionProfile &profile,
+                                                     GInputStream *input_stream, SSL *ssl_stream)
+    : _tick(tick), _profile(profile), _input_stream(input_stream), _ssl_stream(ssl_stream) {
+    _cancellable = g_cancellable_new();
+    if (streamCompression) {
+        _compressor.emplace();
+    }
+    startAsyncRead();
+
+}
+
+InputStreamToSslForwarder::~InputStreamToSslForwarder() {
+    g_object_unref(_cancellable);
+}
+
+void InputStreamToSslForwarder::quicPoll() {
+    _buffer.setCapacity(_profile.localToQuic());
+    transmitBuffered();
+    startAsyncRead();
+}
+
+void InputStreamToSslForwarder::transmitBuffered() {
+    while (!_closed && (!_buffer.empty() || !_compressed.empty())) {
+        const void *ptr = nullptr;
+        size_t len = 0;
+        if (_compressor) {
+            if (_compressed.empty()) {
+                // one frame per slab
+                auto [chunk, chunkLen] = _buffer.readable();
+                _compressor->compress(chunk, chunkLen, _compressed);
+                _buffer.consume(chunkLen);
+                _throughput.add(chunkLen);
+            }
+            ptr = _compressed.data();
+            len = _compressed.size();
+        } else {
+            std::tie(ptr, len) = _buffer.readable();
+        }
+        size_t written = -1;
+        int ret = SSL_write_ex(_ssl_stream, ptr, len, &written);
+        log(LOG_FWD, "write returned {} and wrote {} bytes\n", ret, written);
+        if (ret > 0) {
+            if (written && _compressor) {
+                _compressed.erase(0, written);
+            } else if (written) {
+                _buffer.consume(written);
+                _throughput.add(written);
+            } else {
+                // Workaround for https://github.com/openssl/openssl/issues/23606
+                //log(LOG_QUIC, "Successful write, but written 0 bytes, tried to write {} bytes\n", len);
+                break;
+            }
+        } else {
+            log(LOG_QUIC, "write data: len={}\n", len);
+            int ssl_error = SSL_get_error(_ssl_stream, ret);
+            if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE) {
+                break;
+            }
+            if (SSL_get_stream_write_state(_ssl_stream) == SSL_STREAM_STATE_RESET_REMOTE) {
+                ERR_clear_error();
+                log(LOG_FWD, "Bridge stream stopped by remote, dropping {} bytes\n", _buffer.used() + _compressed.size());
+                _buffer.consume(_buffer.used());
+                _compressed.clear();
+                _eof = true;
+                // finishes a pending local read, the forwarder closes once it completed
+                g_cancellable_cancel(_cancellable);
+                break;
+            }
+            fatal_ossl("write failed:\n");
+        }
+    }
+
+    if (!_read_busy) {
+        _buffer.trim();
+    }
+
+    if (_eof && _buffer.empty() && _compressed.empty() && !_read_busy && !_closed) {
+        _closed = true;
+        _throughput.logSummary("local to bridge");
+        if (_compressor) {
+            log(LOG_FWD, "local to bridge: compression saved {} bytes\n", _compressor->saved());
+        }
+        if (onClose) {
+            onClose();
+        }
+    }
+}
+
+void InputStreamToSslForwarder::localReadCallback(GObject *source_object, GAsyncResult *res) {
+    (void)source_object;
+    GError *error = nullptr;
+    gssize read = g_input_stream_read_finish(_input_stream, res, &error);
+    log(LOG_FWD, "FWD: read finished\n");
+    _read_busy = false;
+
+    if (read < 0) {
+        log(LOG_FWD, "local read failed: {}\n", error->message);
+        g_error_free(error);
+    }
+
+    if (read <= 0) {
+        _eof = true;
+    } else {
+        //log(LOG_FWD, "read local input: {}\n", std::string_view((const char*)_buffer.writable().first, read));
+        log(LOG_FWD, "read local input: {}\n", read);
+        _profile.observeRead(read, _read_len);
+        _buffer.commit(read);
+    }
+
+    transmitBuffered();
+    if (_closed) {
+        // the tick might destroy this forwarder when the bridge is finished
+        _tick();
+        return;
+    }
+
+    startAsyncRead();
+    _tick();
+}
+
+void InputStreamToSslForwarder::wrap_localReadCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    reinterpret_cast<InputStreamToSslForwarder*>(user_data)->localReadCallback(source_object, res);
+}
+
+void InputStreamToSslForwarder::startAsyncRead() {
+    if (_read_busy || _eof || _buffer.full()) {
+        return;
+    }
+    auto [ptr, len] = _buffer.writable();
+    log(LOG_FWD, "FWD: read started\n");
+    _read_busy = true;
+    _read_len = len;
+    g_input_stream_read_async(_input_stream,
+                              ptr, len,
+                              G_PRIORITY_DEFAULT, _cancellable, wrap_localReadCallback, this);
+}
+
+// file status flags of fds before a forwarder made them nonblocking. Stdio fds share them with the processes the
+// terminal or pipe is shared with, so they are restored when the forwarder ends and when the process exits.
+static std::map<int, int> originalFdFlags;
+
+static void restoreFdFlags(int fd) {
+    auto it = originalFdFlags.find(fd);
+    if (it != originalFdFlags.end()) {
+        fcntl(fd, F_SETFL, it->second);
+        originalFdFlags.erase(it);
+    }
+}
+
+static void restoreAllFdFlags() {
+    for (auto [fd, flags] : originalFdFlags) {
+        fcntl(fd, F_SETFL, flags);
+    }
+    originalFdFlags.clear();
+}
+
+FdForwarder::FdForwarder(std::function<void()> tick, ConnectionProfile &profile, SSL *ssl_stream, int inputFd,
+                         int outputFd)
+    : _tick(tick), _profile(profile), _ssl_stream(ssl_stream), _inputFd(inputFd), _outputFd(outputFd) {
+
+    for (int fd : {_inputFd, _outputFd}) {
+        if (!originalFdFlags.count(fd)) {
+            int flags = fcntl(fd, F_GETFL);
+            if (flags < 0) {
+                fatal("Can't get flags of fd {}: {}\n", fd, strerror(errno));
+            }
+            static bool registered = false;
+            if (!registered) {
+                registered = true;
+                atexit(restoreAllFdFlags);
+            }
+            originalFdFlags[fd] = flags;
+        }
+        GError *error = nullptr;
+        if (!g_unix_set_fd_nonblocking(fd, true, &error)) {
+            fatal("Can't set fd {} to nonblocking: {}\n", fd, error->message);
+        }
+    }
+
+    static GSourceFuncs watchFuncs = {
+        nullptr,
+        nullptr,
+        dispatchWatch,
+        nullptr,
+        nullptr,
+        nullptr,
+    };
+
+    _watch = g_source_new(&watchFuncs, sizeof(WatchSource));
+    reinterpret_cast<WatchSource*>(_watch)->that = this;
+    updateWatch();
+    g_source_attach(_watch, g_main_context_get_thread_default());
+}
+
+FdForwarder::~FdForwarder() {
+    g_source_destroy(_watch);
+    g_source_unref(_watch);
+    restoreFdFlags(_inputFd);
+    restoreFdFlags(_outputFd);
+}
+
+gboolean FdForwarder::dispatchWatch(GSource *source, GSourceFunc callback, gpointer user_data) {
+    (void)callback;
+    (void)user_data;
+    reinterpret_cast<WatchSource*>(source)->that->fdReady();
+    return G_SOURCE_CONTINUE;
+}
+
+void FdForwarder::fdReady() {
+    int inputEvents = _inputTag ? g_source_query_unix_fd(_watch, _inputTag) : 0;
+    int outputEvents = _outputTag ? g_source_query_unix_fd(_watch, _outputTag) : 0;
+
+    if (outputEvents & (G_IO_OUT | G_IO_ERR | G_IO_HUP)) {
+        flushOutput();
+    }
+    if (inputEvents & (G_IO_IN | G_IO_ERR | G_IO_HUP)) {
+        readInput();
+    }
+    updateWatch();
+
+    // the tick might destroy this forwarder when the bridge is finished
+    _tick();
+}
+
+void FdForwarder::quicPoll() {
+    _inputBuffer.setCapacity(_profile.localToQuic());
+    _outputBuffer.setCapacity(_profile.quicToLocal());
+    if (!_outputClosed) {
+        while (!_remoteConcluded && !_outputBuffer.full()) {
+            auto [ptr, len] = _outputBuffer.writable();
+            int read = quicReadOrEof(_ssl_stream, (char*)ptr, len);
+            if (read < 0) {
+                log(LOG_FWD, "Bridge stream closed by remote.\n");
+                _remoteConcluded = true;
+            } else if (read) {
+                log(LOG_FWD, "Got {} bytes data from bridge.\n", read);
+                _profile.observeRead(read, len);
+                _outputBuffer.commit(read);
+            } else {
+                break;
+            }
+        }
+        flushOutput();
+    }
+
+    transmitBuffered();
+    updateWatch();
+}
+
+void FdForwarder::readInput() {
+    while (!_inputEof && !_inputBuffer.full()) {
+        auto [ptr, len] = _inputBuffer.writable();
+        ssize_t ret = read(_inputFd, ptr, len);
+        if (ret > 0) {
+            log(LOG_FWD, "read local input: {}\n", ret);
+            _profile.observeRead(ret, len);
+            _inputBuffer.commit(ret);
+        } else if (ret == 0) {
+            _inputEof = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            log(LOG_FWD, "local read failed: {}\n", strerror(errno));
+            _inputEof = true;
+        }
+    }
+
+    transmitBuffered();
+}
+
+void FdForwarder::transmitBuffered() {
+    while (!_inputClosed && !_inputBuffer.empty()) {
+        auto [ptr, len] = _inputBuffer.readable();
+        size_t written = -1;
+        int ret = SSL_write_ex(_ssl_stream, ptr, len, &written);
+        if (ret > 0) {
+            if (written) {
+                _inputBuffer.consume(written);
+                _inputThroughput.add(written);
+            } else {
+                // Workaround for https://github.com/openssl/openssl/issues/23606
+                break;
+            }
+        } else {
+            int ssl_error = SSL_get_error(_ssl_stream, ret);
+            if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE) {
+                break;
+            }
+            if (SSL_get_stream_write_state(_ssl_stream) == SSL_STREAM_STATE_RESET_REMOTE) {
+                ERR_clear_error();
+                log(LOG_FWD, "Bridge stream stopped by remote, dropping {} bytes\n", _inputBuffer.used());
+                _inputBuffer.consume(_inputBuffer.used());
+                _inputEof = true;
+                break;
+            }
+            fatal_ossl("write failed:\n");
+        }
+    }
+
+    _inputBuffer.trim();
+
+    if (_inputEof && _inputBuffer.empty()) {
+        closeInput();
+    }
+}
+
+void FdForwarder::flushOutput() {
+    WriteBatchLimits limits = _profile.batchLimits();
+    if (!_outputClosed && !_outputBuffer.empty()
+            && _outputBatch.hold(_outputBuffer.used(), !_remoteConcluded && !_outputBuffer.full(), limits)) {
+        return;
+    }
+
+    while (!_outputClosed && !_outputBuffer.empty()) {
+        // one syscall for everything read from QUIC so far, one vector per slab
+        struct iovec iov[64];
+        int count = _outputBuffer.readableIov(iov, 64, limits.maxBytes);
+        size_t len = 0;
+        for (int i = 0; i < count; i++) {
+            len += iov[i].iov_len;
+        }
+        _profile.setMoreToWrite(_outputBuffer.used() > len);
+        ssize_t ret = writev(_outputFd, iov, count);
+        if (ret > 0) {
+            _outputBuffer.consume(ret);
+            _outputThroughput.add(ret);
+        } else if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            log(LOG_FWD, "local write failed: {}\n", strerror(errno));
+            closeOutput();
+            return;
+        }
+    }
+
+    _outputBuffer.trim();
+    if (_outputBuffer.empty()) {
+        _profile.setMoreToWrite(false);
+    }
+
+    if (_remoteConcluded && _outputBuffer.empty()) {
+        closeOutput();
+    }
+}
+
+void FdForwarder::closeInput() {
+    if (_inputClosed) {
+        return;
+    }
+    _inputClosed = true;
+    _inputThroughput.logSummary("local to bridge");
+    if (onInputClose) {
+        onInputClose();
+    }
+}
+
+void FdForwarder::closeOutput() {
+    if (_outputClosed) {
+        return;
+    }
+    _outputClosed = true;
+    _outputThroughput.logSummary("bridge to local");
+    if (onOutputClose) {
+        onOutputClose();
+    }
+}
+
+void FdForwarder::updateWatch() {
+    int inputEvents = 0;
+    int outputEvents = 0;
+
+    if (!_inputEof && !_inputBuffer.full()) {
+        inputEvents = G_IO_IN;
+    }
+    if (!_outputClosed && !_outputBuffer.empty() && !_outputBatch.holding()) {
+        outputEvents = G_IO_OUT;
+    }
+
+    // fds are only watched while there is interest, poll would report hangups for fds without requested events
+    // all the time.
+    auto setWatch = [this] (gpointer &tag, int fd, int events) {
+        if (events && tag) {
+            g_source_modify_unix_fd(_watch, tag, (GIOCondition)events);
+        } else if (events) {
+            tag = g_source_add_unix_fd(_watch, fd, (GIOCondition)events);
+        } else if (tag) {
+            g_source_remove_unix_fd(_watch, tag);
+            tag = nullptr;
+        }
+    };
+
+    if (_inputFd == _outputFd) {
+        setWatch(_inputTag, _inputFd, inputEvents | outputEvents);
+        _outputTag = _inputTag;
+    } else {
+        setWatch(_inputTag, _inputFd, inputEvents);
+        setWatch(_outputTag, _outputFd, outputEvents);
+    }
+}
+
+StreamBridge::StreamBridge(std::function<void()> tick, SSL *ssl_stream)
+    : _tick(tick), _ssl_stream(ssl_stream) {
+    SSL_set_mode(_ssl_stream, SSL_MODE_ENABLE_PARTIAL_WRITE);
+}
+
+StreamBridge::~StreamBridge() {
+    // forwarders first, the local streams and fds need to outlive them
+    _socket_to_ssl_forwarder.reset();
+    _ssl_to_socket_forwarder.reset();
+    _fd_forwarder.reset();
+#ifdef PEERSOCK_HAVE_IO_URING
+    _uring_forwarder.reset();
+#endif
+
+    if (_localConnection) {
+        g_io_stream_close((GIOStream*)_localConnection, nullptr, nullptr);
+        g_object_unref(_localConnection);
+    }
+    if (_stdioInputStream) {
+        g_object_unref(_stdioInputStream);
+    }
+    if (_stdioOutputStream) {
+        g_object_unref(_stdioOutputStream);
+    }
+    // frees the stream and resets it if not yet concluded
+    SSL_free(_ssl_stream);
+
+    compressionStats.logSummary();
+}
+
+void StreamBridge::start(GSocketConnection *localConnection) {
+    _localConnection = localConnection;
+
+    GInputStream *localInputStream = g_io_stream_get_input_stream((GIOStream*)_localConnection);
+    GOutputStream *localOutputStream = g_io_stream_get_output_stream((GIOStream*)_localConnection);
+    GSocket *socket = g_socket_connection_get_socket(_localConnection);
+    _profile.setSocket(socket);
+    int fd = g_socket_get_fd(socket);
+
+    startForwarders(localInputStream, localOutputStream, fd, fd);
+}
+
+void StreamBridge::startStdio() {
+    // compressed streams always use the gio forwarders
+    if (forwarderBackend == ForwarderBackend::gio || streamCompression) {
+        _stdioOutputStream = g_unix_output_stream_new(1, false);
+        _stdioInputStream = g_unix_input_stream_new(0, false);
+    }
+
+    startForwarders(_stdioInputStream, _stdioOutputStream, 0, 1);
+}
+
+static bool uringUsable() {
+    static bool warned = false;
+#ifdef PEERSOCK_HAVE_IO_URING
+    if (UringForwarder::available()) {
+        return true;
+    }
+    const char *reason = "io_uring is not available, using native forwarder";
+#else
+    const char *reason = "io_uring support not compiled in, using native forwarder";
+#endif
+    if (!warned) {
+        warned = true;
+        writeUserMessage({
+                             {"event", "warning"},
+                             {"message", reason},
+                         },
+                         "Warning: {}\n", reason);
+    }
+    return false;
+}
+
+void StreamBridge::startForwarders(GInputStream *localInputStream, GOutputStream *localOutputStream,
+                                   int inputFd, int outputFd) {
+    _started = true;
+    // only the gio forwarders have the compression stage
+    ForwarderBackend backend = streamCompression ? ForwarderBackend::gio : forwarderBackend;
+    // io_uring is only used for sockets, stdio uses the native forwarder instead
+    bool useUring = backend == ForwarderBackend::uring && inputFd == outputFd && uringUsable();
+    if (useUring) {
+#ifdef PEERSOCK_HAVE_IO_URING
+        _uring_forwarder.emplace(_tick, _ssl_stream, inputFd);
+        _uring_forwarder->onOutputClose = [this] { remoteClosed(); };
+        _uring_forwarder->onInputClose = [this] { localInputClosed(); };
+#endif
+    } else if (backend != ForwarderBackend::gio) {
+        _fd_forwarder.emplace(_tick, _profile, _ssl_stream, inputFd, outputFd);
+        _fd_forwarder->onOutputClose = [this] { remoteClosed(); };
+        _fd_forwarder->onInputClose = [this] { localInputClosed(); };
+    } else {
+        _ssl_to_socket_forwarder.emplace(_tick, _profile, _ssl_stream, localOutputStream);
+        _socket_to_ssl_forwarder.emplace(_tick, _profile, localInputStream, _ssl_stream);
+        _ssl_to_socket_forwarder->onClose = [this] { remoteClosed(); };
+        _socket_to_ssl_forwarder->onClose = [this] { localInputClosed(); };
+    }
+}
+
+void StreamBridge::remoteClosed() {
+    if (!_localConnection) {
+        return;
+    }
+    GSocket *socket = g_socket_connection_get_socket(_localConnection);
+    if (inputClosed()) {
+        g_socket_shutdown(socket, true, true, nullptr);
+    } else {
+        g_socket_shutdown(socket, false, true, nullptr);
+    }
+}
+
+void StreamBridge::localInputClosed() {
+    log(LOG_FWD, "Local connection closed, concluding stream {}\n", SSL_get_stream_id(_ssl_stream));
+    if (!SSL_stream_conclude(_ssl_stream, 0)) {
+        // the remote might already have reset the stream
+        ERR_clear_error();
+    }
+    if (onLocalClose) {
+        onLocalClose();
+    }
+}
+
+void StreamBridge::connectLocal(GSocketClient *socketClient, GSocketConnectable *target, bool confirm) {
+    _socketClient = socketClient;
+    _confirmConnect = confirm;
+    g_socket_client_connect_async(_socketClient, target, nullptr, wrap_localConnectCallback, this);
+}
+
+void StreamBridge::localConnectCallback(GObject *source_object, GAsyncResult *res) {
+    (void)source_object;
+    GError *error = nullptr;
+    GSocketConnection *localConnection = g_socket_client_connect_finish(_socketClient, res, &error);
+    if (error) {
+        writeUserMessage({
+                             {"event", "error"},
+                             {"message", error->message},
+                         },
+                         "Error: {}\n", error->message);
+        g_error_free(error);
+        SSL_stream_reset(_ssl_stream, nullptr, 0);
+        _failed = true;
+        _tick();
+        return;
+    }
+
+    if (_confirmConnect) {
+        size_t written = 0;
+        if (!SSL_write_ex(_ssl_stream, "\0", 1, &written)) {
+            // the remote reset the stream in the meantime, the forwarders notice it
+            ERR_clear_error();
+        }
+    }
+    start(localConnection);
+    _tick();
+}
+
+void StreamBridge::wrap_localConnectCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    reinterpret_cast<StreamBridge*>(user_data)->localConnectCallback(source_object, res);
+}
+
+void StreamBridge::quicPoll() {
+    if (_ssl_to_socket_forwarder) {
+        _ssl_to_socket_forwarder->quicPoll();
+    }
+    if (_socket_to_ssl_forwarder) {
+        _socket_to_ssl_forwarder->quicPoll();
+    }
+    if (_fd_forwarder) {
+        _fd_forwarder->quicPoll();
+    }
+#ifdef PEERSOCK_HAVE_IO_URING
+    if (_uring_forwarder) {
+        _uring_forwarder->quicPoll();
+    }
+#endif
+}
+
+bool StreamBridge::inputClosed() const {
+    if (_fd_forwarder) {
+        return _fd_forwarder->inputClosed();
+    }
+#ifdef PEERSOCK_HAVE_IO_URING
+    if (_uring_forwarder) {
+        return _uring_forwarder->inputClosed();
+    }
+#endif
+    return _socket_to_ssl_forwarder && _socket_to_ssl_forwarder->closed();
+}
+
+bool StreamBridge::outputClosed() const {
+    if (_fd_forwarder) {
+        return _fd_forwarder->outputClosed();
+    }
+#ifdef PEERSOCK_HAVE_IO_URING
+    if (_uring_forwarder) {
+        return _uring_forwarder->outputClosed();
+    }
+#endif
+    return _ssl_to_socket_forwarder && _ssl_to_socket_forwarder->closed();
+}
+
+bool StreamBridge::finished() const {
+    if (_failed) {
+        return true;
+    }
+
+    return _started && inputClosed() && outputClosed();
+}
+
+static void writeBigEndian(char *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = (char)value;
+        value >>= 8;
+    }
+}
+
+static uint64_t readBigEndian(const char *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | (unsigned char)in[i];
+    }
+    return value;
+}
+
+StripedBridge::StripedBridge(std::function<void()> tick, std::vector<SSL*> streams) : _tick(tick) {
+    for (SSL *stream : streams) {
+        SSL_set_mode(stream, SSL_MODE_ENABLE_PARTIAL_WRITE);
+        Lane lane;
+        lane.stream = stream;
+        _lanes.push_back(lane);
+    }
+    _cancellable = g_cancellable_new();
+}
+
+StripedBridge::~StripedBridge() {
+    g_cancellable_cancel(_cancellable);
+    g_object_unref(_cancellable);
+    if (_input_stream) {
+        g_object_unref(_input_stream);
+    }
+    if (_output_stream) {
+        g_object_unref(_output_stream);
+    }
+    for (Lane &lane : _lanes) {
+        SSL_free(lane.stream);
+    }
+}
+
+void StripedBridge::startStdio() {
+    _output_stream = g_unix_output_stream_new(1, false);
+    _input_stream = g_unix_input_stream_new(0, false);
+    log(LOG_FWD, "Striping stdio over {} streams\n", _lanes.size());
+    startAsyncRead();
+}
+
+void StripedBridge::quicPoll() {
+    transmit();
+    startAsyncRead();
+    receive();
+    startAsyncWrite();
+}
+
+void StripedBridge::startAsyncRead() {
+    // one chunk waiting per stream keeps all of them busy
+    if (_read_busy || _eof || _queue.size() >= _lanes.size()) {
+        return;
+    }
+    _read_busy = true;
+    g_input_stream_read_async(_input_stream, _readBuffer.data(), _readBuffer.size(), G_PRIORITY_DEFAULT,
+                              _cancellable, wrap_localReadCallback, this);
+}
+
+void StripedBridge::wrap_localReadCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    GError *error = nullptr;
+    gssize read = g_input_stream_read_finish((GInputStream*)source_object, res, &error);
+    if (read < 0 && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        // the bridge might already be gone
+        g_error_free(error);
+        return;
+    }
+    reinterpret_cast<StripedBridge*>(user_data)->localReadCallback(read, error);
+}
+
+void StripedBridge::localReadCallback(gssize read, GError *error) {
+    _read_busy = false;
+    if (read < 0) {
+        log(LOG_FWD, "local read failed: {}\n", error->message);
+        g_error_free(error);
+    }
+
+    if (read <= 0) {
+        _eof = true;
+    } else {
+        std::string frame(_headerSize, '\0');
+        writeBigEndian(frame.data(), _sendSeq++, 8);
+        writeBigEndian(frame.data() + 8, read, 4);
+        frame.append(_readBuffer.data(), read);
+        _queue.push_back(std::move(frame));
+        _inputThroughput.add(read);
+    }
+
+    transmit();
+    startAsyncRead();
+    _tick();
+}
+
+void StripedBridge::transmit() {
+    if (_inputClosed) {
+        return;
+    }
+    // one chunk per stream and round, a stream that has no room is skipped until the next poll
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t i = 0; i < _lanes.size(); i++) {
+            Lane &lane = _lanes[(_nextLane + i) % _lanes.size()];
+            if (lane.sent == lane.sending.size()) {
+                if (_queue.empty()) {
+                    continue;
+                }
+                lane.sending = std::move(_queue.front());
+                lane.sent = 0;
+                _queue.pop_front();
+            }
+
+            size_t written = 0;
+            int ret = SSL_write_ex(lane.stream, lane.sending.data() + lane.sent, lane.sending.size() - lane.sent,
+                                   &written);
+            if (ret > 0) {
+                lane.sent += written;
+                progress |= lane.sent == lane.sending.size();
+                continue;
+            }
+            int ssl_error = SSL_get_error(lane.stream, ret);
+            if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE) {
+                continue;
+            }
+            int state = SSL_get_stream_write_state(lane.stream);
+            if (state == SSL_STREAM_STATE_RESET_REMOTE || state == SSL_STREAM_STATE_CONN_CLOSED) {
+                ERR_clear_error();
+                log(LOG_FWD, "Striped stream stopped by remote, dropping local input\n");
+                _eof = true;
+                _queue.clear();
+                g_cancellable_cancel(_cancellable);
+                _read_busy = false;
+                closeInput();
+                return;
+            }
+            fatal_ossl("write failed:\n");
+        }
+        _nextLane = (_nextLane + 1) % _lanes.size();
+    }
+
+    if (!_eof || _read_busy || !_queue.empty()) {
+        return;
+    }
+    for (const Lane &lane : _lanes) {
+        if (lane.sent != lane.sending.size()) {
+            return;
+        }
+    }
+    closeInput();
+}
+
+void StripedBridge::closeInput() {
+    if (_inputClosed) {
+        return;
+    }
+    _inputClosed = true;
+    _inputThroughput.logSummary("local to stripes");
+    for (Lane &lane : _lanes) {
+        if (!SSL_stream_conclude(lane.stream, 0)) {
+            // the remote might already have reset the stream
+            ERR_clear_error();
+        }
+    }
+    if (onLocalClose) {
+        onLocalClose();
+    }
+}
+
+void StripedBridge::receive() {
+    if (_outputClosed) {
+        return;
+    }
+    for (Lane &lane : _lanes) {
+        receiveFrames(lane);
+    }
+
+    if (_write_busy || !_output.empty()) {
+        return;
+    }
+    for (const Lane &lane : _lanes) {
+        if (!lane.remoteConcluded) {
+            return;
+        }
+    }
+    closeOutput();
+}
+
+void StripedBridge::receiveFrames(Lane &lane) {
+    char buf[16384];
+    while (!lane.remoteConcluded) {
+        size_t buffered = _output.size() + _writing.size() + _reorderedBytes;
+        if (buffered >= _receiveLimit) {
+            // streams ahead wait for the one with the next chunk, all wait for the local write
+            if (_output.size() + _writing.size() >= _receiveLimit || lane.lastSeq > _receiveSeq) {
+                return;
+            }
+        }
+
+        // the other side closes its parallel connections when it quits
+        int read = SSL_get_stream_read_state(lane.stream) == SSL_STREAM_STATE_CONN_CLOSED ? -1
+            : quicReadOrEof(lane.stream, buf, sizeof(buf));
+        if (read < 0) {
+            log(LOG_FWD, "Striped stream {} closed by remote.\n", SSL_get_stream_id(lane.stream));
+            lane.remoteConcluded = true;
+            if (!lane.partial.empty()) {
+                log(LOG_FWD, "Striped stream ended within a chunk.\n");
+            }
+            return;
+        } else if (read == 0) {
+            return;
+        }
+        lane.partial.append(buf, read);
+
+        size_t pos = 0;
+        while (lane.partial.size() - pos >= _headerSize) {
+            int64_t seq = readBigEndian(lane.partial.data() + pos, 8);
+            size_t len = readBigEndian(lane.partial.data() + pos + 8, 4);
+            if (len > _chunkSize || seq < _receiveSeq || seq <= lane.lastSeq) {
+                fatal("Malformed striped stream\n");
+            }
+            if (lane.partial.size() - pos < _headerSize + len) {
+                break;
+            }
+            lane.lastSeq = seq;
+            deliver(seq, lane.partial.substr(pos + _headerSize, len));
+            pos += _headerSize + len;
+        }
+        lane.partial.erase(0, pos);
+    }
+}
+
+void StripedBridge::deliver(int64_t seq, std::string &&data) {
+    if (seq != _receiveSeq) {
+        _reorderedBytes += data.size();
+        _reordered.emplace(seq, std::move(data));
+        return;
+    }
+    _output.append(data);
+    ++_receiveSeq;
+    for (auto it = _reordered.begin(); it != _reordered.end() && it->first == _receiveSeq;
+         it = _reordered.erase(it)) {
+        _output.append(it->second);
+        _reorderedBytes -= it->second.size();
+        ++_receiveSeq;
+    }
+}
+
+void StripedBridge::startAsyncWrite() {
+    if (_write_busy || _output.empty() || _outputClosed) {
+        return;
+    }
+
+    auto callback = [](GObject* source_object, GAsyncResult* res, gpointer data) {
+        (void)source_object;
+        auto that = reinterpret_cast<StripedBridge*>(data);
+
+        gsize bytesWritten = -1;
+        GError *error = nullptr;
+        bool ok = g_output_stream_write_all_finish(that->_output_stream, res, &bytesWritten, &error);
+        that->_write_busy = false;
+        if (!ok) {
+            log(LOG_FWD, "local write failed: after {} bytes: {}\n", bytesWritten, error->message);
+            g_error_free(error);
+            that->_output.clear();
+            that->closeOutput();
+            that->_tick();
+            return;
+        }
+        that->_outputThroughput.add(bytesWritten);
+        that->_writing.clear();
+        that->startAsyncWrite();
+        that->_tick();
+    };
+
+    _writing.swap(_output);
+    _write_busy = true;
+    g_output_stream_write_all_async(_output_stream, _writing.data(), _writing.size(), G_PRIORITY_DEFAULT,
+                                    nullptr, callback, this);
+}
+
+void StripedBridge::closeOutput() {
+    if (_outputClosed) {
+        return;
+    }
+    _outputClosed = true;
+    if (!_reordered.empty()) {
+        log(LOG_FWD, "Striped stream ended with {} chunks after a missing one.\n", _reordered.size());
+    }
+    _outputThroughput.logSummary("stripes to local");
+}
+
+DatagramBridge::DatagramBridge(std::function<void()> tick, SSL *ssl_stream)
+    : _tick(tick), _ssl_stream(ssl_stream) {
+    SSL_set_mode(_ssl_stream, SSL_MODE_ENABLE_PARTIAL_WRITE);
+}
+
+DatagramBridge::~DatagramBridge() {
+    if (_watch) {
+        g_source_remove(_watch);
+    }
+    if (_localConnection) {
+        g_io_stream_close((GIOStream*)_localConnection, nullptr, nullptr);
+        g_object_unref(_localConnection);
+    }
+    if (_dropped) {
+        log(LOG_FWD, "udp flow dropped {} datagrams\n", _dropped);
+    }
+    // frees the stream and resets it if not yet concluded
+    SSL_free(_ssl_stream);
+}
+
+void DatagramBridge::startListenFlow(int fd, const sockaddr_storage &peer, socklen_t peerLen) {
+    _fd = fd;
+    _peer = peer;
+    _peerLen = peerLen;
+}
+
+void DatagramBridge::connectLocal(GSocketClient *socketClient, GSocketConnectable *target) {
+    _socketClient = socketClient;
+    g_socket_client_connect_async(_socketClient, target, nullptr, wrap_localConnectCallback, this);
+}
+
+void DatagramBridge::localConnectCallback(GObject *source_object, GAsyncResult *res) {
+    (void)source_object;
+    GError *error = nullptr;
+    _localConnection = g_socket_client_connect_finish(_socketClient, res, &error);
+    if (error) {
+        writeUserMessage({
+                             {"event", "error"},
+                             {"message", error->message},
+                         },
+                         "Error: {}\n", error->message);
+        g_error_free(error);
+        SSL_stream_reset(_ssl_stream, nullptr, 0);
+        _failed = true;
+        _tick();
+        return;
+    }
+
+    _fd = g_socket_get_fd(g_socket_connection_get_socket(_localConnection));
+    _watch = g_unix_fd_add(_fd, G_IO_IN, wrap_localReadable, this);
+    _tick();
+}
+
+void DatagramBridge::wrap_localConnectCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    reinterpret_cast<DatagramBridge*>(user_data)->localConnectCallback(source_object, res);
+}
+
+gboolean DatagramBridge::wrap_localReadable(gint fd, GIOCondition condition, gpointer user_data) {
+    (void)fd;
+    (void)condition;
+    auto that = reinterpret_cast<DatagramBridge*>(user_data);
+    that->readLocal();
+    // the tick might destroy this bridge
+    that->_tick();
+    return G_SOURCE_CONTINUE;
+}
+
+void DatagramBridge::readLocal() {
+    char buf[65536];
+    while (true) {
+        ssize_t ret = recv(_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (ret >= 0) {
+            sendToRemote(buf, ret);
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            // ECONNREFUSED from an earlier send is reported here as well, the flow stays up in that case
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log(LOG_FWD, "local udp read failed: {}\n", strerror(errno));
+            }
+            break;
+        }
+    }
+}
+
+void DatagramBridge::sendToRemote(const char *data, size_t len) {
+    if (_closed || _remoteConcluded) {
+        return;
+    }
+    _lastActivity = std::chrono::steady_clock::now();
+    if (len > 0xffff || _toRemote.size() + 2 + len > _maxQueued) {
+        ++_dropped;
+        return;
+    }
+    _toRemote.push_back((char)(len >> 8));
+    _toRemote.push_back((char)(len & 0xff));
+    _toRemote.append(data, len);
+    flushRemote();
+}
+
+void DatagramBridge::flushRemote() {
+    size_t offset = 0;
+    while (offset < _toRemote.size()) {
+        size_t written = 0;
+        int ret = SSL_write_ex(_ssl_stream, _toRemote.data() + offset, _toRemote.size() - offset, &written);
+        if (ret > 0) {
+            if (!written) {
+                // Workaround for https://github.com/openssl/openssl/issues/23606
+                break;
+            }
+            offset += written;
+        } else {
+            int ssl_error = SSL_get_error(_ssl_stream, ret);
+            if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE) {
+                break;
+            }
+            if (SSL_get_stream_write_state(_ssl_stream) == SSL_STREAM_STATE_RESET_REMOTE) {
+                ERR_clear_error();
+                log(LOG_FWD, "udp flow stream stopped by remote\n");
+                _remoteConcluded = true;
+                offset = _toRemote.size();
+                break;
+            }
+            fatal_ossl("write failed:\n");
+        }
+    }
+    _toRemote.erase(0, offset);
+}
+
+void DatagramBridge::deliverLocal(const char *data, size_t len) {
+    ssize_t ret;
+    do {
+        if (_peerLen) {
+            ret = sendto(_fd, data, len, MSG_DONTWAIT, (const sockaddr*)&_peer, _peerLen);
+        } else {
+            ret = send(_fd, data, len, MSG_DONTWAIT);
+        }
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            ++_dropped;
+        } else {
+            log(LOG_FWD, "local udp send failed: {}\n", strerror(errno));
+        }
+    }
+}
+
+void DatagramBridge::quicPoll() {
+    if (_closed || _failed) {
+        return;
+    }
+    flushRemote();
+
+    // until connected the stream holds back the data
+    if (_fd < 0) {
+        return;
+    }
+
+    char buf[16384];
+    while (!_remoteConcluded) {
+        int read = quicReadOrEof(_ssl_stream, buf, sizeof(buf));
+        if (read < 0) {
+            log(LOG_FWD, "udp flow stream closed by remote.\n");
+            _remoteConcluded = true;
+        } else if (read) {
+            _fromRemote.append(buf, read);
+            _lastActivity = std::chrono::steady_clock::now();
+        } else {
+            break;
+        }
+    }
+
+    size_t offset = 0;
+    while (_fromRemote.size() - offset >= 2) {
+        size_t len = ((unsigned char)_fromRemote[offset]) << 8 | ((unsigned char)_fromRemote[offset + 1]);
+        if (_fromRemote.size() - offset - 2 < len) {
+            break;
+        }
+        deliverLocal(_fromRemote.data() + offset + 2, len);
+        offset += 2 + len;
+    }
+    _fromRemote.erase(0, offset);
+}
+
+void DatagramBridge::close() {
+    if (_closed) {
+        return;
+    }
+    _closed = true;
+    SSL_stream_conclude(_ssl_stream, 0);
+    ERR_clear_error();
+}
+
+bool DatagramBridge::finished() const {
+    return _failed || _closed || _remoteConcluded;
+}
+
+// the marker is sent along with the stream open, so it is there when the stream is accepted
+static char readStreamMarker(SSL *stream) {
+    char buf[1];
+    size_t readbytes = -1;
+    int ret = SSL_read_ex(stream, buf, 1, &readbytes);
+    if (ret != 1) {
+        fatal_ossl("initial read on payload stream failed:\n");
+    }
+    if (readbytes != 1) {
+        fatal("initial read on payload stream wrong sizes: {}\n", readbytes);
+    }
+    return buf[0];
+}
+
+static void expectStreamMarker(SSL *stream) {
+    char marker = readStreamMarker(stream);
+    if (marker != 'X') {
+        fatal("initial read on payload stream unexpected data: {}\n", marker);
+    }
+}
+
+// Payload streams start with a header: a type byte followed by type specific strings, each prefixed by its length
+// in one byte.
+//   'X'                 payload for the fixed target of the accepting side
+//   'T' target          payload to be connected to target ("host:port")
+//   'C' target          like 'T', but the accepting side writes one byte back once it connected to target, or resets
+//                       the stream if it can't, before the payload in that direction
+//   'R' listen target   asks the peer to listen on listen ("[bind:]port") and to open a 'T' stream with target for
+//                       each accepted connection, the stream carries nothing else
+//   'S' count           stdio striped over this stream and count (a byte) 'L' streams, see StripedBridge
+//   'L'                 stream of a striped bridge on one of the parallel connections
+static SSL *openStream(SSL *connection, const std::string &header) {
+    SSL *stream = SSL_new_stream(connection, 0);
+    if (!stream) {
+        fatal_ossl("SSL_new_stream for bridging:\n");
+    }
+    // Stream open only is send if data is written to the stream
+    size_t written = -1;
+    int ret = SSL_write_ex(stream, header.data(), header.size(), &written);
+    if (ret != 1 || written != header.size()) {
+        fatal_ossl("Failed in initial write to payload stream:\n");
+    }
+    return stream;
+}
+
+static SSL *openPayloadStream(RemoteConnection *connection, const std::string &header = "X") {
+    return openStream(connection->ssl(), header);
+}
+
+static void appendHeaderString(std::string &header, const std::string &value) {
+    if (value.size() > 255) {
+        fatal("Forwarding address too long: {}\n", value);
+    }
+    header.push_back((char)value.size());
+    header.append(value);
+}
+
+// number of bytes still needed to complete header, read exactly this much to not consume payload
+static size_t streamHeaderMissing(const std::string &header) {
+    if (header.empty()) {
+        return 1;
+    }
+    size_t expected = 1;
+    size_t strings = header[0] == 'T' || header[0] == 'C' ? 1 : header[0] == 'R' ? 2 : 0;
+    for (size_t i = 0; i < strings; i++) {
+        if (header.size() <= expected) {
+            return expected + 1 - header.size();
+        }
+        expected += 1 + (unsigned char)header[expected];
+    }
+    return expected - header.size();
+}
+
+// Returns 1 when header is complete, 0 if more data is needed and -1 if the stream ended.
+static int readStreamHeader(SSL *stream, std::string &header) {
+    char buf[256];
+    while (size_t missing = streamHeaderMissing(header)) {
+        int read = quicReadOrEof(stream, buf, missing);
+        if (read < 0) {
+            return -1;
+        } else if (read == 0) {
+            return 0;
+        }
+        header.append(buf, read);
+    }
+    return 1;
+}
+
+static std::vector<std::string> splitHeaderStrings(const std::string &header) {
+    std::vector<std::string> result;
+    size_t pos = 1;
+    while (pos < header.size()) {
+        size_t len = (unsigned char)header[pos];
+        result.push_back(header.substr(pos + 1, len));
+        pos += 1 + len;
+    }
+    return result;
+}
+
+GSocketAddress *unixSocketAddress(const std::string &path) {
+    if (path.size() > 1 && path[0] == '@') {
+        return g_unix_socket_address_new_with_type(path.data() + 1, path.size() - 1,
+                                                   G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+    }
+    return g_unix_socket_address_new(path.data());
+}
+
+static std::vector<std::string> socketFilesToRemove;
+
+static void removeSocketFiles() {
+    for (const std::string &path : socketFilesToRemove) {
+        unlink(path.data());
+    }
+}
+
+static gboolean onTerminationSignal(gpointer user_data) {
+    int signal = GPOINTER_TO_INT(user_data);
+    log(LOG_FWD, "Terminated by signal {}\n", signal);
+    // removes the socket files through atexit
+    exit(128 + signal);
+    return G_SOURCE_REMOVE;
+}
+
+// A socket file left behind by a process that was killed makes bind fail. It is only removed if nothing accepts
+// connections on it anymore.
+static void removeStaleSocketFile(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+        return;
+    }
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
+    }
+    bool refused = connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 && errno == ECONNREFUSED;
+    close(fd);
+    if (refused) {
+        log(LOG_FWD, "Removing stale socket file {}\n", path);
+        unlink(path);
+    }
+}
+
+ListenMode::ListenMode(uint16_t port) : _port(port) {
+    _listener = g_socket_listener_new();
+    g_socket_listener_add_inet_port(_listener, _port, nullptr, nullptr);
+    g_socket_listener_accept_async(_listener, nullptr, wrap_acceptCallback, this);
+}
+
+ListenMode::ListenMode(GSocketAddress *address, std::optional<unsigned> socketMode) {
+    _listener = g_socket_listener_new();
+
+    const char *path = nullptr;
+    if (G_IS_UNIX_SOCKET_ADDRESS(address)
+            && g_unix_socket_address_get_address_type((GUnixSocketAddress*)address) == G_UNIX_SOCKET_ADDRESS_PATH) {
+        path = g_unix_socket_address_get_path((GUnixSocketAddress*)address);
+    }
+
+    if (path) {
+        removeStaleSocketFile(path);
+    }
+    // the socket file is created with the permissions from the umask
+    mode_t oldUmask = 0;
+    if (path && socketMode) {
+        oldUmask = umask(~*socketMode & 0777);
+    }
+    GError *error = nullptr;
+    bool ok = g_socket_listener_add_address(_listener, address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                            nullptr, nullptr, &error);
+    if (path && socketMode) {
+        umask(oldUmask);
+    }
+    if (!ok) {
+        fatal("Can't listen on {}: {}\n", path ? path : "socket", error->message);
+    }
+
+    if (path) {
+        if (socketFilesToRemove.empty()) {
+            atexit(removeSocketFiles);
+            g_unix_signal_add(SIGINT, onTerminationSignal, GINT_TO_POINTER(SIGINT));
+            g_unix_signal_add(SIGTERM, onTerminationSignal, GINT_TO_POINTER(SIGTERM));
+        }
+        socketFilesToRemove.push_back(path);
+    }
+    g_object_unref(address);
+
+    g_socket_listener_accept_async(_listener, nullptr, wrap_acceptCallback, this);
+}
+
+void ListenMode::connectionMade(std::function<void()> tick, RemoteConnection *connection) {
+    _tick = tick;
+    q_connection = connection;
+    _bridged = true;
+    for (GSocketConnection *localConnection : _pendingConnections) {
+        bridgeConnection(localConnection);
+    }
+    _pendingConnections.clear();
+}
+
+int ListenMode::handleQuicStreamOpened(SSL *stream) {
+    fatal("Unexpected stream\n");
+
+    return 0;
+}
+
+void ListenMode::quicPoll() {
+    for (StreamBridge &bridge : _bridges) {
+        bridge.quicPoll();
+    }
+    _bridges.remove_if([] (const StreamBridge &bridge) { return bridge.finished(); });
+}
+
+void ListenMode::bridgeConnection(GSocketConnection *localConnection) {
+    SSL *bridgeStream = openPayloadStream(q_connection);
+
+    log(LOG_FWD, "Bridging local connection to stream {}\n", SSL_get_stream_id(bridgeStream));
+    _bridges.emplace_back(_tick, bridgeStream).start(localConnection);
+}
+
+void ListenMode::acceptCallback(GObject *source_object, GAsyncResult *res) {
+    (void)source_object;
+    GSocketConnection *localConnection = g_socket_listener_accept_finish(_listener, res, nullptr, nullptr);
+    g_socket_listener_accept_async(_listener, nullptr, wrap_acceptCallback, this);
+    if (localConnection) {
+        auto remoteAddr = g_socket_connection_get_remote_address(localConnection, nullptr);
+        if (remoteAddr && G_IS_INET_SOCKET_ADDRESS(remoteAddr)) {
+            auto remoteInetAddr = g_inet_socket_address_get_address((GInetSocketAddress*)remoteAddr);
+            log(LOG_FWD, "Incoming connection from {}:{}\n", g_inet_address_to_string(remoteInetAddr),
+                g_inet_socket_address_get_port((GInetSocketAddress*)remoteAddr));
+        } else {
+            log(LOG_FWD, "Incoming local socket connection\n");
+        }
+        if (_bridged) {
+            bridgeConnection(localConnection);
+            _tick();
+        } else {
+            _pendingConnections.push_back(localConnection);
+        }
+    } else {
+        log(LOG_FWD, "accpet failed\n");
+    }
+}
+
+void ListenMode::wrap_acceptCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    reinterpret_cast<ListenMode*>(user_data)->acceptCallback(source_object, res);
+}
+
+ConnectMode::ConnectMode(GSocketConnectable *target) : _target(target) {
+    _socketClient = g_socket_client_new();
+}
+
+void ConnectMode::connectionMade(std::function<void()> tick, RemoteConnection *connection) {
+    _tick = tick;
+    q_connection = connection;
+    _bridged = true;
+}
+
+int ConnectMode::handleQuicStreamOpened(SSL *stream) {
+    expectStreamMarker(stream);
+    _bridges.emplace_back(_tick, stream).connectLocal(_socketClient, _target);
+    return 0;
+}
+
+void ConnectMode::quicPoll() {
+    for (StreamBridge &bridge : _bridges) {
+        bridge.quicPoll();
+    }
+    _bridges.remove_if([] (const StreamBridge &bridge) { return bridge.finished(); });
+}
+
+UdpListenMode::UdpListenMode(uint16_t port) {
+    // dual stack if possible
+    _fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_fd >= 0) {
+        int off = 0;
+        setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        sockaddr_in6 addr = {};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        if (bind(_fd, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+            fatal("Can't listen on udp port {}: {}\n", port, strerror(errno));
+        }
+    } else {
+        _fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_fd < 0) {
+            fatal("Can't create udp socket: {}\n", strerror(errno));
+        }
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(_fd, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+            fatal("Can't listen on udp port {}: {}\n", port, strerror(errno));
+        }
+    }
+
+    _watch = g_unix_fd_add(_fd, G_IO_IN, wrap_localReadable, this);
+    g_timeout_add_seconds(10, wrap_expireFlows, this);
+}
+
+void UdpListenMode::connectionMade(std::function<void()> tick, RemoteConnection *connection) {
+    _tick = tick;
+    q_connection = connection;
+    _bridged = true;
+}
+
+int UdpListenMode::handleQuicStreamOpened(SSL *stream) {
+    fatal("Unexpected stream\n");
+
+    return 0;
+}
+
+gboolean UdpListenMode::wrap_localReadable(gint fd, GIOCondition condition, gpointer user_data) {
+    (void)fd;
+    (void)condition;
+    reinterpret_cast<UdpListenMode*>(user_data)->readLocal();
+    return G_SOURCE_CONTINUE;
+}
+
+void UdpListenMode::readLocal() {
+    char buf[65536];
+    bool received = false;
+    while (true) {
+        sockaddr_storage peer = {};
+        socklen_t peerLen = sizeof(peer);
+        ssize_t ret = recvfrom(_fd, buf, sizeof(buf), MSG_DONTWAIT, (sockaddr*)&peer, &peerLen);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log(LOG_FWD, "local udp read failed: {}\n", strerror(errno));
+            }
+            break;
+        }
+        if (!_bridged) {
+            // like a lost datagram, the application retries
+            log(LOG_FWD, "Dropping udp datagram before the connection is authenticated\n");
+            continue;
+        }
 
-#include "utils.h"
+        std::string key((const char*)&peer, peerLen);
+        auto it = _flows.find(key);
+        if (it == _flows.end()) {
+            log(LOG_FWD, "New udp flow\n");
+            it = _flows.emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                                std::forward_as_tuple(_tick, openPayloadStream(q_connection))).first;
+            it->second.startListenFlow(_fd, peer, peerLen);
+        }
+        it->second.sendToRemote(buf, ret);
+        received = true;
+    }
 
+    if (received) {
+        _tick();
+    }
+}
 
-SslToOutputStreamForwarder::SslToOutputStreamForwarder(std::function<void()> tick, SSL *ssl_stream, GOutputStream *output_stream)
-    : _tick(tick), _ssl_stream(ssl_stream), _output_stream(output_stream) {
+gboolean UdpListenMode::wrap_expireFlows(gpointer user_data) {
+    reinterpret_cast<UdpListenMode*>(user_data)->expireFlows();
+    return G_SOURCE_CONTINUE;
+}
 
+void UdpListenMode::expireFlows() {
+    // udp has no close, flows without traffic end after a timeout like in a NAT
+    auto now = std::chrono::steady_clock::now();
+    bool expired = false;
+    for (auto &[key, flow] : _flows) {
+        if (now - flow.lastActivity() > _flowTimeout) {
+            flow.close();
+            expired = true;
+        }
+    }
+    if (expired && _tick) {
+        _tick();
+    }
 }
 
-void SslToOutputStreamForwarder::quicPoll() {
-    if (!_buffer_busy) {
-        log(LOG_FWD, "Looking for data...\n");
-        int read = quicReadOrDie(_ssl_stream, (char*)_buffer.data(), _buffer.size());
+void UdpListenMode::quicPoll() {
+    for (auto &[key, flow] : _flows) {
+        flow.quicPoll();
+    }
+    for (auto it = _flows.begin(); it != _flows.end();) {
+        if (it->second.finished()) {
+            it = _flows.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
 
-        if (read) {
-            _buffer_busy = true;
-            log(LOG_FWD, "Got {} bytes data from bridge.\n", read);
-            auto callback = [](GObject* source_object, GAsyncResult* res, gpointer data) {
-                (void)source_object;
-                auto that = reinterpret_cast<SslToOutputStreamForwarder*>(data);
-
-                gsize bytesWritten = -1;
-                GError *error = nullptr;
-                bool ok = g_output_stream_write_all_finish(that->_output_stream, res, &bytesWritten, &error);
-                if (!ok) {
-                    fatal("local write failed: after {} bytes: {}\n", bytesWritten, error->message);
-                }
-                if (bytesWritten != that->_buffer_used) {
-                    fatal("local write failed to write all bytes {} != {}\n", bytesWritten, that->_buffer_used);
-                }
+UdpConnectMode::UdpConnectMode(GSocketConnectable *target) : _target(target) {
+    _socketClient = g_socket_client_new();
+    g_socket_client_set_socket_type(_socketClient, G_SOCKET_TYPE_DATAGRAM);
+    g_socket_client_set_protocol(_socketClient, G_SOCKET_PROTOCOL_UDP);
+}
+
+void UdpConnectMode::connectionMade(std::function<void()> tick, RemoteConnection *connection) {
+    _tick = tick;
+    q_connection = connection;
+    _bridged = true;
+}
+
+int UdpConnectMode::handleQuicStreamOpened(SSL *stream) {
+    expectStreamMarker(stream);
+    _flows.emplace_back(_tick, stream).connectLocal(_socketClient, _target);
+    return 0;
+}
+
+void UdpConnectMode::quicPoll() {
+    for (DatagramBridge &flow : _flows) {
+        flow.quicPoll();
+    }
+    _flows.remove_if([] (const DatagramBridge &flow) { return flow.finished(); });
+}
 
-                that->_buffer_busy = false;
-                log(LOG_FWD, "Buffer idle again.\n");
-                that->_tick();
-            };
-            _buffer_used = read;
-            g_output_stream_write_all_async(_output_stream, _buffer.data(), read, G_PRIORITY_DEFAULT,
-                                            nullptr, callback, this);
+std::optional<ForwardSpec> parseForwardSpec(bool remote, std::string_view spec) {
+    std::vector<std::string_view> parts;
+    bool inBrackets = false;
+    size_t start = 0;
+    for (size_t i = 0; i <= spec.size(); i++) {
+        if (i == spec.size() || (spec[i] == ':' && !inBrackets)) {
+            parts.push_back(spec.substr(start, i - start));
+            start = i + 1;
+        } else if (spec[i] == '[') {
+            inBrackets = true;
+        } else if (spec[i] == ']') {
+            inBrackets = false;
         }
     }
+    if (parts.size() != 3 && parts.size() != 4) {
+        return std::nullopt;
+    }
+
+    auto validPort = [] (std::string_view port) {
+        uint16_t value = 0;
+        auto [ptr, ec] = std::from_chars(port.data(), port.data() + port.size(), value);
+        return ec == std::errc{} && ptr == port.data() + port.size() && value;
+    };
+
+    std::string_view port = parts[parts.size() - 3];
+    std::string_view host = parts[parts.size() - 2];
+    std::string_view hostPort = parts[parts.size() - 1];
+    if (!validPort(port) || host.empty() || !validPort(hostPort)) {
+        return std::nullopt;
+    }
+
+    ForwardSpec result;
+    result.remote = remote;
+    if (parts.size() == 4) {
+        result.listen = fmt::format("{}:{}", parts[0], port);
+    } else {
+        result.listen = std::string(port);
+    }
+    result.target = fmt::format("{}:{}", host, hostPort);
+    return result;
 }
 
-InputStreamToSslForwarder::InputStreamToSslForwarder(std::function<void()> tick, GInputStream *input_stream, SSL *ssl_stream)
-    : _tick(tick), _input_stream(input_stream), _ssl_stream(ssl_stream) {
-    startAsyncRead();
+// Splits "[bind:]port", an IPv6 bind address may be in brackets.
+static bool splitListenAddress(const std::string &address, std::string &bindAddress, uint16_t &port) {
+    size_t colon = address.rfind(':');
+    bindAddress = colon == std::string::npos ? "" : address.substr(0, colon);
+    std::string portString = colon == std::string::npos ? address : address.substr(colon + 1);
+    if (bindAddress.size() >= 2 && bindAddress.front() == '[' && bindAddress.back() == ']') {
+        bindAddress = bindAddress.substr(1, bindAddress.size() - 2);
+    }
+    auto [ptr, ec] = std::from_chars(portString.data(), portString.data() + portString.size(), port);
+    return ec == std::errc{} && ptr == portString.data() + portString.size();
+}
 
+// Listens on port of bindAddress, which has to be an IP address. Without a bind address only the loopback interface
+// is used, other machines can only connect if a bind address like 0.0.0.0 is given explicitly.
+static bool addListenAddress(GSocketListener *listener, const std::string &bindAddress, uint16_t port,
+                             GError **error) {
+    if (bindAddress.empty()) {
+        if (!addListenAddress(listener, "127.0.0.1", port, error)) {
+            return false;
+        }
+        // IPv6 may be disabled
+        addListenAddress(listener, "::1", port, nullptr);
+        return true;
+    }
+    GSocketAddress *socketAddress = g_inet_socket_address_new_from_string(bindAddress.data(), port);
+    if (!socketAddress) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Can't parse bind address '%s', it needs to be an IP address", bindAddress.data());
+        return false;
+    }
+    bool ok = g_socket_listener_add_address(listener, socketAddress, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                            nullptr, nullptr, error);
+    g_object_unref(socketAddress);
+    return ok;
 }
 
-void InputStreamToSslForwarder::quicPoll() {
-    if (_buffer_filled) {
-        size_t written = -1;
-        int ret = SSL_write_ex(_ssl_stream, _buffer.data() + _buffer_transmitted,
-                               _buffer_filled - _buffer_transmitted,
-                               &written);
-        if (ret > 0) {
-            if (written) {
-                _buffer_transmitted += written;
-                if (_buffer_filled == _buffer_transmitted) {
-                    _buffer_filled = 0;
-                    _buffer_transmitted = 0;
-                    startAsyncRead();
-                }
-            } else {
-                // Workaround for https://github.com/openssl/openssl/issues/23606
-                //log(LOG_QUIC, "Successful write, but written 0 bytes, tried to write {} bytes\n", _buffer_filled - _buffer_transmitted);
-            }
-        } else {
-            log(LOG_QUIC, "write data: len={}\n", _buffer_filled - _buffer_transmitted);
-            int ssl_error = SSL_get_error(_ssl_stream, written);
-            if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE) {
-                fatal_ossl("write failed:\n");
-            }
+ForwardMode::ForwardMode(std::vector<ForwardSpec> specs, bool allowRemoteBind)
+    : _specs(std::move(specs)), _allowRemoteBind(allowRemoteBind) {
+    _socketClient = g_socket_client_new();
+    for (const ForwardSpec &spec : _specs) {
+        if (!spec.remote && !listen(spec.listen, spec.target, false)) {
+            fatal("Can't set up forwarding from {}\n", spec.listen);
         }
     }
 }
 
-void InputStreamToSslForwarder::localReadCallback(GObject *source_object, GAsyncResult *res) {
-    (void)source_object;
-    gssize read = g_input_stream_read_finish(_input_stream, res, nullptr);
-    log(LOG_FWD, "FWD: read finished\n");
+void ForwardMode::connectionMade(std::function<void()> tick, RemoteConnection *connection) {
+    _tick = tick;
+    q_connection = connection;
+    _bridged = true;
+
+    for (const ForwardSpec &spec : _specs) {
+        if (spec.remote) {
+            std::string header = "R";
+            appendHeaderString(header, spec.listen);
+            appendHeaderString(header, spec.target);
+            SSL *stream = openPayloadStream(q_connection, header);
+            log(LOG_FWD, "Requesting remote forwarding from {} to {}\n", spec.listen, spec.target);
+            // the header is still delivered after freeing a concluded stream
+            SSL_stream_conclude(stream, 0);
+            SSL_free(stream);
+        }
+    }
+
+    for (auto &[localConnection, target] : _pendingConnections) {
+        bridgeConnection(localConnection, target);
+    }
+    _pendingConnections.clear();
+}
+
+bool ForwardMode::listen(const std::string &address, const std::string &target, bool peerRequest) {
+    std::string bindAddress;
+    uint16_t port = 0;
+    if (!splitListenAddress(address, bindAddress, port)) {
+        writeUserMessage({
+                             {"event", "error"},
+                             {"message", "Can't parse port"},
+                             {"address", address},
+                         },
+                         "Can't parse port in '{}'\n", address);
+        return false;
+    }
 
-    if (read == 0) {
-        if (!onClose) {
+    if (peerRequest && !bindAddress.empty() && !_allowRemoteBind) {
+        GInetAddress *inetAddress = g_inet_address_new_from_string(bindAddress.data());
+        bool loopback = inetAddress && g_inet_address_get_is_loopback(inetAddress);
+        if (inetAddress) {
+            g_object_unref(inetAddress);
+        }
+        if (!loopback) {
             writeUserMessage({
-                                 {"event", "connection-close"},
+                                 {"event", "error"},
+                                 {"message", "Peer requested a non loopback bind address"},
+                                 {"address", address},
                              },
-                             "connection close\n");
-            // TODO
-            exit(0);
-        } else {
-            onClose();
+                             "Not listening on {} for the other side, other interfaces than loopback need "
+                             "--allow-remote-bind\n", address);
+            return false;
         }
-        return;
     }
 
-    //log(LOG_FWD, "read local input: {}\n", std::string_view((const char*)_buffer.data(), read));
-    log(LOG_FWD, "read local input: {}\n", read);
+    GSocketListener *socketListener = g_socket_listener_new();
+    GError *error = nullptr;
+    if (!addListenAddress(socketListener, bindAddress, port, &error)) {
+        writeUserMessage({
+                             {"event", "error"},
+                             {"message", error->message},
+                             {"address", address},
+                         },
+                         "Can't listen on {}: {}\n", address, error->message);
+        g_error_free(error);
+        g_object_unref(socketListener);
+        return false;
+    }
+
+    Listener &listener = _listeners.emplace_back();
+    listener.mode = this;
+    listener.listener = socketListener;
+    listener.target = target;
+    g_socket_listener_accept_async(listener.listener, nullptr, wrap_acceptCallback, &listener);
+    log(LOG_FWD, "Forwarding connections to {} to {}\n", address, target);
+    return true;
+}
 
-    size_t written;
-    int ret = SSL_write_ex(_ssl_stream, _buffer.data(), read, &written);
-    log(LOG_FWD, "write returned {} and wrote {} bytes\n", ret, written);
-    if (ret == 1) {
-        // written can be == 0 here, see https://github.com/openssl/openssl/issues/23606
-        if (written != read) {
-            _buffer_filled = read;
-            _buffer_transmitted = written;
+void ForwardMode::acceptCallback(Listener &listener, GAsyncResult *res) {
+    GSocketConnection *localConnection = g_socket_listener_accept_finish(listener.listener, res, nullptr, nullptr);
+    g_socket_listener_accept_async(listener.listener, nullptr, wrap_acceptCallback, &listener);
+    if (localConnection) {
+        log(LOG_FWD, "Incoming connection for {}\n", listener.target);
+        if (_bridged) {
+            bridgeConnection(localConnection, listener.target);
+            _tick();
+        } else {
+            _pendingConnections.emplace_back(localConnection, listener.target);
         }
     } else {
-        int ssl_error = SSL_get_error(_ssl_stream, written);
-        if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE) {
-            fatal_ossl("write failed:\n");
+        log(LOG_FWD, "accpet failed\n");
+    }
+}
+
+void ForwardMode::wrap_acceptCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    (void)source_object;
+    auto listener = reinterpret_cast<Listener*>(user_data);
+    listener->mode->acceptCallback(*listener, res);
+}
+
+void ForwardMode::bridgeConnection(GSocketConnection *localConnection, const std::string &target) {
+    std::string header = "T";
+    appendHeaderString(header, target);
+    SSL *bridgeStream = openPayloadStream(q_connection, header);
+
+    log(LOG_FWD, "Bridging local connection to stream {} for {}\n", SSL_get_stream_id(bridgeStream), target);
+    _bridges.emplace_back(_tick, bridgeStream).start(localConnection);
+}
+
+int ForwardMode::handleQuicStreamOpened(SSL *stream) {
+    _pendingStreams.push_back({stream, {}});
+    return 0;
+}
+
+void ForwardMode::streamHeaderReceived(SSL *stream, const std::string &header) {
+    std::vector<std::string> strings = splitHeaderStrings(header);
+
+    if (header[0] == 'T' || header[0] == 'C') {
+        GError *error = nullptr;
+        GSocketConnectable *target = g_network_address_parse(strings[0].data(), 0, &error);
+        if (!target) {
+            log(LOG_FWD, "Can't parse forwarding target '{}': {}\n", strings[0], error->message);
+            g_error_free(error);
+            SSL_stream_reset(stream, nullptr, 0);
+            SSL_free(stream);
+            return;
         }
+        log(LOG_FWD, "Forwarding stream {} to {}\n", SSL_get_stream_id(stream), strings[0]);
+        _bridges.emplace_back(_tick, stream).connectLocal(_socketClient, target, header[0] == 'C');
+        g_object_unref(target);
+    } else if (header[0] == 'R') {
+        log(LOG_FWD, "Peer requests forwarding from {} to {}\n", strings[0], strings[1]);
+        listen(strings[0], strings[1], true);
+        SSL_free(stream);
+    } else {
+        log(LOG_FWD, "Stream {} has no forwarding target, both sides need to use forward\n",
+            SSL_get_stream_id(stream));
+        SSL_stream_reset(stream, nullptr, 0);
+        SSL_free(stream);
     }
+}
 
-    _tick();
-    if (!_buffer_filled) {
-        startAsyncRead();
+void ForwardMode::quicPoll() {
+    _pendingStreams.remove_if([this] (PendingStream &pending) {
+        int ret = readStreamHeader(pending.stream, pending.header);
+        if (ret < 0) {
+            log(LOG_FWD, "Stream {} ended before its header\n", SSL_get_stream_id(pending.stream));
+            SSL_free(pending.stream);
+            return true;
+        } else if (ret == 0) {
+            return false;
+        }
+        streamHeaderReceived(pending.stream, pending.header);
+        return true;
+    });
+
+    for (StreamBridge &bridge : _bridges) {
+        bridge.quicPoll();
     }
+    _bridges.remove_if([] (const StreamBridge &bridge) { return bridge.finished(); });
 }
 
-void InputStreamToSslForwarder::wrap_localReadCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
-    reinterpret_cast<InputStreamToSslForwarder*>(user_data)->localReadCallback(source_object, res);
+struct SocksReply {
+    GSocketConnection *connection = nullptr;
+    std::string data;
+    std::function<void(bool)> done;
+};
+
+static void wrap_socksReplyWritten(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    auto reply = reinterpret_cast<SocksReply*>(user_data);
+    bool ok = g_output_stream_write_all_finish((GOutputStream*)source_object, res, nullptr, nullptr);
+    if (!ok) {
+        log(LOG_FWD, "Writing SOCKS reply failed\n");
+    }
+    if (reply->done) {
+        reply->done(ok);
+    }
+    g_object_unref(reply->connection);
+    delete reply;
 }
 
-void InputStreamToSslForwarder::startAsyncRead() {
-    log(LOG_FWD, "FWD: read started\n");
-    g_input_stream_read_async(_input_stream,
-                              _buffer.data(), _buffer.size(),
-                              G_PRIORITY_DEFAULT, nullptr, wrap_localReadCallback, this);
+// done(ok) is called once the reply is written, only one operation at a time may use the output of connection
+static void writeSocksReply(GSocketConnection *connection, std::string_view data, std::function<void(bool)> done) {
+    auto reply = new SocksReply{(GSocketConnection*)g_object_ref(connection), std::string(data), done};
+    GOutputStream *output = g_io_stream_get_output_stream((GIOStream*)connection);
+    g_output_stream_write_all_async(output, reply->data.data(), reply->data.size(), G_PRIORITY_DEFAULT, nullptr,
+                                    wrap_socksReplyWritten, reply);
 }
 
-ListenMode::ListenMode(uint16_t port) : _port(port) {
+SocksMode::SocksMode(const std::string &address) {
+    std::string bindAddress;
+    uint16_t port = 0;
+    if (!splitListenAddress(address, bindAddress, port)) {
+        fatal("Can't parse port in '{}'\n", address);
+    }
     _listener = g_socket_listener_new();
-    g_socket_listener_add_inet_port(_listener, _port, nullptr, nullptr);
+    GError *error = nullptr;
+    if (!addListenAddress(_listener, bindAddress, port, &error)) {
+        fatal("Can't listen on {}: {}\n", address, error->message);
+    }
     g_socket_listener_accept_async(_listener, nullptr, wrap_acceptCallback, this);
 }
 
-void ListenMode::connectionMade(std::function<void()> tick, RemoteConnection *connection) {
+void SocksMode::connectionMade(std::function<void()> tick, RemoteConnection *connection) {
     _tick = tick;
     q_connection = connection;
     _bridged = true;
-    if (_localConnection) {
-        fatal("Code for local connection before quic auth not yet done");
-        socket_to_ssl_forwarder.emplace(_tick, _localInputStream, _bridgeStream);
+    for (const PendingConnection &pending : _pendingConnections) {
+        bridgeConnection(pending);
     }
+    _pendingConnections.clear();
 }
 
-int ListenMode::handleQuicStreamOpened(SSL *stream) {
+int SocksMode::handleQuicStreamOpened(SSL *stream) {
     fatal("Unexpected stream\n");
 
     return 0;
 }
 
-void ListenMode::quicPoll() {
-    if (socket_to_ssl_forwarder) {
-        socket_to_ssl_forwarder->quicPoll();
+void SocksMode::quicPoll() {
+    _connecting.remove_if([this] (const Connecting &connecting) {
+        char confirm;
+        int read = quicReadOrEof(connecting.stream, &confirm, 1);
+        if (read == 0) {
+            return false;
+        }
+        GSocketConnection *localConnection = connecting.connection;
+        SSL *stream = connecting.stream;
+        if (read < 0) {
+            log(LOG_FWD, "Other side can't connect to {}\n", connecting.target);
+            SSL_free(stream);
+            writeSocksReply(localConnection, "\x05\x04\x00\x01\x00\x00\x00\x00\x00\x00"sv,
+                            [localConnection] (bool) {
+                g_io_stream_close((GIOStream*)localConnection, nullptr, nullptr);
+                g_object_unref(localConnection);
+            });
+            return true;
+        }
+
+        log(LOG_FWD, "Bridging SOCKS connection to stream {} for {}\n", SSL_get_stream_id(stream), connecting.target);
+        // the bridge only starts after the reply, so its writes don't overlap with it
+        writeSocksReply(localConnection, "\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00"sv,
+                        [this, localConnection, stream] (bool ok) {
+            if (!ok) {
+                SSL_stream_reset(stream, nullptr, 0);
+                SSL_free(stream);
+                g_io_stream_close((GIOStream*)localConnection, nullptr, nullptr);
+                g_object_unref(localConnection);
+                _tick();
+                return;
+            }
+            _bridges.emplace_back(_tick, stream).start(localConnection);
+            _tick();
+        });
+        return true;
+    });
+
+    for (StreamBridge &bridge : _bridges) {
+        bridge.quicPoll();
     }
-    if (ssl_to_socket_forwarder) {
-        ssl_to_socket_forwarder->quicPoll();
+    _bridges.remove_if([] (const StreamBridge &bridge) { return bridge.finished(); });
+}
+
+void SocksMode::acceptCallback(GAsyncResult *res) {
+    GSocketConnection *localConnection = g_socket_listener_accept_finish(_listener, res, nullptr, nullptr);
+    g_socket_listener_accept_async(_listener, nullptr, wrap_acceptCallback, this);
+    if (localConnection) {
+        log(LOG_FWD, "Incoming SOCKS connection\n");
+        Handshake &handshake = _handshakes.emplace_back();
+        handshake.mode = this;
+        handshake.connection = localConnection;
+        readHandshake(handshake);
+    } else {
+        log(LOG_FWD, "accpet failed\n");
     }
 }
 
-void ListenMode::acceptCallback(GObject *source_object, GAsyncResult *res) {
-    if (_localConnection) {
-        writeUserMessage({
-                             {"event", "error"},
-                             {"message", "Only one connection implemented."},
-                         },
-                         "Error: Only one connection implemented.\n");
+void SocksMode::wrap_acceptCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    (void)source_object;
+    reinterpret_cast<SocksMode*>(user_data)->acceptCallback(res);
+}
+
+void SocksMode::readHandshake(Handshake &handshake) {
+    GInputStream *input = g_io_stream_get_input_stream((GIOStream*)handshake.connection);
+    g_input_stream_read_async(input, handshake.buf, sizeof(handshake.buf), G_PRIORITY_DEFAULT, nullptr,
+                              wrap_readCallback, &handshake);
+}
+
+void SocksMode::wrap_readCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    (void)source_object;
+    auto handshake = reinterpret_cast<Handshake*>(user_data);
+    handshake->mode->readCallback(*handshake, res);
+}
+
+void SocksMode::readCallback(Handshake &handshake, GAsyncResult *res) {
+    GInputStream *input = g_io_stream_get_input_stream((GIOStream*)handshake.connection);
+    gssize read = g_input_stream_read_finish(input, res, nullptr);
+    if (read <= 0) {
+        log(LOG_FWD, "SOCKS client closed connection during handshake\n");
+        dropHandshake(handshake);
         return;
     }
-    (void)source_object;
-    _localConnection = g_socket_listener_accept_finish(_listener, res, nullptr, nullptr);
-    if (_localConnection) {
-        _localInputStream = g_io_stream_get_input_stream((GIOStream*)_localConnection);
-        _localOutputStream = g_io_stream_get_output_stream((GIOStream*)_localConnection);
-        auto remoteAddr = g_socket_connection_get_remote_address(_localConnection, nullptr);
-        auto remoteInetAddr = g_inet_socket_address_get_address((GInetSocketAddress*)remoteAddr);
-        log(LOG_FWD, "Incoming connection from {}:{}\n", g_inet_address_to_string(remoteInetAddr),
-            g_inet_socket_address_get_port((GInetSocketAddress*)remoteAddr));
-        if (_bridged) {
-            _bridgeStream = SSL_new_stream(q_connection->ssl(), 0);
-            if (!_bridgeStream) {
-                fatal_ossl("SSL_new_stream for bridging:\n");
-            }
-            // Stream open only is send if data is written to the stream
-            size_t written = -1;
-            int ret = SSL_write_ex(_bridgeStream, "X", 1, &written);
-            if (ret != 1 || written != 1) {
-                fatal_ossl("Failed in initial write to payload stream:\n");
-            }
+    handshake.received.append(handshake.buf, read);
+    continueHandshake(handshake);
+}
 
-            SSL_set_mode(_bridgeStream, SSL_MODE_ENABLE_PARTIAL_WRITE);
-            socket_to_ssl_forwarder.emplace(_tick, _localInputStream, _bridgeStream);
-            ssl_to_socket_forwarder.emplace(_tick, _bridgeStream, _localOutputStream);
+void SocksMode::continueHandshake(Handshake &handshake) {
+    PendingConnection pending;
+    HandshakeState state = advanceHandshake(handshake, pending);
+    if (state == HandshakeState::needMore) {
+        readHandshake(handshake);
+    } else if (state == HandshakeState::replying) {
+        // continued by the reply callback
+    } else if (state == HandshakeState::failed) {
+        dropHandshake(handshake);
+    } else {
+        handshake.connection = nullptr;
+        dropHandshake(handshake);
+        if (_bridged) {
+            bridgeConnection(pending);
             _tick();
+        } else {
+            _pendingConnections.push_back(std::move(pending));
         }
-    } else {
-        log(LOG_FWD, "accpet failed\n");
     }
 }
 
-void ListenMode::wrap_acceptCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
-    reinterpret_cast<ListenMode*>(user_data)->acceptCallback(source_object, res);
+SocksMode::HandshakeState SocksMode::replyAndDrop(Handshake &handshake, std::string_view reply) {
+    writeSocksReply(handshake.connection, reply, [this, &handshake] (bool) {
+        dropHandshake(handshake);
+    });
+    return HandshakeState::replying;
 }
 
-ConnectMode::ConnectMode(std::string hostAndPort) : _hostAndPort(hostAndPort) {
-    _socketClient = g_socket_client_new();
-}
+SocksMode::HandshakeState SocksMode::advanceHandshake(Handshake &handshake, PendingConnection &result) {
+    std::string &received = handshake.received;
+    if (received.size() && received[0] != 5) {
+        log(LOG_FWD, "Not a SOCKS5 client\n");
+        return HandshakeState::failed;
+    }
 
-void ConnectMode::connectionMade(std::function<void()> tick, RemoteConnection *connection) {
-    _tick = tick;
-    q_connection = connection;
-    _bridged = true;
-    g_socket_client_connect_to_host_async(_socketClient, _hostAndPort.data(), 443, nullptr,
-                                          wrap_localConnectCallback, this);
-}
+    if (!handshake.greeted) {
+        if (received.size() < 2) {
+            return HandshakeState::needMore;
+        }
+        size_t methods = (unsigned char)received[1];
+        if (received.size() < 2 + methods) {
+            return HandshakeState::needMore;
+        }
+        if (received.find('\0', 2) >= 2 + methods) {
+            log(LOG_FWD, "SOCKS client does not offer connecting without authentication\n");
+            return replyAndDrop(handshake, "\x05\xff"sv);
+        }
+        received.erase(0, 2 + methods);
+        handshake.greeted = true;
+        // a request that already arrived is handled once the reply is written
+        writeSocksReply(handshake.connection, "\x05\x00"sv, [this, &handshake] (bool ok) {
+            if (ok) {
+                continueHandshake(handshake);
+            } else {
+                dropHandshake(handshake);
+            }
+        });
+        return HandshakeState::replying;
+    }
 
-int ConnectMode::handleQuicStreamOpened(SSL *stream) {
-    _bridgeStream = stream;
-    SSL_set_mode(_bridgeStream, SSL_MODE_ENABLE_PARTIAL_WRITE);
-    char buf[1];
-    size_t readbytes = -1;
-    int ret = SSL_read_ex(_bridgeStream, buf, 1, &readbytes);
-    if (ret != 1) {
-        fatal_ossl("initial read on payload stream failed:\n");
+    // version, command, reserved, address type, address, port
+    if (received.size() < 5) {
+        return HandshakeState::needMore;
     }
-    if (readbytes != 1) {
-        fatal("initial read on payload stream wrong sizes: {}\n", readbytes);
+    unsigned char command = received[1];
+    unsigned char addressType = received[3];
+    size_t addressLength = addressType == 1 ? 4 : addressType == 4 ? 16
+                         : addressType == 3 ? 1 + (unsigned char)received[4] : 0;
+    if (!addressLength) {
+        return replyAndDrop(handshake, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00"sv);
     }
-    if (buf[0] != 'X') {
-        fatal("initial read on payload stream unexpected data: {}\n", buf[0]);
+    if (received.size() < 4 + addressLength + 2) {
+        return HandshakeState::needMore;
+    }
+    if (command != 1) {
+        log(LOG_FWD, "Unsupported SOCKS command {}\n", command);
+        return replyAndDrop(handshake, "\x05\x07\x00\x01\x00\x00\x00\x00\x00\x00"sv);
     }
-    _ssl_to_socket_forwarder.emplace(_tick, _bridgeStream, _localOutputStream);
-    _socket_to_ssl_forwarder.emplace(_tick, _localInputStream, _bridgeStream);
-    return 0;
-}
 
-void ConnectMode::quicPoll() {
-    if (_ssl_to_socket_forwarder) {
-        _ssl_to_socket_forwarder->quicPoll();
+    std::string host;
+    if (addressType == 3) {
+        host = received.substr(5, addressLength - 1);
+    } else {
+        GInetAddress *address = g_inet_address_new_from_bytes((const guint8*)received.data() + 4,
+            addressType == 1 ? G_SOCKET_FAMILY_IPV4 : G_SOCKET_FAMILY_IPV6);
+        char *addressString = g_inet_address_to_string(address);
+        host = addressType == 4 ? fmt::format("[{}]", addressString) : addressString;
+        g_free(addressString);
+        g_object_unref(address);
     }
-    if (_socket_to_ssl_forwarder) {
-        _socket_to_ssl_forwarder->quicPoll();
+    uint16_t port = ((unsigned char)received[4 + addressLength]) << 8 | (unsigned char)received[5 + addressLength];
+    std::string target = fmt::format("{}:{}", host, port);
+    if (target.size() > 255) {
+        return replyAndDrop(handshake, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00"sv);
     }
+
+    // the reply is sent once the other side connected to the target
+    result.connection = handshake.connection;
+    result.target = target;
+    result.initialData = received.substr(4 + addressLength + 2);
+    return HandshakeState::done;
 }
 
-void ConnectMode::localConnectCallback(GObject *source_object, GAsyncResult *res) {
-    (void)source_object;
-    GError *error = nullptr;
-    _localConnection = g_socket_client_connect_to_host_finish(_socketClient, res, &error);
-    if (error) {
-        fatal("Error: {}\n", error->message);
-        g_error_free(error);
-        return;
+void SocksMode::dropHandshake(Handshake &handshake) {
+    if (handshake.connection) {
+        g_io_stream_close((GIOStream*)handshake.connection, nullptr, nullptr);
+        g_object_unref(handshake.connection);
     }
-
-    _localOutputStream = g_io_stream_get_output_stream((GIOStream*)_localConnection);
-    _localInputStream = g_io_stream_get_input_stream((GIOStream*)_localConnection);
+    _handshakes.remove_if([&handshake] (const Handshake &entry) { return &entry == &handshake; });
 }
 
-void ConnectMode::wrap_localConnectCallback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
-    reinterpret_cast<ConnectMode*>(user_data)->localConnectCallback(source_object, res);
+void SocksMode::bridgeConnection(const PendingConnection &pending) {
+    std::string header = "C";
+    appendHeaderString(header, pending.target);
+    // data sent before the reply was received goes right after the header, framed like the rest of the stream
+    if (streamCompression) {
+        StreamCompressor compressor;
+        for (size_t pos = 0; pos < pending.initialData.size(); pos += maxCompressionChunk) {
+            size_t len = std::min(maxCompressionChunk, pending.initialData.size() - pos);
+            compressor.compress(pending.initialData.data() + pos, len, header);
+        }
+    } else {
+        header += pending.initialData;
+    }
+    SSL *bridgeStream = openPayloadStream(q_connection, header);
+
+    log(LOG_FWD, "Requesting connection to {} on stream {}\n", pending.target, SSL_get_stream_id(bridgeStream));
+    _connecting.push_back({pending.connection, bridgeStream, pending.target});
 }
 
 StdioModeA::StdioModeA() {
@@ -275,30 +2345,29 @@ void StdioModeA::connectionMade(std::function<void ()> tick, RemoteConnection *c
     _tick = tick;
     q_connection = connection;
     _bridged = true;
-
-    _localOutputStream = g_unix_output_stream_new(1, false);
-    _localInputStream = g_unix_input_stream_new(0, false);
 }
 
 int StdioModeA::handleQuicStreamOpened(SSL *stream) {
-    _bridgeStream = stream;
-    SSL_set_mode(_bridgeStream, SSL_MODE_ENABLE_PARTIAL_WRITE);
-    char buf[1];
-    size_t readbytes = -1;
-    int ret = SSL_read_ex(_bridgeStream, buf, 1, &readbytes);
-    if (ret != 1) {
-        fatal_ossl("initial read on payload stream failed:\n");
-    }
-    if (readbytes != 1) {
-        fatal("initial read on payload stream wrong sizes: {}\n", readbytes);
-    }
-    if (buf[0] != 'X') {
-        fatal("initial read on payload stream unexpected data: {}\n", buf[0]);
+    char marker = readStreamMarker(stream);
+    if (marker == 'S' || marker == 'L') {
+        if (marker == 'S') {
+            unsigned char count = (unsigned char)readStreamMarker(stream);
+            _stripeExpected = count + 1;
+            // the primary stream comes first, the order of the others doesn't matter
+            _stripeStreams.insert(_stripeStreams.begin(), stream);
+        } else {
+            _stripeStreams.push_back(stream);
+        }
+        if ((int)_stripeStreams.size() == _stripeExpected) {
+            startStriped();
+        }
+        return 0;
+    } else if (marker != 'X') {
+        fatal("initial read on payload stream unexpected data: {}\n", marker);
     }
-    _ssl_to_socket_forwarder.emplace(_tick, _bridgeStream, _localOutputStream);
-    _socket_to_ssl_forwarder.emplace(_tick, _localInputStream, _bridgeStream);
 
-    _socket_to_ssl_forwarder->onClose = [this] {
+    _bridge.emplace(_tick, stream);
+    _bridge->onLocalClose = [this] {
         writeUserMessage({
                              {"event", "connection-close"},
                          },
@@ -306,16 +2375,31 @@ int StdioModeA::handleQuicStreamOpened(SSL *stream) {
         q_connection->shutdown();
         _tick();
     };
+    _bridge->startStdio();
 
     return 0;
 }
 
+void StdioModeA::startStriped() {
+    _striped.emplace(_tick, _stripeStreams);
+    _stripeStreams.clear();
+    _striped->onLocalClose = [this] {
+        writeUserMessage({
+                             {"event", "connection-close"},
+                         },
+                         "connection closed\n");
+        q_connection->shutdown();
+        _tick();
+    };
+    _striped->startStdio();
+}
+
 void StdioModeA::quicPoll() {
-    if (_ssl_to_socket_forwarder) {
-        _ssl_to_socket_forwarder->quicPoll();
+    if (_bridge) {
+        _bridge->quicPoll();
     }
-    if (_socket_to_ssl_forwarder) {
-        _socket_to_ssl_forwarder->quicPoll();
+    if (_striped) {
+        _striped->quicPoll();
     }
 }
 
@@ -325,27 +2409,16 @@ StdioModeB::StdioModeB() {
 void StdioModeB::connectionMade(std::function<void ()> tick, RemoteConnection *connection) {
     _tick = tick;
     q_connection = connection;
-    _bridged = true;
+    startBridge();
+}
 
-    _bridgeStream = SSL_new_stream(q_connection->ssl(), 0);
-    if (!_bridgeStream) {
-        fatal_ossl("SSL_new_stream for bridging:\n");
-    }
-    // Stream open only is send if data is written to the stream
-    size_t written = -1;
-    int ret = SSL_write_ex(_bridgeStream, "X", 1, &written);
-    if (ret != 1 || written != 1) {
-        fatal_ossl("Failed in initial write to payload stream:\n");
+void StdioModeB::startBridge() {
+    if (_bridged || !q_connection->lanesSettled()) {
+        return;
     }
+    _bridged = true;
 
-    SSL_set_mode(_bridgeStream, SSL_MODE_ENABLE_PARTIAL_WRITE);
-
-    _localOutputStream = g_unix_output_stream_new(1, false);
-    _localInputStream = g_unix_input_stream_new(0, false);
-
-    _ssl_to_socket_forwarder.emplace(_tick, _bridgeStream, _localOutputStream);
-    _socket_to_ssl_forwarder.emplace(_tick, _localInputStream, _bridgeStream);
-    _socket_to_ssl_forwarder->onClose = [this] {
+    auto onLocalClose = [this] {
         writeUserMessage({
                              {"event", "connection-close"},
                          },
@@ -353,6 +2426,25 @@ void StdioModeB::connectionMade(std::function<void ()> tick, RemoteConnection *c
         q_connection->shutdown();
         _tick();
     };
+
+    std::vector<SSL*> lanes = q_connection->lanes();
+    if (lanes.size()) {
+        std::vector<SSL*> streams;
+        streams.push_back(openPayloadStream(q_connection, std::string{'S', (char)lanes.size()}));
+        for (SSL *lane : lanes) {
+            streams.push_back(openStream(lane, "L"));
+        }
+        _striped.emplace(_tick, streams);
+        _striped->onLocalClose = onLocalClose;
+        _striped->startStdio();
+        return;
+    }
+
+    SSL *bridgeStream = openPayloadStream(q_connection);
+
+    _bridge.emplace(_tick, bridgeStream);
+    _bridge->onLocalClose = onLocalClose;
+    _bridge->startStdio();
 }
 
 int StdioModeB::handleQuicStreamOpened(SSL *stream) {
@@ -362,10 +2454,13 @@ int StdioModeB::handleQuicStreamOpened(SSL *stream) {
 }
 
 void StdioModeB::quicPoll() {
-    if (_ssl_to_socket_forwarder) {
-        _ssl_to_socket_forwarder->quicPoll();
+    if (!_bridged && q_connection) {
+        startBridge();
     }
-    if (_socket_to_ssl_forwarder) {
-        _socket_to_ssl_forwarder->quicPoll();
+    if (_bridge) {
+        _bridge->quicPoll();
+    }
+    if (_striped) {
+        _striped->quicPoll();
     }
 }
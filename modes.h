@@ -1,6 +1,14 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/socket.h>
 
 #include <openssl/ssl.h>
 
@@ -8,29 +16,142 @@
 #include <gio/gio.h>
 //#include <libsoup/soup.h>
 
+#include "buffers.h"
+#include "compression.h"
+#include "uringforwarder.h"
 #include "utils.h"
 #include "peersock.h"
 
+enum class ForwarderBackend {
+    gio,
+    native,
+    // falls back to native if io_uring is not available
+    uring,
+};
+
+extern ForwarderBackend forwarderBackend;
+
+enum class TrafficProfile {
+    // buffer sizes and write batching as configured globally
+    standard,
+    // small buffers, every chunk is written right away, TCP_NODELAY on local sockets
+    interactive,
+    // large buffers, local writes are coalesced and the socket is corked while more data is buffered
+    bulk,
+    // each connection starts interactive and is switched to bulk while its reads keep coming in large chunks
+    automatic,
+};
+
+extern TrafficProfile trafficProfile;
+
+// Tuning of one bridged connection according to its traffic profile, shared by the forwarders of the connection.
+class ConnectionProfile {
+public:
+    explicit ConnectionProfile(TrafficProfile profile);
+
+    // TCP socket of the local connection for TCP_NODELAY and TCP_CORK, other sockets and pipes are left alone
+    void setSocket(GSocket *socket);
+
+    // capacities of the forwarder buffers
+    size_t localToQuic() const;
+    size_t quicToLocal() const;
+    WriteBatchLimits batchLimits() const;
+
+    // called with the size of each read (local or from the QUIC stream) and the space that was offered for it
+    void observeRead(size_t bytes, size_t offered);
+
+    // corks the socket in bulk mode while more data follows the current write
+    void setMoreToWrite(bool more);
+
+private:
+    void applySocketOptions();
+
+    static constexpr size_t _interactiveBufferSize = 64*1024;
+    static constexpr size_t _bulkBufferSize = 8*1024*1024;
+    // reads of at least this size count as bulk, reads below _smallRead as interactive
+    static constexpr size_t _largeRead = 8*1024;
+    static constexpr size_t _smallRead = 1024;
+    static constexpr unsigned _readsToSwitch = 8;
+
+    TrafficProfile _profile;
+    // interactive or bulk for the automatic profile
+    TrafficProfile _current;
+    int _tcpFd = -1;
+    bool _corked = false;
+    unsigned _largeReads = 0;
+    unsigned _smallReads = 0;
+};
+
+// Holds back small local writes for up to WriteBatchLimits::maxDelay so data of several QUIC reads goes out in one
+// write.
+class WriteBatchTimer {
+public:
+    explicit WriteBatchTimer(std::function<void()> flush);
+    ~WriteBatchTimer();
+
+    WriteBatchTimer(const WriteBatchTimer&) = delete;
+    WriteBatchTimer &operator=(const WriteBatchTimer&) = delete;
+
+    // Returns true if a write of `buffered` bytes should wait, `more` tells if more data can still arrive.
+    // Arms the timer that calls flush when the batch is due.
+    bool hold(size_t buffered, bool more, const WriteBatchLimits &limits);
+    bool holding() const { return _timer != 0; }
+
+private:
+    static gboolean wrap_timeout(gpointer user_data);
+
+    std::function<void()> _flush;
+    guint _timer = 0;
+    bool _due = false;
+};
+
+// Reads from the QUIC stream into a buffer while the previous local write is still in flight.
 class SslToOutputStreamForwarder {
 public:
-    SslToOutputStreamForwarder(std::function<void()> tick, SSL *ssl_stream, GOutputStream *output_stream);
+    SslToOutputStreamForwarder(std::function<void()> tick, ConnectionProfile &profile, SSL *ssl_stream,
+                               GOutputStream *output_stream);
 
     void quicPoll();
 
+    bool closed() const { return _closed; }
+
+    // called when the remote side concluded the stream or the local write failed
+    std::function<void()> onClose;
+
 private:
+    void startAsyncWrite();
+    void close();
+
     std::function<void()> _tick;
+    ConnectionProfile &_profile;
     SSL *_ssl_stream = nullptr;
     GOutputStream *_output_stream = nullptr;
+    bool _closed = false;
+    bool _remoteConcluded = false;
+
+    static constexpr int _maxVectors = 64;
+    SlabBuffer _buffer{bufferSizes.quicToLocal};
+    GOutputVector _vectors[_maxVectors];
+    size_t _write_len = 0;
+    bool _write_busy = false;
+    WriteBatchTimer _batch{[this] { startAsyncWrite(); }};
 
-    static constexpr size_t _bufferSize = 2*1024*1024;
-    std::array<std::byte, _bufferSize> _buffer;
-    int _buffer_used = 0;
-    bool _buffer_busy = false;
+    // with streamCompression stream data goes through the decompressor and _decompressed into _buffer
+    std::optional<StreamDecompressor> _decompressor;
+    std::string _decompressed;
+
+    ThroughputCounter _throughput;
 };
 
+// Writes buffered data to the QUIC stream while the next local read is already in flight.
 class InputStreamToSslForwarder {
 public:
-    InputStreamToSslForwarder(std::function<void()> tick, GInputStream *input_stream, SSL *ssl_stream);
+    InputStreamToSslForwarder(std::function<void()> tick, ConnectionProfile &profile, GInputStream *input_stream,
+                              SSL *ssl_stream);
+    ~InputStreamToSslForwarder();
+
+    InputStreamToSslForwarder(const InputStreamToSslForwarder&) = delete;
+    InputStreamToSslForwarder &operator=(const InputStreamToSslForwarder&) = delete;
 
     void quicPoll();
 
@@ -40,21 +161,287 @@ public:
 
     void startAsyncRead();
 
+    bool closed() const { return _closed; }
+
+    // called when the local input reached eof or the remote side stopped the stream, the QUIC connection stays up
     std::function<void()> onClose;
 
 private:
+    void transmitBuffered();
+
+    std::function<void()> _tick;
+    ConnectionProfile &_profile;
+    GInputStream *_input_stream = nullptr;
+    SSL *_ssl_stream = nullptr;
+    bool _closed = false;
+    bool _eof = false;
+
+    SlabBuffer _buffer{bufferSizes.localToQuic};
+    bool _read_busy = false;
+    size_t _read_len = 0;
+    GCancellable *_cancellable = nullptr;
+
+    // with streamCompression each chunk of _buffer is written as one frame from _compressed
+    std::optional<StreamCompressor> _compressor;
+    std::string _compressed;
+
+    ThroughputCounter _throughput;
+};
+
+// Forwards both directions between local file descriptors and a QUIC stream using nonblocking read and write
+// driven by a single GSource watching the file descriptors, without any per chunk allocation or GTask.
+class FdForwarder {
+public:
+    FdForwarder(std::function<void()> tick, ConnectionProfile &profile, SSL *ssl_stream, int inputFd, int outputFd);
+    ~FdForwarder();
+
+    FdForwarder(const FdForwarder&) = delete;
+    FdForwarder &operator=(const FdForwarder&) = delete;
+
+    void quicPoll();
+
+    bool inputClosed() const { return _inputClosed; }
+    bool outputClosed() const { return _outputClosed; }
+
+    // same semantics as InputStreamToSslForwarder::onClose
+    std::function<void()> onInputClose;
+    // same semantics as SslToOutputStreamForwarder::onClose
+    std::function<void()> onOutputClose;
+
+private:
+    struct WatchSource {
+        GSource source;
+        FdForwarder *that;
+    };
+
+    static gboolean dispatchWatch(GSource *source, GSourceFunc callback, gpointer user_data);
+
+    void fdReady();
+    void readInput();
+    void transmitBuffered();
+    void flushOutput();
+    void closeInput();
+    void closeOutput();
+    void updateWatch();
+
+    std::function<void()> _tick;
+    ConnectionProfile &_profile;
+    SSL *_ssl_stream = nullptr;
+    int _inputFd = -1;
+    int _outputFd = -1;
+
+    GSource *_watch = nullptr;
+    gpointer _inputTag = nullptr;
+    gpointer _outputTag = nullptr;
+
+    SlabBuffer _inputBuffer{bufferSizes.localToQuic};
+    bool _inputEof = false;
+    bool _inputClosed = false;
+    ThroughputCounter _inputThroughput;
+
+    SlabBuffer _outputBuffer{bufferSizes.quicToLocal};
+    bool _remoteConcluded = false;
+    bool _outputClosed = false;
+    WriteBatchTimer _outputBatch{[this] { flushOutput(); updateWatch(); _tick(); }};
+    ThroughputCounter _outputThroughput;
+};
+
+// Bridges stdio to a bulk stream striped over one QUIC stream on each parallel connection. Local input is cut into
+// chunks, each sent as a frame of a 64 bit big endian sequence number, the 32 bit length and the data on the next
+// stream with room for it, so faster connections carry more chunks. Each stream delivers its frames in order, only
+// chunks that overtook the next expected one are buffered until it arrives. Striped streams are not compressed.
+class StripedBridge {
+public:
+    StripedBridge(std::function<void()> tick, std::vector<SSL*> streams);
+    ~StripedBridge();
+
+    StripedBridge(const StripedBridge&) = delete;
+    StripedBridge &operator=(const StripedBridge&) = delete;
+
+    void startStdio();
+
+    void quicPoll();
+
+    bool finished() const { return _inputClosed && _outputClosed; }
+
+    // called after the local input reached its end and all streams were concluded
+    std::function<void()> onLocalClose;
+
+private:
+    struct Lane {
+        SSL *stream = nullptr;
+        // frame being written and how much of it was written
+        std::string sending;
+        size_t sent = 0;
+        // received data of an incomplete frame
+        std::string partial;
+        // sequence number of the last frame received, -1 before the first
+        int64_t lastSeq = -1;
+        bool remoteConcluded = false;
+    };
+
+    static void wrap_localReadCallback(GObject *source_object, GAsyncResult *res, gpointer user_data);
+    void localReadCallback(gssize read, GError *error);
+    void startAsyncRead();
+    void transmit();
+    void closeInput();
+
+    void receive();
+    void receiveFrames(Lane &lane);
+    void deliver(int64_t seq, std::string &&data);
+    void startAsyncWrite();
+    void closeOutput();
+
+    static constexpr size_t _chunkSize = 64*1024;
+    static constexpr size_t _headerSize = 12;
+    // received data waiting for the local write or for an earlier chunk, reading more is paused above this
+    static constexpr size_t _receiveLimit = 16*1024*1024;
+
     std::function<void()> _tick;
+    std::vector<Lane> _lanes;
     GInputStream *_input_stream = nullptr;
+    GOutputStream *_output_stream = nullptr;
+
+    std::vector<char> _readBuffer = std::vector<char>(_chunkSize);
+    GCancellable *_cancellable = nullptr;
+    bool _read_busy = false;
+    bool _eof = false;
+    bool _inputClosed = false;
+    // framed chunks not yet assigned to a stream
+    std::list<std::string> _queue;
+    int64_t _sendSeq = 0;
+    size_t _nextLane = 0;
+    ThroughputCounter _inputThroughput;
+
+    int64_t _receiveSeq = 0;
+    std::map<int64_t, std::string> _reordered;
+    size_t _reorderedBytes = 0;
+    std::string _output;
+    std::string _writing;
+    bool _write_busy = false;
+    bool _outputClosed = false;
+    ThroughputCounter _outputThroughput;
+};
+
+// Bridges one local socket connection to one QUIC stream. Both directions are half closed independently,
+// the bridge is finished when both directions are closed.
+class StreamBridge {
+public:
+    StreamBridge(std::function<void()> tick, SSL *ssl_stream);
+    ~StreamBridge();
+
+    StreamBridge(const StreamBridge&) = delete;
+    StreamBridge &operator=(const StreamBridge&) = delete;
+
+    void start(GSocketConnection *localConnection);
+    void startStdio();
+    // with confirm one byte is written to the stream once the connection is made, before any payload
+    void connectLocal(GSocketClient *socketClient, GSocketConnectable *target, bool confirm = false);
+
+    void quicPoll();
+
+    bool finished() const;
+
+    void localConnectCallback(GObject *source_object, GAsyncResult *res);
+
+    static void wrap_localConnectCallback(GObject *source_object, GAsyncResult *res, gpointer user_data);
+
+    // called after the local input reached its end and the stream was concluded
+    std::function<void()> onLocalClose;
+
+private:
+    void startForwarders(GInputStream *localInputStream, GOutputStream *localOutputStream, int inputFd, int outputFd);
+    void localInputClosed();
+    void remoteClosed();
+    bool inputClosed() const;
+    bool outputClosed() const;
+
+    std::function<void()> _tick;
     SSL *_ssl_stream = nullptr;
+    GSocketClient *_socketClient = nullptr;
+    GSocketConnection *_localConnection = nullptr;
+    GInputStream *_stdioInputStream = nullptr;
+    GOutputStream *_stdioOutputStream = nullptr;
+    bool _started = false;
+    bool _failed = false;
+    bool _confirmConnect = false;
+
+    // used by the forwarders, so it needs to outlive them
+    ConnectionProfile _profile{trafficProfile};
 
-    std::array<std::byte, 1024*1024> _buffer;
-    int _buffer_filled = 0;
-    int _buffer_transmitted = 0;
+    std::optional<InputStreamToSslForwarder> _socket_to_ssl_forwarder;
+    std::optional<SslToOutputStreamForwarder> _ssl_to_socket_forwarder;
+    std::optional<FdForwarder> _fd_forwarder;
+#ifdef PEERSOCK_HAVE_IO_URING
+    std::optional<UringForwarder> _uring_forwarder;
+#endif
 };
 
+// Carries the datagrams of one local UDP flow on a QUIC stream, each prefixed with its 16 bit length.
+// OpenSSL has no QUIC DATAGRAM frames, one stream per flow at least keeps flows from blocking each other.
+// Datagrams are dropped instead of queued without bound while the stream is blocked or the local socket is full.
+class DatagramBridge {
+public:
+    DatagramBridge(std::function<void()> tick, SSL *ssl_stream);
+    ~DatagramBridge();
+
+    DatagramBridge(const DatagramBridge&) = delete;
+    DatagramBridge &operator=(const DatagramBridge&) = delete;
+
+    // replies go to peer via the shared socket fd, which the bridge doesn't own
+    void startListenFlow(int fd, const sockaddr_storage &peer, socklen_t peerLen);
+    // connects its own udp socket to target
+    void connectLocal(GSocketClient *socketClient, GSocketConnectable *target);
+
+    void sendToRemote(const char *data, size_t len);
+    void quicPoll();
+
+    // concludes the stream
+    void close();
+    bool finished() const;
+    std::chrono::steady_clock::time_point lastActivity() const { return _lastActivity; }
+
+    void localConnectCallback(GObject *source_object, GAsyncResult *res);
+
+    static void wrap_localConnectCallback(GObject *source_object, GAsyncResult *res, gpointer user_data);
+
+private:
+    static gboolean wrap_localReadable(gint fd, GIOCondition condition, gpointer user_data);
+
+    void readLocal();
+    void deliverLocal(const char *data, size_t len);
+    void flushRemote();
+
+    std::function<void()> _tick;
+    SSL *_ssl_stream = nullptr;
+    GSocketClient *_socketClient = nullptr;
+    GSocketConnection *_localConnection = nullptr;
+    int _fd = -1;
+    sockaddr_storage _peer = {};
+    socklen_t _peerLen = 0;
+    guint _watch = 0;
+
+    static constexpr size_t _maxQueued = 256*1024;
+    // framed datagrams not yet accepted by the stream
+    std::string _toRemote;
+    // incomplete frame from the stream
+    std::string _fromRemote;
+    size_t _dropped = 0;
+
+    bool _remoteConcluded = false;
+    bool _closed = false;
+    bool _failed = false;
+    std::chrono::steady_clock::time_point _lastActivity = std::chrono::steady_clock::now();
+};
+
+
+// Returns a unix socket address for path, a leading '@' selects the abstract namespace.
+GSocketAddress *unixSocketAddress(const std::string &path);
 
 struct ListenMode : public ModeBase {
     ListenMode(uint16_t port);
+    // socketMode sets the permissions of a unix socket in the file system
+    ListenMode(GSocketAddress *address, std::optional<unsigned> socketMode);
 
     void connectionMade(std::function<void()> tick, RemoteConnection *connection) override;
 
@@ -67,23 +454,23 @@ struct ListenMode : public ModeBase {
     static void wrap_acceptCallback(GObject *source_object, GAsyncResult *res, gpointer user_data);
 
 private:
+    void bridgeConnection(GSocketConnection *localConnection);
+
     GSocketListener *_listener = nullptr;
     uint16_t _port = 0;
-    GSocketConnection *_localConnection = nullptr;
-    GInputStream *_localInputStream = nullptr;
-    GOutputStream *_localOutputStream = nullptr;
+    // connections accepted before the quic connection was authenticated
+    std::vector<GSocketConnection*> _pendingConnections;
 
     RemoteConnection *q_connection = nullptr;
     std::function<void()> _tick;
     bool _bridged = false;
-    SSL *_bridgeStream = nullptr;
 
-    std::optional<InputStreamToSslForwarder> socket_to_ssl_forwarder;
-    std::optional<SslToOutputStreamForwarder> ssl_to_socket_forwarder;
+    std::list<StreamBridge> _bridges;
 };
 
 struct ConnectMode : public ModeBase {
-    ConnectMode(std::string hostAndPort);
+    // takes ownership of target
+    ConnectMode(GSocketConnectable *target);
 
     void connectionMade(std::function<void()> tick, RemoteConnection *connection) override;
 
@@ -91,24 +478,192 @@ struct ConnectMode : public ModeBase {
 
     void quicPoll() override;
 
+private:
+    GSocketConnectable *_target = nullptr;
+    GSocketClient *_socketClient = nullptr;
 
-    void localConnectCallback(GObject *source_object, GAsyncResult *res);
+    RemoteConnection *q_connection = nullptr;
+    std::function<void()> _tick;
+    bool _bridged = false;
 
-    static void wrap_localConnectCallback(GObject *source_object, GAsyncResult *res, gpointer user_data);
+    std::list<StreamBridge> _bridges;
+};
+
+struct UdpListenMode : public ModeBase {
+    UdpListenMode(uint16_t port);
+
+    void connectionMade(std::function<void()> tick, RemoteConnection *connection) override;
+
+    int handleQuicStreamOpened(SSL *stream) override;
+
+    void quicPoll() override;
 
 private:
-    std::string _hostAndPort;
+    static gboolean wrap_localReadable(gint fd, GIOCondition condition, gpointer user_data);
+    static gboolean wrap_expireFlows(gpointer user_data);
+
+    void readLocal();
+    void expireFlows();
+
+    static constexpr std::chrono::seconds _flowTimeout{120};
+
+    int _fd = -1;
+    guint _watch = 0;
+
+    RemoteConnection *q_connection = nullptr;
+    std::function<void()> _tick;
+    bool _bridged = false;
+
+    // keyed by the raw source address
+    std::map<std::string, DatagramBridge> _flows;
+};
+
+struct UdpConnectMode : public ModeBase {
+    // takes ownership of target
+    UdpConnectMode(GSocketConnectable *target);
+
+    void connectionMade(std::function<void()> tick, RemoteConnection *connection) override;
+
+    int handleQuicStreamOpened(SSL *stream) override;
+
+    void quicPoll() override;
+
+private:
+    GSocketConnectable *_target = nullptr;
     GSocketClient *_socketClient = nullptr;
-    GSocketConnection *_localConnection = nullptr;
-    GOutputStream *_localOutputStream = nullptr;
-    GInputStream *_localInputStream = nullptr;
-    std::optional<SslToOutputStreamForwarder> _ssl_to_socket_forwarder;
-    std::optional<InputStreamToSslForwarder> _socket_to_ssl_forwarder;
 
     RemoteConnection *q_connection = nullptr;
     std::function<void()> _tick;
     bool _bridged = false;
-    SSL *_bridgeStream = nullptr;
+
+    std::list<DatagramBridge> _flows;
+};
+
+// One -L or -R forwarding, listen is "[bind:]port" and target is "host:port".
+struct ForwardSpec {
+    // the peer listens and forwards back to target on this side
+    bool remote = false;
+    std::string listen;
+    std::string target;
+};
+
+// Parses "[bind:]port:host:hostport", IPv6 addresses need to be enclosed in brackets.
+std::optional<ForwardSpec> parseForwardSpec(bool remote, std::string_view spec);
+
+// Carries any number of forwardings in both directions over one connection. The target of each connection is
+// sent in the header of its stream, so both sides need to use this mode.
+struct ForwardMode : public ModeBase {
+    // allowRemoteBind lets the other side ask for listening on other interfaces than loopback
+    ForwardMode(std::vector<ForwardSpec> specs, bool allowRemoteBind);
+
+    void connectionMade(std::function<void()> tick, RemoteConnection *connection) override;
+
+    int handleQuicStreamOpened(SSL *stream) override;
+
+    void quicPoll() override;
+
+private:
+    struct Listener {
+        ForwardMode *mode = nullptr;
+        GSocketListener *listener = nullptr;
+        std::string target;
+    };
+
+    struct PendingStream {
+        SSL *stream = nullptr;
+        std::string header;
+    };
+
+    static void wrap_acceptCallback(GObject *source_object, GAsyncResult *res, gpointer user_data);
+
+    // address is "[bind:]port", peerRequest if the other side asked for it with an 'R' stream
+    bool listen(const std::string &address, const std::string &target, bool peerRequest);
+    void acceptCallback(Listener &listener, GAsyncResult *res);
+    void bridgeConnection(GSocketConnection *localConnection, const std::string &target);
+    void streamHeaderReceived(SSL *stream, const std::string &header);
+
+    std::vector<ForwardSpec> _specs;
+    bool _allowRemoteBind = false;
+    std::list<Listener> _listeners;
+    GSocketClient *_socketClient = nullptr;
+    // connections accepted before the quic connection was authenticated, with their targets
+    std::vector<std::pair<GSocketConnection*, std::string>> _pendingConnections;
+    // incoming streams with an incomplete header
+    std::list<PendingStream> _pendingStreams;
+
+    RemoteConnection *q_connection = nullptr;
+    std::function<void()> _tick;
+    bool _bridged = false;
+
+    std::list<StreamBridge> _bridges;
+};
+
+// SOCKS5 proxy for local clients, each CONNECT request is forwarded as a stream with the destination in its header.
+// The other side needs to use ForwardMode. The client gets its reply once the other side connected.
+struct SocksMode : public ModeBase {
+    // address is "[bind:]port", without bind address only on the loopback interface
+    SocksMode(const std::string &address);
+
+    void connectionMade(std::function<void()> tick, RemoteConnection *connection) override;
+
+    int handleQuicStreamOpened(SSL *stream) override;
+
+    void quicPoll() override;
+
+private:
+    enum class HandshakeState {
+        needMore,
+        // a reply is being written, its callback continues or drops the handshake
+        replying,
+        failed,
+        done,
+    };
+
+    struct Handshake {
+        SocksMode *mode = nullptr;
+        GSocketConnection *connection = nullptr;
+        std::string received;
+        bool greeted = false;
+        char buf[512];
+    };
+
+    struct PendingConnection {
+        GSocketConnection *connection = nullptr;
+        std::string target;
+        // data the client sent right after its request
+        std::string initialData;
+    };
+
+    // waiting for the other side to confirm the connection to target
+    struct Connecting {
+        GSocketConnection *connection = nullptr;
+        SSL *stream = nullptr;
+        std::string target;
+    };
+
+    static void wrap_acceptCallback(GObject *source_object, GAsyncResult *res, gpointer user_data);
+    static void wrap_readCallback(GObject *source_object, GAsyncResult *res, gpointer user_data);
+
+    void acceptCallback(GAsyncResult *res);
+    void readCallback(Handshake &handshake, GAsyncResult *res);
+    void readHandshake(Handshake &handshake);
+    void continueHandshake(Handshake &handshake);
+    HandshakeState advanceHandshake(Handshake &handshake, PendingConnection &result);
+    HandshakeState replyAndDrop(Handshake &handshake, std::string_view reply);
+    void dropHandshake(Handshake &handshake);
+    void bridgeConnection(const PendingConnection &pending);
+
+    GSocketListener *_listener = nullptr;
+    std::list<Handshake> _handshakes;
+    // connections with completed handshake before the quic connection was authenticated
+    std::vector<PendingConnection> _pendingConnections;
+    std::list<Connecting> _connecting;
+
+    RemoteConnection *q_connection = nullptr;
+    std::function<void()> _tick;
+    bool _bridged = false;
+
+    std::list<StreamBridge> _bridges;
 };
 
 struct StdioModeA : public ModeBase {
@@ -119,15 +674,17 @@ struct StdioModeA : public ModeBase {
     void quicPoll() override;
 
 private:
-    GOutputStream *_localOutputStream = nullptr;
-    GInputStream *_localInputStream = nullptr;
-    std::optional<SslToOutputStreamForwarder> _ssl_to_socket_forwarder;
-    std::optional<InputStreamToSslForwarder> _socket_to_ssl_forwarder;
+    void startStriped();
 
     RemoteConnection *q_connection = nullptr;
     std::function<void()> _tick;
     bool _bridged = false;
-    SSL *_bridgeStream = nullptr;
+
+    std::optional<StreamBridge> _bridge;
+    std::optional<StripedBridge> _striped;
+    // streams of a striped bridge until all arrived, the primary stream announces the number of extra streams
+    std::vector<SSL*> _stripeStreams;
+    int _stripeExpected = -1;
 };
 
 struct StdioModeB : public ModeBase {
@@ -138,14 +695,13 @@ struct StdioModeB : public ModeBase {
     void quicPoll() override;
 
 private:
-    GInputStream *_localInputStream = nullptr;
-    GOutputStream *_localOutputStream = nullptr;
+    // waits for the parallel connections, if any, and stripes over them
+    void startBridge();
 
     RemoteConnection *q_connection = nullptr;
     std::function<void()> _tick;
     bool _bridged = false;
-    SSL *_bridgeStream = nullptr;
 
-    std::optional<InputStreamToSslForwarder> _socket_to_ssl_forwarder;
-    std::optional<SslToOutputStreamForwarder> _ssl_to_socket_forwarder;
+    std::optional<StreamBridge> _bridge;
+    std::optional<StripedBridge> _striped;
 };
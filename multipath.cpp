@@ -0,0 +1,260 @@
+#include "multipath.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+
+#include "utils.h"
+
+
+static constexpr char pingType = 2;
+static constexpr char echoType = 3;
+static constexpr size_t pingSize = 18;
+static constexpr size_t echoSize = 26;
+
+static void write64(char *out, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        out[i] = (char)value;
+        value >>= 8;
+    }
+}
+
+static uint64_t read64(const char *in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | (guint8)in[i];
+    }
+    return value;
+}
+
+MultipathScheduler &MultipathScheduler::instance() {
+    static MultipathScheduler scheduler;
+    return scheduler;
+}
+
+void MultipathScheduler::start(NiceAgent *agent, guint streamId, guint components) {
+    if (_agent) {
+        return;
+    }
+    _agent = agent;
+    _streamId = streamId;
+    for (guint component = 1; component <= std::min(components, maxPaths); component++) {
+        Path path;
+        path.component = component;
+        _paths.push_back(path);
+    }
+    log(LOG_ICE, "multipath: using {} components\n", _paths.size());
+    g_timeout_add_seconds(1, wrap_tick, this);
+    atexit([] {
+        instance().exportStats();
+    });
+}
+
+void MultipathScheduler::setStream(guint streamId) {
+    if (!_agent) {
+        return;
+    }
+    _streamId = streamId;
+    for (Path &path : _paths) {
+        path.connected = false;
+        path.relayed = false;
+        path.lastEcho = -1;
+        path.srtt = 0;
+        path.weightScale = 1;
+        path.current = 0;
+        setComponentState(path.component, nice_agent_get_component_state(_agent, streamId, path.component));
+    }
+    log(LOG_ICE, "multipath: moved to stream {}\n", streamId);
+}
+
+MultipathScheduler::Path *MultipathScheduler::path(guint component) {
+    for (Path &path : _paths) {
+        if (path.component == component) {
+            return &path;
+        }
+    }
+    return nullptr;
+}
+
+void MultipathScheduler::setComponentState(guint component, guint state) {
+    Path *p = path(component);
+    if (!p) {
+        return;
+    }
+    p->connected = state == NICE_COMPONENT_STATE_CONNECTED || state == NICE_COMPONENT_STATE_READY;
+    if (p->connected) {
+        NiceCandidate *local = nullptr;
+        NiceCandidate *remote = nullptr;
+        if (nice_agent_get_selected_pair(_agent, _streamId, component, &local, &remote)) {
+            p->relayed = local->type == NICE_CANDIDATE_TYPE_RELAYED || remote->type == NICE_CANDIDATE_TYPE_RELAYED;
+        }
+    }
+}
+
+bool MultipathScheduler::usable(const Path &path, gint64 now) const {
+    if (!path.connected) {
+        return false;
+    }
+    if (path.lastEcho == -1) {
+        // component 1 is trusted until its pings go unanswered
+        return path.component == 1;
+    }
+    return now - path.lastEcho < _deadAfterUs;
+}
+
+MultipathScheduler::Path *MultipathScheduler::primary(gint64 now) {
+    if (usable(_paths[0], now)) {
+        return &_paths[0];
+    }
+    Path *best = nullptr;
+    for (Path &path : _paths) {
+        if (usable(path, now) && (!best || path.srtt < best->srtt)) {
+            best = &path;
+        }
+    }
+    return best;
+}
+
+bool MultipathScheduler::similarRtt(const Path &path, const Path &primary) const {
+    if (&path == &primary) {
+        return true;
+    }
+    if (path.lastEcho == -1 || primary.lastEcho == -1) {
+        return false;
+    }
+    return std::fabs(path.srtt - primary.srtt) <= std::max(primary.srtt * _similarRttFraction, _similarRttMinUs);
+}
+
+guint MultipathScheduler::pick(size_t bytes) {
+    gint64 now = g_get_monotonic_time();
+    Path *first = primary(now);
+    if (!first) {
+        first = &_paths[0];
+    }
+    Path *best = nullptr;
+    double total = 0;
+    for (Path &path : _paths) {
+        if (!usable(path, now) || !similarRtt(path, *first)) {
+            continue;
+        }
+        // rtt in microseconds, paths below 1ms count as equal
+        double weight = path.weightScale / std::max(path.srtt, 1000.0);
+        path.current += weight;
+        total += weight;
+        if (!best || path.current > best->current) {
+            best = &path;
+        }
+    }
+    if (best) {
+        best->current -= total;
+    } else {
+        best = first;
+    }
+    best->txDatagrams++;
+    best->txBytes += bytes;
+    return best->component;
+}
+
+void MultipathScheduler::countReceived(guint component, size_t bytes) {
+    Path *p = path(component);
+    if (!p) {
+        return;
+    }
+    p->rxDatagrams++;
+    p->rxBytes += bytes;
+}
+
+bool MultipathScheduler::handleDatagram(guint component, const char *buf, size_t len) {
+    if (!len || (buf[0] & 0x40) || (buf[0] != pingType && buf[0] != echoType)) {
+        return false;
+    }
+    Path *p = path(component);
+    if (!p) {
+        return true;
+    }
+
+    if (buf[0] == pingType && len == pingSize) {
+        char echo[echoSize];
+        memcpy(echo, buf, pingSize);
+        echo[0] = echoType;
+        write64(echo + pingSize, p->rxBytes);
+        nice_agent_send(_agent, _streamId, component, echoSize, echo);
+    } else if (buf[0] == echoType && len == echoSize) {
+        gint64 now = g_get_monotonic_time();
+        double rtt = (double)(now - (gint64)read64(buf + 2));
+        p->srtt = p->lastEcho == -1 ? rtt : p->srtt * 7 / 8 + rtt / 8;
+        p->lastEcho = now;
+
+        uint64_t tx = read64(buf + 10);
+        uint64_t peerRx = read64(buf + 18);
+        if (tx >= p->echoedTx + _lossSampleBytes && peerRx >= p->echoedPeerRx) {
+            double delivered = (double)(peerRx - p->echoedPeerRx) / (double)(tx - p->echoedTx);
+            if (delivered < 0.95) {
+                p->weightScale = std::max(p->weightScale / 2, 1.0 / 16);
+            } else {
+                p->weightScale = std::min(p->weightScale * 1.25, 1.0);
+            }
+            p->echoedTx = tx;
+            p->echoedPeerRx = peerRx;
+        }
+    }
+    return true;
+}
+
+gboolean MultipathScheduler::wrap_tick(gpointer user_data) {
+    reinterpret_cast<MultipathScheduler*>(user_data)->tick();
+    return G_SOURCE_CONTINUE;
+}
+
+void MultipathScheduler::tick() {
+    char ping[pingSize];
+    for (Path &path : _paths) {
+        if (!path.connected) {
+            continue;
+        }
+        ping[0] = pingType;
+        ping[1] = (char)path.component;
+        write64(ping + 2, g_get_monotonic_time());
+        write64(ping + 10, path.txBytes);
+        nice_agent_send(_agent, _streamId, path.component, pingSize, ping);
+    }
+
+    if (++_ticks % _statsInterval == 0) {
+        exportStats();
+    }
+}
+
+void MultipathScheduler::exportStats() const {
+    gint64 now = g_get_monotonic_time();
+    nlohmann::json paths = nlohmann::json::array();
+    std::string text;
+    for (const Path &path : _paths) {
+        bool alive = usable(path, now);
+        paths.push_back({
+                            {"component", path.component},
+                            {"connected", path.connected},
+                            {"relayed", path.relayed},
+                            {"alive", alive},
+                            {"rtt_us", (uint64_t)path.srtt},
+                            {"weight_scale", path.weightScale},
+                            {"tx_datagrams", path.txDatagrams},
+                            {"tx_bytes", path.txBytes},
+                            {"rx_datagrams", path.rxDatagrams},
+                            {"rx_bytes", path.rxBytes},
+                        });
+        text += fmt::format("path {}{}: {}, rtt {}us, sent {} datagrams ({} bytes), received {} datagrams ({} bytes)\n",
+                            path.component, path.relayed ? " (relayed)" : "", alive ? "alive" : "down",
+                            (uint64_t)path.srtt, path.txDatagrams, path.txBytes, path.rxDatagrams, path.rxBytes);
+    }
+
+    if (peersockJsonOutputMode) {
+        writeUserMessage({
+                             {"event", "path-stats"},
+                             {"paths", paths},
+                         },
+                         "{}", text);
+    } else {
+        log(LOG_ICE, "{}", text);
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <agent.h> // libnice
+
+// Experimental striping of QUIC datagrams over several components of the ICE stream, each of which nominates its own
+// candidate pair. Component 1 carries everything until another path proved to be alive.
+// Every second each connected path is pinged with a datagram with the QUIC fixed bit clear: type 2, the component,
+// the send time in microseconds and the bytes sent on the path so far. The other side echoes it on the same component
+// as type 3, adding the bytes it received on the path. That yields a smoothed RTT per path and the share of the sent
+// bytes that arrived. A path without an echo for 3 seconds is skipped until it answers again.
+// QUIC takes datagrams arriving out of order for loss, so one connection mostly stays on a primary path: component 1,
+// or the usable path with the lowest RTT while component 1 is down. Datagrams are only spread over paths with an RTT
+// within a quarter (at least 1ms) of the primary one, by smooth weighted round robin with the inverse RTT as weight,
+// scaled down while a path loses more than 5 percent.
+class MultipathScheduler {
+public:
+    static MultipathScheduler &instance();
+
+    // components of the stream, including component 1
+    static constexpr guint maxPaths = 4;
+
+    void start(NiceAgent *agent, guint streamId, guint components);
+    // Moves to the stream of an ICE restart, the paths start over with the state of its components.
+    void setStream(guint streamId);
+    bool active() const { return _paths.size() > 1; }
+
+    void setComponentState(guint component, guint state);
+
+    // component to send a datagram of bytes on
+    guint pick(size_t bytes);
+    void countReceived(guint component, size_t bytes);
+
+    // true if the datagram was a ping or echo, not a QUIC packet
+    bool handleDatagram(guint component, const char *buf, size_t len);
+
+    // logs the statistics of all paths, as path-stats event in json mode
+    void exportStats() const;
+
+private:
+    struct Path {
+        guint component = 0;
+        bool connected = false;
+        bool relayed = false;
+        // monotonic time of the last echo, -1 before the first
+        gint64 lastEcho = -1;
+        double srtt = 0;
+        double weightScale = 1;
+        double current = 0;
+        uint64_t txDatagrams = 0;
+        uint64_t txBytes = 0;
+        uint64_t rxDatagrams = 0;
+        uint64_t rxBytes = 0;
+        // counters carried by the last echo used for the loss estimate
+        uint64_t echoedTx = 0;
+        uint64_t echoedPeerRx = 0;
+    };
+
+    MultipathScheduler() = default;
+
+    static gboolean wrap_tick(gpointer user_data);
+    void tick();
+    bool usable(const Path &path, gint64 now) const;
+    Path *primary(gint64 now);
+    bool similarRtt(const Path &path, const Path &primary) const;
+    Path *path(guint component);
+
+    static constexpr gint64 _deadAfterUs = 3 * G_USEC_PER_SEC;
+    static constexpr double _similarRttFraction = 0.25;
+    static constexpr double _similarRttMinUs = 1000;
+    // a loss estimate needs at least this many bytes sent since the last one
+    static constexpr uint64_t _lossSampleBytes = 64*1024;
+    static constexpr int _statsInterval = 10;
+
+    NiceAgent *_agent = nullptr;
+    guint _streamId = 0;
+    std::vector<Path> _paths;
+    int _ticks = 0;
+};
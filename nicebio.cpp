@@ -0,0 +1,299 @@
+#include "nicebio.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <openssl/err.h>
+
+#include "autotune.h"
+#include "control.h"
+#include "multipath.h"
+#include "utils.h"
+
+
+NiceDatagramBio &NiceDatagramBio::instance() {
+    static NiceDatagramBio bio;
+    return bio;
+}
+
+BIO *NiceDatagramBio::newBio(uint32_t caps) {
+    if (!_method) {
+        _method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "peersock libnice datagrams");
+        if (!_method
+                || !BIO_meth_set_create(_method, wrap_create)
+                || !BIO_meth_set_destroy(_method, wrap_destroy)
+                || !BIO_meth_set_ctrl(_method, wrap_ctrl)
+                || !BIO_meth_set_sendmmsg(_method, wrap_sendmmsg)
+                || !BIO_meth_set_recvmmsg(_method, wrap_recvmmsg)) {
+            fatal_ossl("BIO_meth_new failed:\n");
+        }
+    }
+
+    BIO *bio = BIO_new(_method);
+    if (!bio) {
+        fatal_ossl("BIO_new failed:\n");
+    }
+    _caps = caps;
+    return bio;
+}
+
+void NiceDatagramBio::setStream(NiceAgent *agent, guint streamId) {
+    _agent = agent;
+    _streamId = streamId;
+}
+
+void NiceDatagramBio::enableThreaded(std::function<void()> egressQueued) {
+    _ingressQueue = std::make_unique<SpscQueue<std::vector<char>>>(_threadedQueueSize);
+    _egressQueue = std::make_unique<SpscQueue<std::vector<char>>>(_threadedQueueSize);
+    _egressQueued = egressQueued;
+}
+
+void NiceDatagramBio::sendQueued() {
+    GOutputVector vectors[_sendBatchSize];
+    NiceOutputMessage niceMessages[_sendBatchSize];
+
+    size_t count;
+    while ((count = std::min(_egressQueue->available(), _sendBatchSize))) {
+        for (size_t i = 0; i < count; i++) {
+            std::vector<char> &datagram = _egressQueue->front(i);
+            vectors[i].buffer = datagram.data();
+            vectors[i].size = datagram.size();
+        }
+        passToNice(vectors, niceMessages, count);
+        _egressQueue->pop(count);
+    }
+}
+
+bool NiceDatagramBio::queueReceived(const char *buf, size_t len) {
+    if (_ingressQueue) {
+        return _ingressQueue->push([&] (std::vector<char> &datagram) {
+            datagram.assign(buf, buf + len);
+        });
+    }
+
+    if (_queuedBytes + len > _queueLimit) {
+        return false;
+    }
+
+    std::vector<char> datagram;
+    if (_spare.size()) {
+        datagram = std::move(_spare.back());
+        _spare.pop_back();
+    }
+    datagram.assign(buf, buf + len);
+    _queue.push_back(std::move(datagram));
+    _queuedBytes += len;
+    return true;
+}
+
+int NiceDatagramBio::wrap_create(BIO *bio) {
+    BIO_set_data(bio, &instance());
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+int NiceDatagramBio::wrap_destroy(BIO *bio) {
+    BIO_set_data(bio, nullptr);
+    BIO_set_init(bio, 0);
+    return 1;
+}
+
+long NiceDatagramBio::wrap_ctrl(BIO *bio, int cmd, long larg, void *parg) {
+    return reinterpret_cast<NiceDatagramBio*>(BIO_get_data(bio))->ctrl(cmd, larg, parg);
+}
+
+int NiceDatagramBio::wrap_sendmmsg(BIO *bio, BIO_MSG *msg, size_t stride, size_t num_msg, uint64_t flags,
+                                   size_t *msgs_processed) {
+    (void)flags;
+    return reinterpret_cast<NiceDatagramBio*>(BIO_get_data(bio))->sendmmsg(msg, stride, num_msg, msgs_processed);
+}
+
+int NiceDatagramBio::wrap_recvmmsg(BIO *bio, BIO_MSG *msg, size_t stride, size_t num_msg, uint64_t flags,
+                                   size_t *msgs_processed) {
+    (void)flags;
+    return reinterpret_cast<NiceDatagramBio*>(BIO_get_data(bio))->recvmmsg(msg, stride, num_msg, msgs_processed);
+}
+
+long NiceDatagramBio::ctrl(int cmd, long larg, void *parg) {
+    (void)parg;
+    switch (cmd) {
+        case BIO_CTRL_DGRAM_GET_CAPS:
+        case BIO_CTRL_DGRAM_GET_EFFECTIVE_CAPS:
+            return _caps;
+        case BIO_CTRL_DGRAM_SET_CAPS:
+            _caps = (uint32_t)larg;
+            return 1;
+        case BIO_CTRL_DGRAM_GET_NO_TRUNC:
+            return _noTrunc;
+        case BIO_CTRL_DGRAM_SET_NO_TRUNC:
+            _noTrunc = larg != 0;
+            return 1;
+        case BIO_CTRL_DGRAM_GET_MTU:
+        case BIO_CTRL_DGRAM_QUERY_MTU:
+            return _pathMtu;
+        case BIO_CTRL_PENDING:
+            if (_ingressQueue) {
+                return _ingressQueue->available() ? _ingressQueue->front(0).size() : 0;
+            }
+            return _queue.size() ? _queue.front().size() : 0;
+        case BIO_CTRL_WPENDING:
+            // written datagrams are never held back
+            return 0;
+        case BIO_CTRL_FLUSH:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void NiceDatagramBio::passToNice(GOutputVector *vectors, NiceOutputMessage *niceMessages, size_t count) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        niceMessages[i].buffers = &vectors[i];
+        niceMessages[i].n_buffers = 1;
+        bytes += vectors[i].size;
+    }
+    log(LOG_QUIC, "sending {} datagrams with {} bytes\n", count, bytes);
+    BufferAutotuner::instance().countEgress(bytes);
+    ControlChannel::instance().countSent(bytes, count);
+
+    MultipathScheduler &multipath = MultipathScheduler::instance();
+    if (!multipath.active()) {
+        sendOnComponent(1, niceMessages, count);
+        return;
+    }
+
+    // one call per path, the order within each path is kept
+    NiceOutputMessage pathMessages[_sendBatchSize];
+    guint components[_sendBatchSize];
+    for (size_t i = 0; i < count; i++) {
+        components[i] = multipath.pick(vectors[i].size);
+    }
+    for (guint component = 1; component <= MultipathScheduler::maxPaths; component++) {
+        size_t pathCount = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (components[i] == component) {
+                pathMessages[pathCount++] = niceMessages[i];
+            }
+        }
+        if (pathCount) {
+            sendOnComponent(component, pathMessages, pathCount);
+        }
+    }
+}
+
+void NiceDatagramBio::sendOnComponent(guint component, NiceOutputMessage *niceMessages, size_t count) {
+    gint sent = 0;
+    if (_agent) {
+        GError *error = nullptr;
+        sent = nice_agent_send_messages_nonblocking(_agent, _streamId, component, niceMessages, count, nullptr,
+                                                    &error);
+        if (sent < 0) {
+            log(LOG_ICE, "failed to send datagrams: {}\n", error->message);
+            g_error_free(error);
+            sent = 0;
+        }
+    }
+    if ((size_t)sent < count) {
+        // like loss on the path, QUIC retransmits
+        _sendDrops += count - sent;
+        log(LOG_ICE, "dropped {} datagrams\n", count - sent);
+    }
+}
+
+int NiceDatagramBio::sendmmsg(BIO_MSG *msg, size_t stride, size_t num_msg, size_t *msgs_processed) {
+    if (_egressQueue) {
+        size_t queued = 0;
+        for (size_t i = 0; i < num_msg; i++) {
+            BIO_MSG *m = reinterpret_cast<BIO_MSG*>(reinterpret_cast<char*>(msg) + i * stride);
+            m->flags = 0;
+            bool ok = _egressQueue->push([&] (std::vector<char> &datagram) {
+                const char *data = reinterpret_cast<const char*>(m->data);
+                datagram.assign(data, data + m->data_len);
+            });
+            if (ok) {
+                queued++;
+            } else {
+                // like loss on the path
+                _sendDrops++;
+            }
+        }
+        if (queued) {
+            _egressQueued();
+        }
+        *msgs_processed = num_msg;
+        return 1;
+    }
+
+    GOutputVector vectors[_sendBatchSize];
+    NiceOutputMessage niceMessages[_sendBatchSize];
+
+    for (size_t start = 0; start < num_msg; start += _sendBatchSize) {
+        size_t count = std::min(num_msg - start, _sendBatchSize);
+        for (size_t i = 0; i < count; i++) {
+            BIO_MSG *m = reinterpret_cast<BIO_MSG*>(reinterpret_cast<char*>(msg) + (start + i) * stride);
+            vectors[i].buffer = m->data;
+            vectors[i].size = m->data_len;
+            m->flags = 0;
+        }
+        passToNice(vectors, niceMessages, count);
+    }
+
+    *msgs_processed = num_msg;
+    return 1;
+}
+
+static bool copyReceived(BIO_MSG *m, const std::vector<char> &datagram, bool noTrunc) {
+    if (datagram.size() > m->data_len && noTrunc) {
+        log(LOG_QUIC, "dropped received datagram of {} bytes, larger than the read buffer\n", datagram.size());
+        return false;
+    }
+    size_t len = std::min(datagram.size(), m->data_len);
+    memcpy(m->data, datagram.data(), len);
+    m->data_len = len;
+    m->flags = 0;
+    if (m->peer) {
+        BIO_ADDR_clear(m->peer);
+    }
+    if (m->local) {
+        BIO_ADDR_clear(m->local);
+    }
+    return true;
+}
+
+int NiceDatagramBio::recvmmsg(BIO_MSG *msg, size_t stride, size_t num_msg, size_t *msgs_processed) {
+    size_t count = 0;
+    if (_ingressQueue) {
+        size_t available = _ingressQueue->available();
+        size_t consumed = 0;
+        while (count < num_msg && consumed < available) {
+            BIO_MSG *m = reinterpret_cast<BIO_MSG*>(reinterpret_cast<char*>(msg) + count * stride);
+            if (copyReceived(m, _ingressQueue->front(consumed++), _noTrunc)) {
+                count++;
+            }
+        }
+        _ingressQueue->pop(consumed);
+    }
+    while (count < num_msg && _queue.size()) {
+        BIO_MSG *m = reinterpret_cast<BIO_MSG*>(reinterpret_cast<char*>(msg) + count * stride);
+        std::vector<char> datagram = std::move(_queue.front());
+        _queue.pop_front();
+        _queuedBytes -= datagram.size();
+
+        if (copyReceived(m, datagram, _noTrunc)) {
+            count++;
+        }
+
+        if (_spare.size() < _maxSpare) {
+            _spare.push_back(std::move(datagram));
+        }
+    }
+
+    _received += count;
+    *msgs_processed = count;
+    if (!count) {
+        ERR_raise(ERR_LIB_BIO, BIO_R_NON_FATAL);
+        return 0;
+    }
+    return 1;
+}
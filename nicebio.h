@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <openssl/bio.h>
+
+#include <agent.h> // libnice
+
+#include "spscqueue.h"
+
+// Datagram BIO between OpenSSL's QUIC and libnice, in place of a datagram BIO pair.
+// Datagrams written by OpenSSL are passed to libnice directly from OpenSSL's buffers. Received datagrams wait in a
+// bounded queue until OpenSSL reads them, as libnice's buffer is only valid during its receive callback.
+class NiceDatagramBio {
+public:
+    static NiceDatagramBio &instance();
+
+    // The returned BIO is used for reading and writing, caps are reported as BIO_dgram_get_caps.
+    BIO *newBio(uint32_t caps);
+
+    // datagrams written before the ICE stream is known are dropped, QUIC retransmits them
+    void setStream(NiceAgent *agent, guint streamId);
+
+    // false if the datagram was dropped because the queue is full
+    bool queueReceived(const char *buf, size_t len);
+    // bytes the receive queue may hold, like the buffer size of one direction of a BIO pair
+    void setQueueLimit(size_t bytes) { _queueLimit = bytes; }
+
+    // For QUIC running on its own thread, both directions then pass through SPSC queues: received datagrams from
+    // the libnice thread to the QUIC thread and written datagrams back, where sendQueued passes them to libnice.
+    // egressQueued is called on the QUIC thread after it queued datagrams.
+    void enableThreaded(std::function<void()> egressQueued);
+    // libnice thread, threaded mode only
+    void sendQueued();
+
+    // reported by BIO_dgram_get_mtu and BIO_dgram_query_mtu, 0 while unknown
+    void setPathMtu(size_t mtu) { _pathMtu = mtu; }
+
+    // datagrams handed to OpenSSL, only used on the thread running QUIC
+    uint64_t receivedCount() const { return _received; }
+    uint64_t sendDrops() const { return _sendDrops; }
+
+private:
+    NiceDatagramBio() = default;
+
+    static int wrap_create(BIO *bio);
+    static int wrap_destroy(BIO *bio);
+    static long wrap_ctrl(BIO *bio, int cmd, long larg, void *parg);
+    static int wrap_sendmmsg(BIO *bio, BIO_MSG *msg, size_t stride, size_t num_msg, uint64_t flags,
+                             size_t *msgs_processed);
+    static int wrap_recvmmsg(BIO *bio, BIO_MSG *msg, size_t stride, size_t num_msg, uint64_t flags,
+                             size_t *msgs_processed);
+
+    long ctrl(int cmd, long larg, void *parg);
+    int sendmmsg(BIO_MSG *msg, size_t stride, size_t num_msg, size_t *msgs_processed);
+    int recvmmsg(BIO_MSG *msg, size_t stride, size_t num_msg, size_t *msgs_processed);
+    void passToNice(GOutputVector *vectors, NiceOutputMessage *niceMessages, size_t count);
+    void sendOnComponent(guint component, NiceOutputMessage *niceMessages, size_t count);
+
+    // messages passed to libnice in one call
+    static constexpr size_t _sendBatchSize = 32;
+    static constexpr size_t _maxSpare = 64;
+    // datagrams in each of the queues of threaded mode
+    static constexpr size_t _threadedQueueSize = 4096;
+
+    BIO_METHOD *_method = nullptr;
+    uint32_t _caps = 0;
+    bool _noTrunc = false;
+    std::atomic<size_t> _pathMtu{0};
+
+    NiceAgent *_agent = nullptr;
+    guint _streamId = 0;
+    std::atomic<uint64_t> _sendDrops{0};
+    uint64_t _received = 0;
+
+    std::deque<std::vector<char>> _queue;
+    // emptied buffers of the queue, reused to avoid an allocation per datagram
+    std::vector<std::vector<char>> _spare;
+    size_t _queuedBytes = 0;
+    size_t _queueLimit = 1024*1024;
+
+    std::unique_ptr<SpscQueue<std::vector<char>>> _ingressQueue;
+    std::unique_ptr<SpscQueue<std::vector<char>>> _egressQueue;
+    std::function<void()> _egressQueued;
+};
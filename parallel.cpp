@@ -0,0 +1,248 @@
+#include "parallel.h"
+
+#include <cstring>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+
+#include "utils.h"
+
+
+static constexpr size_t proofSize = 33;
+
+ParallelConnections &ParallelConnections::instance() {
+    static ParallelConnections connections;
+    return connections;
+}
+
+void ParallelConnections::startClient(const std::array<guint8, 32> &secret, std::function<SSL*()> connect,
+                                      std::function<void()> tick) {
+    if (!enabled() || _deadline != -1) {
+        return;
+    }
+    _client = true;
+    _secret = secret;
+    _tick = tick;
+    _deadline = g_get_monotonic_time() + _setupTimeoutUs;
+    g_timeout_add(_setupTimeoutUs / 1000, wrap_setupTimeout, this);
+    for (unsigned i = 1; i < _count; i++) {
+        Lane lane;
+        lane.connection = connect();
+        _lanes.push_back(lane);
+    }
+    log(LOG_QUIC, "parallel: connecting {} extra connections\n", _lanes.size());
+}
+
+void ParallelConnections::startServer(const std::array<guint8, 32> &secret, SSL *listener,
+                                      std::function<void(SSL*)> prepare, std::function<void()> tick) {
+    if (!enabled() || _deadline != -1) {
+        return;
+    }
+    _secret = secret;
+    _listener = listener;
+    _prepare = prepare;
+    _tick = tick;
+    _deadline = g_get_monotonic_time() + _setupTimeoutUs;
+    g_timeout_add(_setupTimeoutUs / 1000, wrap_setupTimeout, this);
+    log(LOG_QUIC, "parallel: accepting {} extra connections\n", _count - 1);
+}
+
+gboolean ParallelConnections::wrap_setupTimeout(gpointer user_data) {
+    ParallelConnections *that = reinterpret_cast<ParallelConnections*>(user_data);
+    if (that->lanes().size() + 1 < that->_count) {
+        log(LOG_QUIC, "parallel: only {} of {} extra connections bound in time\n", that->lanes().size(),
+            that->_count - 1);
+    }
+    // lets modes waiting for the lanes go on without the missing ones
+    that->_tick();
+    return G_SOURCE_REMOVE;
+}
+
+void ParallelConnections::poll(std::function<void(SSL*)> onStream) {
+    if (_deadline == -1) {
+        return;
+    }
+    while (_listener && _lanes.size() + 1 < _count) {
+        SSL *connection = SSL_accept_connection(_listener, 0);
+        if (!connection) {
+            break;
+        }
+        log(LOG_QUIC, "parallel: got extra connection\n");
+        _prepare(connection);
+        Lane lane;
+        lane.connection = connection;
+        _lanes.push_back(lane);
+    }
+
+    for (Lane &lane : _lanes) {
+        advance(lane);
+        if (!lane.bound || lane.closed || SSL_get_shutdown(lane.connection)) {
+            // the other side closes the lanes before the primary connection when it quits
+            continue;
+        }
+        // keepalives of the code side
+        char buf[64];
+        while (quicReadOrEof(lane.control, buf, sizeof(buf)) > 0) {
+        }
+        SSL *stream;
+        while ((stream = SSL_accept_stream(lane.connection, 0))) {
+            log(LOG_QUIC, "parallel: stream {} opened\n", SSL_get_stream_id(stream));
+            onStream(stream);
+        }
+    }
+}
+
+void ParallelConnections::advance(Lane &lane) {
+    if (lane.bound || lane.closed) {
+        return;
+    }
+    if (!lane.handshaked) {
+        if (_client) {
+            int ret = SSL_connect(lane.connection);
+            if (ret != 1) {
+                int ssl_error = SSL_get_error(lane.connection, ret);
+                if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE) {
+                    log(LOG_QUIC, "parallel: extra connection failed\n");
+                    ERR_clear_error();
+                    lane.closed = true;
+                }
+                return;
+            }
+        } else if (!SSL_is_init_finished(lane.connection)) {
+            return;
+        }
+        lane.handshaked = true;
+        SSL_set_default_stream_mode(lane.connection, SSL_DEFAULT_STREAM_MODE_NONE);
+
+        if (_client) {
+            lane.control = SSL_new_stream(lane.connection, 0);
+            if (!lane.control) {
+                fatal_ossl("SSL_new_stream for parallel connection binding:\n");
+            }
+            std::string proof = bindingProof(lane.connection, true);
+            size_t written = 0;
+            if (!SSL_write_ex(lane.control, proof.data(), proof.size(), &written) || written != proof.size()) {
+                fatal_ossl("Failed to write parallel connection binding:\n");
+            }
+        }
+    }
+
+    if (!lane.control) {
+        lane.control = SSL_accept_stream(lane.connection, 0);
+        if (!lane.control) {
+            return;
+        }
+    }
+    if (!checkProof(lane, !_client)) {
+        return;
+    }
+    if (!_client) {
+        std::string proof = bindingProof(lane.connection, false);
+        size_t written = 0;
+        if (!SSL_write_ex(lane.control, proof.data(), proof.size(), &written) || written != proof.size()) {
+            fatal_ossl("Failed to write parallel connection binding:\n");
+        }
+    }
+    lane.bound = true;
+    log(LOG_QUIC, "parallel: extra connection bound\n");
+    if (lanes().size() + 1 == _count) {
+        writeUserMessage({
+                             {"event", "parallel-connections"},
+                             {"connections", _count},
+                         },
+                         "Using {} parallel connections\n", _count);
+    }
+}
+
+std::string ParallelConnections::bindingProof(SSL *connection, bool client) const {
+    constexpr int exportLen = 32;
+    guchar exported[exportLen];
+    const char *label = "exporter lane peersock";
+    if (SSL_export_keying_material(connection, exported, exportLen, label, strlen(label), NULL, 0, 0) != 1) {
+        fatal_ossl("SSL_export_keying_material failed:\n");
+    }
+
+    const char *role = client ? "peersock lane client" : "peersock lane server";
+    GHmac *hmac = g_hmac_new(G_CHECKSUM_SHA256, _secret.data(), _secret.size());
+    if (!hmac) fatal("g_hmac_new failed");
+    g_hmac_update(hmac, (const guchar*)role, strlen(role));
+    g_hmac_update(hmac, exported, exportLen);
+    std::string proof(proofSize, 'B');
+    gsize len = proofSize - 1;
+    g_hmac_get_digest(hmac, (guint8*)proof.data() + 1, &len);
+    g_hmac_unref(hmac);
+    if (len != proofSize - 1) {
+        fatal("hmac get_digest bogus");
+    }
+    return proof;
+}
+
+bool ParallelConnections::checkProof(Lane &lane, bool client) {
+    char buf[proofSize];
+    int read = quicReadOrDie(lane.control, buf, proofSize - lane.proof.size());
+    lane.proof.append(buf, read);
+    if (lane.proof.size() < proofSize) {
+        return false;
+    }
+    std::string expected = bindingProof(lane.connection, client);
+    if (CRYPTO_memcmp(lane.proof.data(), expected.data(), proofSize) != 0) {
+        fatal("parallel connection is not bound to the authenticated connection\n");
+    }
+    return true;
+}
+
+bool ParallelConnections::settled() const {
+    if (!enabled()) {
+        return true;
+    }
+    if (_deadline == -1) {
+        return false;
+    }
+    return lanes().size() + 1 == _count || g_get_monotonic_time() >= _deadline;
+}
+
+std::vector<SSL*> ParallelConnections::lanes() const {
+    std::vector<SSL*> result;
+    for (const Lane &lane : _lanes) {
+        if (lane.bound && !lane.closed) {
+            result.push_back(lane.connection);
+        }
+    }
+    return result;
+}
+
+void ParallelConnections::sendKeepalives() {
+    if (!_client) {
+        return;
+    }
+    for (Lane &lane : _lanes) {
+        if (!lane.bound || lane.closed) {
+            continue;
+        }
+        size_t written = 0;
+        if (!SSL_write_ex(lane.control, "*", 1, &written)) {
+            // blocked by flow control, the lane is not idle anyway
+            ERR_clear_error();
+        }
+    }
+}
+
+bool ParallelConnections::shutdown() {
+    bool done = true;
+    for (Lane &lane : _lanes) {
+        if (!lane.bound || lane.closed) {
+            continue;
+        }
+        // flushes the striped streams of the lane first
+        int ret = SSL_shutdown(lane.connection);
+        if (ret < 0) {
+            fatal_ossl("SSL_shutdown of parallel connection failed:\n");
+        }
+        if (ret) {
+            lane.closed = true;
+        } else {
+            done = false;
+        }
+    }
+    return done;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+#include <glib.h>
+
+// Extra QUIC connections ("lanes") over the same ICE pair, set up after the SMP authentication of the primary
+// connection. The connections share the QUIC port of the primary one, which tells their datagrams apart by the
+// connection id. Each lane gets its own congestion controller and flow control windows. All lanes share the port, so
+// they are processed by the same SSL_handle_events calls and packet protection of all lanes stays on one core.
+// A lane is bound to the authenticated secret of the primary connection: the code side opens the first stream of the
+// lane and sends 'B' and HMAC-SHA256(secret, "peersock lane client" + exporter of the lane), the initiator checks it
+// and answers with the same for "peersock lane server". Only bound lanes carry payload streams.
+class ParallelConnections {
+public:
+    static ParallelConnections &instance();
+
+    // number of connections including the primary one, as agreed during rendezvous
+    void setCount(unsigned count) { _count = count; }
+    unsigned count() const { return _count; }
+    bool enabled() const { return _count > 1; }
+
+    // Called once the primary connection is authenticated. The code side connects the lanes using connect, the
+    // initiator accepts them from listener and passes each to prepare. tick is called when the setup times out.
+    void startClient(const std::array<guint8, 32> &secret, std::function<SSL*()> connect, std::function<void()> tick);
+    void startServer(const std::array<guint8, 32> &secret, SSL *listener, std::function<void(SSL*)> prepare,
+                     std::function<void()> tick);
+
+    // Advances handshakes and binding, payload streams opened by the other side on bound lanes go to onStream.
+    void poll(std::function<void(SSL*)> onStream);
+
+    // true once all lanes are bound or the setup timed out, lanes that are not bound by then are not used
+    bool settled() const;
+    std::vector<SSL*> lanes() const;
+
+    // keeps idle lanes from running into the idle timeout, sent by the code side like the primary keepalive
+    void sendKeepalives();
+
+    // Starts or continues the shutdown of all bound lanes, true once all of them are closed.
+    bool shutdown();
+
+private:
+    struct Lane {
+        SSL *connection = nullptr;
+        SSL *control = nullptr;
+        std::string proof;
+        bool handshaked = false;
+        bool bound = false;
+        bool closed = false;
+    };
+
+    ParallelConnections() = default;
+
+    static gboolean wrap_setupTimeout(gpointer user_data);
+    void advance(Lane &lane);
+    std::string bindingProof(SSL *connection, bool client) const;
+    bool checkProof(Lane &lane, bool client);
+
+    static constexpr gint64 _setupTimeoutUs = 10 * G_USEC_PER_SEC;
+
+    unsigned _count = 1;
+    bool _client = false;
+    std::array<guint8, 32> _secret;
+    SSL *_listener = nullptr;
+    std::function<void(SSL*)> _prepare;
+    std::function<void()> _tick;
+    gint64 _deadline = -1;
+    std::vector<Lane> _lanes;
+};
@@ -1,5 +1,6 @@
 #include "peersock.h"
 
+#include <algorithm>
 #include <chrono>
 #include <random>
 #include <string>
@@ -7,6 +8,9 @@
 #include <type_traits>
 #include <variant>
 
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 #include <glib.h>
 #include <libsoup/soup.h>
 #include <agent.h> // libnice
@@ -21,6 +25,16 @@ extern "C" {
 #include <openssl/pem.h>
 #include <openssl/ssl.h>
 
+#include "autotune.h"
+#include "buffers.h"
+#include "compression.h"
+#include "control.h"
+#include "multipath.h"
+#include "nicebio.h"
+#include "parallel.h"
+#include "pmtud.h"
+#include "quicthread.h"
+#include "resumption.h"
 #include "utils.h"
 
 using namespace std::string_literals;
@@ -36,12 +50,21 @@ static const unsigned char alpn[] = { 10, 'x', '-', 'p', 'e', 'e', 'r', 's', 'o'
 std::function<void(std::string)> codeCallback;
 
 static SSL *quicKeepaliveStream = nullptr; // stream 0
+static int keepaliveInterval = 15;
+static bool compressionWanted = false;
+static bool pathMtuDiscoveryWanted = false;
+static bool pathMtuDiscovery = false;
+// stream 0 carries the control protocol instead of plain keepalive bytes
+static bool controlProtocol = false;
+// the rendezvous connection stays open to exchange the candidates of ICE restarts
+static bool iceRestartSupported = false;
+static bool multipathWanted = false;
+static unsigned parallelWanted = 1;
 static std::string AuthStreamBuffer;
 static SSL *quicAuthStream = nullptr; // stream 4
 
 static SSL *quic_poll;
 static SSL_CTX *quic_ssl_ctx;
-static BIO *quic_dgram_bio;
 
 
 enum class ShutdownState {
@@ -59,6 +82,8 @@ static int authStep = 0;
 
 // from code
 static SSL *quic_client;
+// with parallel connections, the port shared by quic_client and the extra connections
+static SSL *quic_client_port;
 
 
 // server (initiator)
@@ -78,7 +103,12 @@ public:
     }
 
     void shutdown() override {
-        int ret = SSL_shutdown(_ssl);
+        ControlChannel::instance().stop();
+        // striped data on the extra connections has to arrive before the primary connection closes
+        int ret = 0;
+        if (ParallelConnections::instance().shutdown()) {
+            ret = SSL_shutdown(_ssl);
+        }
         if (ret < 0) {
             fatal_ossl("SSL_shutdown failed:\n");
         }
@@ -86,6 +116,14 @@ public:
         ::quicPoll();
     }
 
+    bool lanesSettled() override {
+        return ParallelConnections::instance().settled();
+    }
+
+    std::vector<SSL*> lanes() override {
+        return ParallelConnections::instance().lanes();
+    }
+
     SSL *_ssl = nullptr;
 };
 
@@ -281,22 +319,187 @@ static std::array<guint8, 32> authSecret(std::string_view connectionSecret, std:
     return ret;
 }
 
-static int timer_generation = 0;
-static int onQuicPollTimeout(void *data) {
-    if (timer_generation == (intptr_t)data) {
-         quicPoll();
+static void requestDatagramResize() {
+    NiceDatagramBio::instance().setQueueLimit(bufferSizes.datagram);
+    log(LOG_QUIC, "datagram queue resized to {}\n", bufferSizes.datagram);
+}
+
+// A single source wakes quicPoll when the next QUIC timer of OpenSSL expires. It is rearmed in place after every
+// poll, using the microsecond ready time of the monotonic clock.
+static GSource *quicTimerSource = nullptr;
+static uint64_t quicPolls = 0;
+static uint64_t quicTimerFires = 0;
+// fires where OpenSSL's deadline was actually reached, the others found it moved by a poll in between
+static uint64_t quicTimerPolls = 0;
+
+static SSL *quicEventSsl() {
+    return quic_connection ? quic_connection : quic_poll;
+}
+
+static void logQuicTimerStats() {
+    log(LOG_QUIC, "quic polls: {}, timer fires: {}, polls by timer: {}\n", quicPolls, quicTimerFires,
+        quicTimerPolls);
+}
+
+static void armQuicTimer() {
+    struct timeval tv;
+    int is_infinite = 0;
+
+    if (!SSL_get_event_timeout(quicEventSsl(), &tv, &is_infinite) || is_infinite) {
+        g_source_set_ready_time(quicTimerSource, -1);
+        return;
     }
+    gint64 timeout = tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+    log(LOG_QUIC, "quicPoll rescheduled in {}us\n", timeout);
+    g_source_set_ready_time(quicTimerSource, g_get_monotonic_time() + timeout);
+}
 
-    return false;
+// Received datagrams are only queued for the QUIC BIO, one quicPoll in the next main loop iteration processes
+// the whole burst. Any poll in between clears the request, as it consumes the queue just the same.
+static bool ingressPollRequested = false;
+static uint64_t ingressDatagrams = 0;
+static uint64_t ingressPolls = 0;
+// datagrams that did not fit into the receive queue, QUIC handles them like loss on the path
+static uint64_t ingressOverflows = 0;
+
+static void logIngressStats() {
+    log(LOG_QUIC, "ingress datagrams: {}, polls for ingress: {}, overflowed: {}, egress drops: {}\n",
+        ingressDatagrams, ingressPolls, ingressOverflows, NiceDatagramBio::instance().sendDrops());
+}
+
+static void queueIngressDatagram(gchar *buf, guint len) {
+    ++ingressDatagrams;
+    if (!NiceDatagramBio::instance().queueReceived(buf, len)) {
+        ++ingressOverflows;
+        log(LOG_QUIC, "ingress datagram of {} bytes dropped, queue full ({} overflows)\n", len, ingressOverflows);
+    }
+}
+
+static void requestIngressPoll() {
+    if (ingressPollRequested) {
+        return;
+    }
+    ingressPollRequested = true;
+    g_source_set_ready_time(quicTimerSource, 0);
+}
+
+static gboolean dispatchQuicTimer(GSource *source, GSourceFunc callback, gpointer user_data) {
+    (void)callback;
+    (void)user_data;
+    g_source_set_ready_time(source, -1);
+
+    if (ingressPollRequested) {
+        ++ingressPolls;
+        quicPoll();
+        return G_SOURCE_CONTINUE;
+    }
+
+    ++quicTimerFires;
+
+    struct timeval tv;
+    int is_infinite = 0;
+    if (SSL_get_event_timeout(quicEventSsl(), &tv, &is_infinite) && !is_infinite && (tv.tv_sec || tv.tv_usec)) {
+        // deadline moved since the timer was armed
+        armQuicTimer();
+        return G_SOURCE_CONTINUE;
+    }
+    if (is_infinite) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    ++quicTimerPolls;
+    quicPoll();
+    return G_SOURCE_CONTINUE;
+}
+
+static void createQuicTimer() {
+    static GSourceFuncs timerFuncs = {
+        nullptr,
+        nullptr,
+        dispatchQuicTimer,
+        nullptr,
+        nullptr,
+        nullptr,
+    };
+
+    quicTimerSource = g_source_new(&timerFuncs, sizeof(GSource));
+    g_source_set_name(quicTimerSource, "quic timer");
+    g_source_attach(quicTimerSource, g_main_context_get_thread_default());
+    atexit(logQuicTimerStats);
+    atexit(logIngressStats);
+}
+
+static void onQuicThreadEvents(bool poll) {
+    NiceDatagramBio::instance().sendQueued();
+    if (poll) {
+        quicPoll();
+    }
+}
+
+// Keeps calls on connection from the main thread from processing events if the QUIC thread is enabled.
+static void useExplicitEventHandling(SSL *connection) {
+    if (!QuicThread::instance().started()) {
+        return;
+    }
+    if (!SSL_set_value_uint(connection, SSL_VALUE_CLASS_GENERIC, SSL_VALUE_EVENT_HANDLING_MODE,
+                            SSL_VALUE_EVENT_HANDLING_MODE_EXPLICIT)) {
+        fatal_ossl("Setting explicit event handling failed:\n");
+    }
+}
+
+// Hands event processing of connection to the QUIC thread if enabled. OpenSSL builds with thread support default to
+// the multi threaded domain, which locks the connection for calls from the main thread.
+// Events of the extra parallel connections are processed along with it, they share its port.
+static void useQuicThread(SSL *connection) {
+    if (!QuicThread::instance().started()) {
+        return;
+    }
+    useExplicitEventHandling(connection);
+    QuicThread::instance().setConnection(connection);
+}
+
+// Keeps NAT and TURN bindings open while no local connection transfers data, the other side echoes the byte.
+static void sendKeepalive() {
+    size_t written = 0;
+    if (!SSL_write_ex(quicKeepaliveStream, "*", 1, &written)) {
+        int ssl_error = SSL_get_error(quicKeepaliveStream, 0);
+        if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE) {
+            fatal_ossl("keepalive write failed:\n");
+        }
+        // blocked by flow control, the connection is not idle anyway
+        ERR_clear_error();
+    }
 }
 
 static int keepAliveTimer(void *data) {
     (void)data;
-    //SSL_write(quicKeepaliveStream, "*", 1);
-    //quicPoll();
+    if (in_shutdown != ShutdownState::noShutdown) {
+        return false;
+    }
+    if (!controlProtocol) {
+        log(LOG_QUIC, "sending keepalive\n");
+        sendKeepalive();
+    }
+    ParallelConnections::instance().sendKeepalives();
+    quicPoll();
     return true;
 }
 
+static void drainKeepalive(bool echo) {
+    if (controlProtocol) {
+        ControlChannel::instance().poll();
+        return;
+    }
+    char buf[1000];
+    int read = quicReadOrDie(quicKeepaliveStream, buf, sizeof(buf));
+    if (read > 0) {
+        log(LOG_QUIC, "quic read on keepalive: l{}:{}\n", read, std::string_view{(const char*)buf, (uint)read});
+        if (echo) {
+            sendKeepalive();
+        }
+    }
+}
+
 static void sendAuthFrame(unsigned char *bufPtr, int bufLen) {
     char c;
     c = (bufLen >> 8) & 0xff;
@@ -350,6 +553,61 @@ static NiceAgent *iceAgent = nullptr;
 static void onIceCandidateGatheringDone(NiceAgent *iceAgent, guint stream_id, gpointer data);
 static void onIceReceive(NiceAgent *iceAgent, guint streamId, guint componentId, guint len, gchar *buf, gpointer data);
 static void onIceComponentStateChanged(NiceAgent *iceAgent, guint streamId, guint componentId, guint state, gpointer data);
+static void requestIceRestart(std::string_view reason);
+
+// Probes need the don't fragment bit, without using the cached path MTU of the kernel.
+static bool setDontFragment(GSocket *socket) {
+    int fd = g_socket_get_fd(socket);
+    if (g_socket_get_family(socket) == G_SOCKET_FAMILY_IPV6) {
+        int value = IPV6_PMTUDISC_PROBE;
+        return setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &value, sizeof(value)) == 0;
+    }
+    int value = IP_PMTUDISC_PROBE;
+    return setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value)) == 0;
+}
+
+// Probes need the don't fragment bit on the socket of the selected pair. Returns false if the path can't be probed.
+static bool prepareSelectedPathForProbes(bool &relayed) {
+    relayed = false;
+    NiceCandidate *local = nullptr;
+    NiceCandidate *remote = nullptr;
+    if (!nice_agent_get_selected_pair(iceAgent, iceStreamId, 1, &local, &remote)) {
+        log(LOG_ICE, "pmtud: no selected pair, not probing\n");
+        return false;
+    }
+    relayed = local->type == NICE_CANDIDATE_TYPE_RELAYED || remote->type == NICE_CANDIDATE_TYPE_RELAYED;
+
+    GSocket *socket = nice_agent_get_selected_socket(iceAgent, iceStreamId, 1);
+    if (!socket) {
+        if (local->type == NICE_CANDIDATE_TYPE_RELAYED) {
+            // libnice doesn't hand out the socket to the TURN server, the relayed limits keep probes within a 1500
+            // byte MTU
+            log(LOG_ICE, "pmtud: relayed by this side, probing without don't fragment\n");
+            return true;
+        }
+        log(LOG_ICE, "pmtud: no selected socket, not probing\n");
+        return false;
+    }
+    bool dontFragment = setDontFragment(socket);
+    g_object_unref(socket);
+    if (!dontFragment) {
+        log(LOG_ICE, "pmtud: can not set don't fragment, not probing\n");
+        return false;
+    }
+    return true;
+}
+
+static void startPathMtuDiscovery() {
+    if (!pathMtuDiscovery) {
+        return;
+    }
+
+    bool relayed = false;
+    bool probe = prepareSelectedPathForProbes(relayed);
+    PathMtuProber::instance().start(relayed, probe, [] (size_t mtu) {
+        NiceDatagramBio::instance().setPathMtu(mtu);
+    });
+}
 
 static void sendRendMessage(SoupWebsocketConnection *wsConnection, nlohmann::json msg) {
     std::string out = msg.dump();
@@ -366,29 +624,70 @@ static void sendBind(SoupWebsocketConnection *wsConnection, std::string_view sid
     sendRendMessage(wsConnection, msg);
 }
 
-static void sendICE(SoupWebsocketConnection *wsConnection, int streamId) {
-    nlohmann::json ice;
+// Closes the rendezvous connection once QUIC is up, unless it is kept for ICE restarts.
+static void finishRendezvous(SoupWebsocketConnection *&wsConnection) {
+    if (!wsConnection || soup_websocket_connection_get_state(wsConnection) != SOUP_WEBSOCKET_STATE_OPEN) {
+        return;
+    }
+    if (iceRestartSupported) {
+        // the mailbox server and NAT on the way drop idle websockets
+        soup_websocket_connection_set_keepalive_interval(wsConnection, 30);
+        return;
+    }
+    soup_websocket_connection_close(wsConnection, SOUP_WEBSOCKET_CLOSE_NORMAL, nullptr);
+    wsConnection = nullptr;
+}
 
-    gchar *user = NULL;
-    gchar *password = NULL;
-    if (!nice_agent_get_local_credentials(iceAgent, streamId, &user, &password)) {
-        // TODO error handling
-        fatal("nice_agent_get_local_credentials");
+// the extra components of multipath mode each nominate a pair of their own
+static guint iceComponents() {
+    return multipathWanted ? 2 : 1;
+}
+
+// Adds a stream with relays on all components and starts gathering, used for the first stream and ICE restarts.
+static guint addIceStream(const PeersockConfig &config) {
+    guint streamId = nice_agent_add_stream(iceAgent, iceComponents());
+    if (!streamId) {
+        fatal("Invalid zero stream id\n");
     }
 
-    ice["u"] = user;
-    ice["p"] = password;
+    // for some reason this didn't work without manually resolving the server to ips.
+    auto ips = resolveNameToIps(config.turnServer);
+    for (guint component = 1; component <= iceComponents(); component++) {
+        for (std::string ip: ips) {
+            nice_agent_set_relay_info(iceAgent, streamId, component, ip.data(), *config.turnPort, config.turnUser.data(), config.turnPassword.data(), NICE_RELAY_TYPE_TURN_UDP);
+            nice_agent_set_relay_info(iceAgent, streamId, component, ip.data(), *config.turnPort, config.turnUser.data(), config.turnPassword.data(), NICE_RELAY_TYPE_TURN_TCP);
+        }
+
+        nice_agent_attach_recv(iceAgent, streamId, component, g_main_context_get_thread_default() /*g_main_loop_get_context (mainLoop)*/, onIceReceive, NULL);
+    }
+
+    if (!nice_agent_gather_candidates(iceAgent, streamId)) {
+        fatal("nice_agent_gather_candidates failed.\n");
+    }
+    return streamId;
+}
 
+static std::vector<nlohmann::json> localCandidatesJson(int streamId, guint component, bool preferRelayed) {
     std::vector<nlohmann::json> candidatesJson;
 
-    auto candidates = nice_agent_get_local_candidates(iceAgent, streamId, 1);
+    auto candidates = nice_agent_get_local_candidates(iceAgent, streamId, component);
     if (candidates == NULL) {
         // TODO error handling
         fatal("no candidates");
     }
 
+    bool relayedOnly = false;
+    if (preferRelayed) {
+        for (auto item = candidates; item; item = item->next) {
+            relayedOnly |= ((NiceCandidate *)item->data)->type == NICE_CANDIDATE_TYPE_RELAYED;
+        }
+    }
+
     for (auto item = candidates; item; item = item->next) {
         NiceCandidate *candidate = (NiceCandidate *)item->data;
+        if (relayedOnly && candidate->type != NICE_CANDIDATE_TYPE_RELAYED) {
+            continue;
+        }
 
         nlohmann::json candJson;
 
@@ -411,29 +710,17 @@ static void sendICE(SoupWebsocketConnection *wsConnection, int streamId) {
 
         candidatesJson.push_back(candJson);
     }
+    g_slist_free_full(candidates, (GDestroyNotify)&nice_candidate_free);
 
-    ice["c"] = candidatesJson;
-
-    sendRendMessage(wsConnection, {
-                    {"type", "add"},
-                    {"phase", "ice"},
-                    {"body", ice.dump()}
-                });
+    return candidatesJson;
 }
 
-static void applyRemoteICE(nlohmann::json msg, int streamId) {
-    std::string body = msg.value("body", "");
-    auto ice = nlohmann::json::parse(body);
+static void setRemoteCandidates(const std::vector<nlohmann::json> &candidatesJson, int streamId, guint component) {
     GSList *candidates = nullptr;
 
-    std::string user = ice["u"];
-    std::string password = ice["p"];
-
-    std::vector<nlohmann::json> candidatesJson = ice["c"];
-
     for (nlohmann::json candJson : candidatesJson) {
         NiceCandidate *candidate = nice_candidate_new(candJson["t"]);
-        candidate->component_id = 1;
+        candidate->component_id = component;
         candidate->stream_id = streamId;
         candidate->transport = candJson["tr"];
         std::string foundation = candJson["f"];
@@ -460,11 +747,197 @@ static void applyRemoteICE(nlohmann::json msg, int streamId) {
         candidates = g_slist_prepend (candidates, candidate);
     }
 
+    nice_agent_set_remote_candidates(iceAgent, streamId, component, candidates);
+    g_slist_free_full(candidates, (GDestroyNotify)&nice_candidate_free);
+}
+
+// credentials and candidates of a stream, as sent during rendezvous and for ICE restarts
+static nlohmann::json localIceJson(int streamId) {
+    nlohmann::json ice;
+
+    gchar *user = NULL;
+    gchar *password = NULL;
+    if (!nice_agent_get_local_credentials(iceAgent, streamId, &user, &password)) {
+        // TODO error handling
+        fatal("nice_agent_get_local_credentials");
+    }
+
+    ice["u"] = user;
+    ice["p"] = password;
+
+    ice["c"] = localCandidatesJson(streamId, 1, false);
+    if (multipathWanted) {
+        // the extra path goes through the relay if there is one, the direct path is taken by component 1
+        ice["m"] = localCandidatesJson(streamId, 2, true);
+    }
+    return ice;
+}
+
+static void sendICE(SoupWebsocketConnection *wsConnection, int streamId, bool announcePairings = false) {
+    nlohmann::json ice = localIceJson(streamId);
+
+    // optional features, each is used if both sides announce it
+    std::vector<std::string> features;
+    if (compressionWanted && compressionAvailable()) {
+        features.push_back("zstd");
+    }
+    if (pathMtuDiscoveryWanted) {
+        features.push_back("pmtud");
+    }
+    features.push_back("control");
+    features.push_back("restart");
+    if (SessionCache::instance().enabled()) {
+        features.push_back("resume");
+        if (announcePairings) {
+            SessionCache::instance().announce(ice);
+        }
+    }
+    if (multipathWanted) {
+        features.push_back("multipath");
+    }
+    if (parallelWanted > 1) {
+        features.push_back("parallel");
+        ice["n"] = parallelWanted;
+    }
+    ice["x"] = features;
+
+    sendRendMessage(wsConnection, {
+                    {"type", "add"},
+                    {"phase", "ice"},
+                    {"body", ice.dump()}
+                });
+}
+
+static void applyRemoteICE(nlohmann::json msg, int streamId) {
+    std::string body = msg.value("body", "");
+    auto ice = nlohmann::json::parse(body);
+
+    std::string user = ice["u"];
+    std::string password = ice["p"];
+
+    std::vector<std::string> remoteFeatures = ice.value("x", std::vector<std::string>{});
+    streamCompression = compressionWanted && compressionAvailable()
+        && std::find(remoteFeatures.begin(), remoteFeatures.end(), "zstd") != remoteFeatures.end();
+    if (streamCompression) {
+        log(LOG_ICE, "Both sides support compression, payload streams are compressed\n");
+    }
+    pathMtuDiscovery = pathMtuDiscoveryWanted
+        && std::find(remoteFeatures.begin(), remoteFeatures.end(), "pmtud") != remoteFeatures.end();
+    if (pathMtuDiscovery) {
+        PathMtuProber::instance().setSender([] (const char *buf, size_t len) {
+            return nice_agent_send(iceAgent, iceStreamId, 1, len, buf) == (gint)len;
+        });
+    }
+
+    controlProtocol = std::find(remoteFeatures.begin(), remoteFeatures.end(), "control") != remoteFeatures.end();
+    iceRestartSupported = std::find(remoteFeatures.begin(), remoteFeatures.end(), "restart") != remoteFeatures.end();
+    if (std::find(remoteFeatures.begin(), remoteFeatures.end(), "resume") == remoteFeatures.end()) {
+        SessionCache::instance().setEnabled(false);
+    }
+    // only the initiator announces pairings
+    SessionCache::instance().selectSession(ice);
+    if (controlProtocol && iceRestartSupported) {
+        ControlChannel::instance().setStallHandler([] {
+            requestIceRestart("no answer on the control stream");
+        });
+    }
+
+    if (parallelWanted > 1
+        && std::find(remoteFeatures.begin(), remoteFeatures.end(), "parallel") != remoteFeatures.end()) {
+        unsigned count = std::min(parallelWanted, ice.value("n", 1u));
+        ParallelConnections::instance().setCount(std::max(count, 1u));
+        log(LOG_ICE, "Both sides support parallel connections, using {}\n", ParallelConnections::instance().count());
+    }
+
+    bool multipath = multipathWanted && ice.contains("m")
+        && std::find(remoteFeatures.begin(), remoteFeatures.end(), "multipath") != remoteFeatures.end();
+
     nice_agent_set_remote_credentials(iceAgent, streamId, user.data(), password.data());
-    nice_agent_set_remote_candidates(iceAgent, streamId, 1, candidates);
+    setRemoteCandidates(ice["c"], streamId, 1);
+    if (multipath) {
+        MultipathScheduler::instance().start(iceAgent, streamId, iceComponents());
+        setRemoteCandidates(ice["m"], streamId, 2);
+    }
 }
 
 
+// Creates a client connection and starts its handshake, the extra parallel connections share the port of the first.
+// Both sides need to request it, the smaller timeout of both sides applies. Idle connections are held open by
+// keepalives, this only detects a vanished peer.
+static void setIdleTimeout(SSL *connection) {
+    if (!SSL_set_value_uint(connection, SSL_VALUE_CLASS_FEATURE_REQUEST, SSL_VALUE_QUIC_IDLE_TIMEOUT,
+                            keepaliveInterval * 4 * 1000)) {
+        fatal_ossl("setting idle timeout failed:\n");
+    }
+}
+
+static SSL *newQuicClient() {
+    SSL_CTX_set_verify(quic_ssl_ctx, SSL_VERIFY_PEER, NULL);
+    SSL *client = nullptr;
+    if (ParallelConnections::instance().enabled()) {
+        // the port demultiplexes the datagrams of the connections by connection id
+        if (!quic_client_port) {
+            quic_client_port = SSL_new_listener(quic_ssl_ctx, SSL_LISTENER_FLAG_NO_ACCEPT);
+            if (!quic_client_port) {
+                fatal_ossl("SSL_new_listener failed:\n");
+            }
+            SSL_set_blocking_mode(quic_client_port, 0);
+            BIO *dgram_for_ossl = NiceDatagramBio::instance().newBio(BIO_DGRAM_CAP_HANDLES_DST_ADDR);
+            SSL_set_bio(quic_client_port, dgram_for_ossl, dgram_for_ossl);
+        }
+        client = SSL_new_from_listener(quic_client_port, 0);
+        if (!client) {
+            fatal_ossl("SSL_new_from_listener failed:\n");
+        }
+    } else {
+        client = SSL_new(quic_ssl_ctx);
+        if (!client) {
+            fatal_ossl("SSL_new failed:\n");
+        }
+        BIO *dgram_for_ossl = NiceDatagramBio::instance().newBio(BIO_DGRAM_CAP_HANDLES_DST_ADDR);
+
+        // TODO possibly add capabilities?
+
+        SSL_set_bio(client, dgram_for_ossl, dgram_for_ossl);
+    }
+
+    if (!SSL_set_tlsext_host_name(client, "dummy")) {
+        fatal_ossl("SSL_set_tlsext_host_name failed:\n");
+    }
+
+    if (!SSL_set1_host(client, "dummy")) {
+        fatal_ossl("SSL_set1_host failed:\n");
+    }
+
+    if (SSL_set_alpn_protos(client, alpn, sizeof(alpn)) != 0) {
+        fatal_ossl("SSL_set_alpn_protos failed:\n");
+    }
+
+    BIO_ADDR *peer_addr = BIO_ADDR_new();
+    struct in_addr sin_addr = { 0x02020202 };
+    BIO_ADDR_rawmake(peer_addr, AF_INET, &sin_addr, sizeof(sin_addr), htons(2020));
+
+    if (!SSL_set1_initial_peer_addr(client, peer_addr)) {
+        fatal_ossl("SSL_set1_initial_peer_addr failed:\n");
+    }
+
+    if (!SSL_set_blocking_mode(client, 0)) {
+        fatal_ossl("SSL_set_blocking_mode failed:\n");
+    }
+
+    setIdleTimeout(client);
+
+    int ret = SSL_connect(client);
+    if (ret >= 0) {
+        fatal_ossl("SSL_connect implausible return: {}\n", ret);
+    }
+    int ssl_error = SSL_get_error(client, ret);
+    if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE) {
+        fatal_ossl("SSL_connect failed\n");
+    }
+    return client;
+}
+
 struct RoleInitiator {
     RoleInitiator(PeersockConfig config) : config(config) {};
 
@@ -491,10 +964,7 @@ struct RoleInitiator {
     void handleQuicConnected(std::string_view tlsExport) {
         // other side starts management streams, nothing to do here
         auth = authSecret(tlsExport, code);
-        if (wsConnection && soup_websocket_connection_get_state(wsConnection) == SOUP_WEBSOCKET_STATE_OPEN) {
-            soup_websocket_connection_close(wsConnection, SOUP_WEBSOCKET_CLOSE_NORMAL, nullptr);
-            wsConnection = nullptr;
-        }
+        finishRendezvous(wsConnection);
     }
 
     int handleQuicStreamOpened(SSL *stream) {
@@ -502,6 +972,9 @@ struct RoleInitiator {
         log(LOG_QUIC, "Got new stream {}\n", stream_id);
         if (stream_id == 0) { // keep alive stream
             quicKeepaliveStream = stream;
+            if (controlProtocol) {
+                ControlChannel::instance().start(stream, ::quicPoll);
+            }
         } else if (stream_id == 4) { // auth stream
             quicAuthStream = stream;
         } else if (authDone) {
@@ -517,14 +990,8 @@ struct RoleInitiator {
     }
 
     void quicPoll() {
-        char buf[1000];
-        int read;
-
         if (quicKeepaliveStream) {
-            read = quicReadOrDie(quicKeepaliveStream, buf, sizeof(buf));
-            if (read > 0) {
-                log(LOG_QUIC, "quic read on keepalive: l{}:{}\n", read, std::string_view{(const char*)buf, (uint)read});
-            }
+            drainKeepalive(true);
         }
 
         if (quicAuthStream && !authDone) {
@@ -569,6 +1036,8 @@ struct RoleInitiator {
                                      },
                                      "Auth success\n");
                     authDone = true;
+                    SessionCache::instance().authenticated(quic_connection, true);
+                    ParallelConnections::instance().startServer(auth, quic_poll, useExplicitEventHandling, ::quicPoll);
                     if (!mode) {
                         fatal("Bad mode\n");
                     } else {
@@ -685,23 +1154,8 @@ struct RoleInitiator {
                     g_signal_connect(iceAgent, "candidate-gathering-done", G_CALLBACK(onIceCandidateGatheringDone), NULL);
                     g_signal_connect(iceAgent, "component-state-changed", G_CALLBACK(onIceComponentStateChanged), NULL);
 
-                    guint streamId = nice_agent_add_stream(iceAgent, 1);
-                    if (!streamId) {
-                        fatal("Invalid zero stream id\n");
-                    }
-
-                    // for some reason this didn't work without manually resolving the server to ips.
-                    auto ips = resolveNameToIps(config.turnServer);
-                    for (std::string ip: ips) {
-                        nice_agent_set_relay_info(iceAgent, streamId, 1, ip.data(), *config.turnPort, config.turnUser.data(), config.turnPassword.data(), NICE_RELAY_TYPE_TURN_UDP);
-                        nice_agent_set_relay_info(iceAgent, streamId, 1, ip.data(), *config.turnPort, config.turnUser.data(), config.turnPassword.data(), NICE_RELAY_TYPE_TURN_TCP);
-                    }
-
-                    nice_agent_attach_recv(iceAgent, streamId, 1, g_main_context_get_thread_default() /*g_main_loop_get_context (mainLoop)*/, onIceReceive, NULL);
-
-                    if (!nice_agent_gather_candidates(iceAgent, streamId)) {
-                        fatal("nice_agent_gather_candidates failed.\n");
-                    }
+                    guint streamId = addIceStream(config);
+                    NiceDatagramBio::instance().setStream(iceAgent, streamId);
 
                     return WaitingForLocalCandidates{data, streamId};
                 }
@@ -718,7 +1172,7 @@ struct RoleInitiator {
     State onLocalCandidates(WaitingForLocalCandidates& s) {
         applyRemoteICE(s.remoteCandidates, s.streamId);
 
-        sendICE(wsConnection, s.streamId);
+        sendICE(wsConnection, s.streamId, true);
         return s;
     }
 
@@ -743,6 +1197,7 @@ struct RoleFromCode {
     PeersockConfig config;
     SoupWebsocketConnection *wsConnection;
     std::string localSide = "code";
+    std::array<guint8, 32> auth;
     bool authDone = false;
 
     void handleWsData(nlohmann::json data) {
@@ -757,14 +1212,18 @@ struct RoleFromCode {
         }, state);
     }
     void handleQuicConnected(std::string_view tlsExport) {
-        if (wsConnection && soup_websocket_connection_get_state(wsConnection) == SOUP_WEBSOCKET_STATE_OPEN) {
-            soup_websocket_connection_close(wsConnection, SOUP_WEBSOCKET_CLOSE_NORMAL, nullptr);
-            wsConnection = nullptr;
-        }
+        finishRendezvous(wsConnection);
 
-        auto auth = authSecret(tlsExport, code);
+        auth = authSecret(tlsExport, code);
         quicKeepaliveStream = SSL_new_stream(quic_client, 0);
-        g_timeout_add(15000, keepAliveTimer, nullptr);
+        if (controlProtocol) {
+            // the pings keep the connection from idling
+            ControlChannel::instance().start(quicKeepaliveStream, ::quicPoll);
+        } else {
+            // the stream only opens on the other side when data is written
+            sendKeepalive();
+        }
+        g_timeout_add_seconds(keepaliveInterval, keepAliveTimer, nullptr);
         quicAuthStream = SSL_new_stream(quic_client, 0);
         unsigned char *bufPtr = nullptr;
         int bufLen = 0;
@@ -791,6 +1250,10 @@ struct RoleFromCode {
     }
 
     void quicPoll() {
+        if (quicKeepaliveStream) {
+            drainKeepalive(false);
+        }
+
         if (quicAuthStream && !authDone) {
             quicReadFramedMessageOrDie(quicAuthStream, AuthStreamBuffer, [&] (uint8_t *frame, ssize_t frameLen) {
                 log(LOG_QUIC, "quic auth stream data l{} bytes\n", frameLen);
@@ -820,6 +1283,12 @@ struct RoleFromCode {
                                      },
                                      "Auth success\n");
                     authDone = true;
+                    SessionCache::instance().authenticated(quic_client, false);
+                    ParallelConnections::instance().startClient(auth, [] {
+                        SSL *connection = newQuicClient();
+                        useExplicitEventHandling(connection);
+                        return connection;
+                    }, ::quicPoll);
                     if (!mode) {
                         fatal("Bad mode\n");
                     } else {
@@ -890,23 +1359,8 @@ struct RoleFromCode {
             g_signal_connect(iceAgent, "candidate-gathering-done", G_CALLBACK(onIceCandidateGatheringDone), NULL);
             g_signal_connect(iceAgent, "component-state-changed", G_CALLBACK(onIceComponentStateChanged), NULL);
 
-            guint streamId = nice_agent_add_stream(iceAgent, 1);
-            if (!streamId) {
-                fatal("Invalid zero stream id\n");
-            }
-
-            // for some reason this didn't work without manually resolving the server to ips.
-            auto ips = resolveNameToIps(config.turnServer);
-            for (std::string ip: ips) {
-                nice_agent_set_relay_info(iceAgent, streamId, 1, ip.data(), *config.turnPort, config.turnUser.data(), config.turnPassword.data(), NICE_RELAY_TYPE_TURN_UDP);
-                nice_agent_set_relay_info(iceAgent, streamId, 1, ip.data(), *config.turnPort, config.turnUser.data(), config.turnPassword.data(), NICE_RELAY_TYPE_TURN_TCP);
-            }
-
-            nice_agent_attach_recv(iceAgent, streamId, 1, g_main_context_get_thread_default() /*g_main_loop_get_context (mainLoop)*/, onIceReceive, NULL);
-
-            if (!nice_agent_gather_candidates(iceAgent, streamId)) {
-                fatal("nice_agent_gather_candidates failed.\n");
-            }
+            guint streamId = addIceStream(config);
+            NiceDatagramBio::instance().setStream(iceAgent, streamId);
 
             return WaitingForLocalCandidates{mailbox, streamId};
         } else if (type == "ack"s) {
@@ -969,6 +1423,165 @@ struct RoleFromCode {
 
 static std::variant<std::monostate, RoleInitiator, RoleFromCode> role;
 
+// ICE restart: a new stream gathers candidates next to the current one, they are exchanged over the rendezvous
+// connection as phase "ice-restart-N", where N counts the restarts. A side that gets a higher N than its own restarts
+// too, so both sides starting at the same time agree on the stream. Once the new stream is connected the datagram BIO
+// sends on it and the old stream is removed. QUIC does not see a migration, its peer address is a placeholder anyway,
+// the streams stall until the new pair is up.
+static constexpr guint iceRestartTimeoutSeconds = 30;
+static unsigned iceRestartGeneration = 0;
+static int iceRestartStreamId = -1;
+static bool iceRestartGathered = false;
+// candidates of the other side that arrived before the local ones were gathered
+static nlohmann::json iceRestartRemote;
+
+static SoupWebsocketConnection *rendezvousConnection() {
+    return std::visit([&] (auto &role) -> SoupWebsocketConnection* {
+        if constexpr (std::is_same_v<typeof(role), std::monostate>) {
+            return nullptr;
+        } else {
+            return role.wsConnection;
+        }
+    }, role);
+}
+
+static void applyIceRestartRemote() {
+    std::string user = iceRestartRemote["u"];
+    std::string password = iceRestartRemote["p"];
+    nice_agent_set_remote_credentials(iceAgent, iceRestartStreamId, user.data(), password.data());
+    setRemoteCandidates(iceRestartRemote["c"], iceRestartStreamId, 1);
+    if (MultipathScheduler::instance().active() && iceRestartRemote.contains("m")) {
+        setRemoteCandidates(iceRestartRemote["m"], iceRestartStreamId, 2);
+    }
+    iceRestartRemote = nullptr;
+}
+
+static void abandonIceRestart() {
+    if (iceRestartStreamId == -1) {
+        return;
+    }
+    nice_agent_remove_stream(iceAgent, iceRestartStreamId);
+    iceRestartStreamId = -1;
+    iceRestartRemote = nullptr;
+}
+
+static int iceRestartTimeout(void *data) {
+    unsigned generation = GPOINTER_TO_UINT(data);
+    if (generation == iceRestartGeneration && iceRestartStreamId != -1) {
+        log(LOG_ICE, "ICE restart {} did not connect in time\n", generation);
+        abandonIceRestart();
+    }
+    return false;
+}
+
+static void startIceRestart(unsigned generation) {
+    SoupWebsocketConnection *wsConnection = rendezvousConnection();
+    if (!wsConnection || soup_websocket_connection_get_state(wsConnection) != SOUP_WEBSOCKET_STATE_OPEN) {
+        log(LOG_ICE, "ICE restart not possible, the rendezvous connection is closed\n");
+        return;
+    }
+    abandonIceRestart();
+    iceRestartGeneration = generation;
+    iceRestartGathered = false;
+    std::visit([&] (auto &role) {
+        if constexpr (!std::is_same_v<typeof(role), std::monostate>) {
+            iceRestartStreamId = addIceStream(role.config);
+        }
+    }, role);
+    g_timeout_add_seconds(iceRestartTimeoutSeconds, iceRestartTimeout, GUINT_TO_POINTER(generation));
+    writeUserMessage({
+                         {"event", "ice-restart"},
+                         {"generation", generation},
+                     },
+                     "Connection path lost, searching a new one\n");
+}
+
+static void requestIceRestart(std::string_view reason) {
+    if (!iceRestartSupported || iceRestartStreamId != -1 || in_shutdown != ShutdownState::noShutdown) {
+        return;
+    }
+    log(LOG_ICE, "ICE restart: {}\n", reason);
+    startIceRestart(iceRestartGeneration + 1);
+}
+
+static void onIceRestartGathered() {
+    iceRestartGathered = true;
+    SoupWebsocketConnection *wsConnection = rendezvousConnection();
+    if (!wsConnection || soup_websocket_connection_get_state(wsConnection) != SOUP_WEBSOCKET_STATE_OPEN) {
+        log(LOG_ICE, "ICE restart not possible, the rendezvous connection is closed\n");
+        abandonIceRestart();
+        return;
+    }
+    sendRendMessage(wsConnection, {
+                    {"type", "add"},
+                    {"phase", fmt::format("ice-restart-{}", iceRestartGeneration)},
+                    {"body", localIceJson(iceRestartStreamId).dump()}
+                });
+    if (!iceRestartRemote.is_null()) {
+        applyIceRestartRemote();
+    }
+}
+
+// true if data was an ICE restart message of the other side
+static bool handleIceRestartMessage(const nlohmann::json &data) {
+    std::string_view prefix = "ice-restart-";
+    std::string phase = data.value("phase", "");
+    if (data.value("type", "") != "message"s || phase.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    std::string localSide = std::visit([&] (auto &role) -> std::string {
+        if constexpr (std::is_same_v<typeof(role), std::monostate>) {
+            return "";
+        } else {
+            return role.localSide;
+        }
+    }, role);
+    if (!iceRestartSupported || data.value("side", "") == localSide) {
+        return true;
+    }
+
+    unsigned generation = std::strtoul(phase.data() + prefix.size(), nullptr, 10);
+    if (generation > iceRestartGeneration) {
+        log(LOG_ICE, "ICE restart {} requested by the other side\n", generation);
+        startIceRestart(generation);
+    }
+    if (generation != iceRestartGeneration || iceRestartStreamId == -1) {
+        // a restart that was superseded, finished or could not start
+        return true;
+    }
+    iceRestartRemote = nlohmann::json::parse(data.value("body", "{}"));
+    if (iceRestartGathered) {
+        applyIceRestartRemote();
+    }
+    return true;
+}
+
+static void finishIceRestart() {
+    int oldStreamId = iceStreamId;
+    iceStreamId = iceRestartStreamId;
+    iceRestartStreamId = -1;
+    NiceDatagramBio::instance().setStream(iceAgent, iceStreamId);
+    MultipathScheduler::instance().setStream(iceStreamId);
+    ControlChannel::instance().pathChanged();
+    BufferAutotuner::instance().pathChanged();
+    if (oldStreamId != -1) {
+        nice_agent_remove_stream(iceAgent, oldStreamId);
+    }
+    writeUserMessage({
+                         {"event", "ice-restarted"},
+                         {"generation", iceRestartGeneration},
+                     },
+                     "Connection moved to a new path\n");
+
+    if (pathMtuDiscovery) {
+        bool relayed = false;
+        bool probe = prepareSelectedPathForProbes(relayed);
+        PathMtuProber::instance().pathChanged(relayed, probe);
+    }
+    // sends what QUIC queued while the path was down
+    quicPoll();
+}
+
 static void onRendMessage(SoupWebsocketConnection *conn, gint type, GBytes *message, gpointer data) {
     (void)conn; (void)data;
     if (type == SOUP_WEBSOCKET_DATA_TEXT) {
@@ -979,6 +1592,9 @@ static void onRendMessage(SoupWebsocketConnection *conn, gint type, GBytes *mess
         log(LOG_REND, "Received text data: {}\n", (const char*)ptr);
 
         auto j = nlohmann::json::parse(std::string_view((const char*)ptr));
+        if (handleIceRestartMessage(j)) {
+            return;
+        }
         std::visit([&] (auto &role) {
             if constexpr (std::is_same_v<typeof(role), std::monostate>) {
                 fatal("Bad role\n");
@@ -994,59 +1610,35 @@ static void onIceComponentStateChanged(NiceAgent *agent, guint streamId, guint c
     static const gchar *state_name[] = {"disconnected", "gathering", "connecting",
                                         "connected", "ready", "failed"};
 
-    log(LOG_ICE, "State change: {}\n", state_name[state]);
-    if (state == NICE_COMPONENT_STATE_CONNECTED) {
-        if (std::holds_alternative<RoleFromCode>(role)) {
-            SSL_CTX_set_verify(quic_ssl_ctx, SSL_VERIFY_PEER, NULL);
-            quic_client = SSL_new(quic_ssl_ctx);
-            if (!quic_client) {
-                fatal_ossl("SSL_new failed:\n");
-            }
-            BIO *dgram_for_ossl = nullptr;
-            if (!BIO_new_bio_dgram_pair(&quic_dgram_bio, 1024 * 1024, &dgram_for_ossl, 1024 * 1024)) {
-                fatal_ossl("BIO_new_bio_dgram_pair failed:\n");
-            }
-            BIO_dgram_set_caps(dgram_for_ossl, BIO_DGRAM_CAP_HANDLES_DST_ADDR);
-            BIO_dgram_set_caps(quic_dgram_bio, BIO_DGRAM_CAP_HANDLES_DST_ADDR);
-
-            // TODO possibly add capabilities?
-
-            SSL_set_bio(quic_client, dgram_for_ossl, dgram_for_ossl);
-
-            if (!SSL_set_tlsext_host_name(quic_client, "dummy")) {
-                fatal_ossl("SSL_set_tlsext_host_name failed:\n");
-            }
-
-            if (!SSL_set1_host(quic_client, "dummy")) {
-                fatal_ossl("SSL_set1_host failed:\n");
-            }
-
-            if (SSL_set_alpn_protos(quic_client, alpn, sizeof(alpn)) != 0) {
-                fatal_ossl("SSL_set_alpn_protos failed:\n");
-            }
-
-            BIO_ADDR *peer_addr = BIO_ADDR_new();
-            struct in_addr sin_addr = { 0x02020202 };
-            BIO_ADDR_rawmake(peer_addr, AF_INET, &sin_addr, sizeof(sin_addr), htons(2020));
-
-            if (!SSL_set1_initial_peer_addr(quic_client, peer_addr)) {
-                fatal_ossl("SSL_set1_initial_peer_addr failed:\n");
-            }
+    if ((int)streamId == iceRestartStreamId) {
+        log(LOG_ICE, "State change of restarted component {}: {}\n", componentId, state_name[state]);
+        if (componentId == 1 && state == NICE_COMPONENT_STATE_CONNECTED) {
+            finishIceRestart();
+        }
+        return;
+    }
+    if (iceStreamId != -1 && (int)streamId != iceStreamId) {
+        // stream replaced by a restart
+        return;
+    }
 
-            if (!SSL_set_blocking_mode(quic_client, 0)) {
-                fatal_ossl("SSL_set_blocking_mode failed:\n");
-            }
+    MultipathScheduler::instance().setComponentState(componentId, state);
+    if (componentId != 1) {
+        log(LOG_ICE, "State change of component {}: {}\n", componentId, state_name[state]);
+        return;
+    }
 
-            int ret = SSL_connect(quic_client);
-            if (ret >= 0) {
-                fatal_ossl("SSL_connect implausible return: {}\n", ret);
-            }
-            int ssl_error = SSL_get_error(quic_client, ret);
-            if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE) {
-                fatal_ossl("SSL_connect failed\n");
-            }
+    log(LOG_ICE, "State change: {}\n", state_name[state]);
+    if (state == NICE_COMPONENT_STATE_FAILED && quicConnectionUp) {
+        requestIceRestart("selected pair failed");
+    }
+    if (state == NICE_COMPONENT_STATE_CONNECTED && !quic_client) {
+        if (std::holds_alternative<RoleFromCode>(role)) {
+            quic_client = newQuicClient();
+            SessionCache::instance().prepareConnection(quic_client);
             quic_poll = quic_client;
             iceStreamId = streamId;
+            useQuicThread(quic_client);
             quicPoll();
         }
     }
@@ -1088,6 +1680,10 @@ static void OnRendConnection(SoupSession *session, GAsyncResult *res, gpointer d
 
 static void onIceCandidateGatheringDone(NiceAgent *agent, guint stream_id, gpointer data) {
     log(LOG_ICE, "Gathering done\n");
+    if ((int)stream_id == iceRestartStreamId) {
+        onIceRestartGathered();
+        return;
+    }
     std::visit([&] (auto &role) {
         if constexpr (std::is_same_v<typeof(role), std::monostate>) {
             fatal("Bad role\n");
@@ -1108,15 +1704,32 @@ static int alpn_callback(SSL *ssl, const unsigned char **out, unsigned char *out
     return SSL_TLSEXT_ERR_OK;
 }
 
+// connections accepted by the listener, called before their handshake
+static int onNewPendingConnection(SSL_CTX *ctx, SSL *connection, void *arg) {
+    (void)ctx;
+    (void)arg;
+    setIdleTimeout(connection);
+    return 1;
+}
+
 
 static void onIceReceive(NiceAgent *agent, guint _stream_id, guint component_id, guint len, gchar *buf, gpointer data) {
     log(LOG_ICE, "cb_nice_recv: {}\n", len);
-    BIO_write(quic_dgram_bio, buf, len);
+    if (MultipathScheduler::instance().handleDatagram(component_id, buf, len)) {
+        return;
+    }
+    if (PathMtuProber::instance().handleDatagram(buf, len)) {
+        return;
+    }
+    MultipathScheduler::instance().countReceived(component_id, len);
+    ControlChannel::instance().countReceived(len);
+    BufferAutotuner::instance().countIngress(len);
 
     if (std::holds_alternative<RoleInitiator>(role)) {
         if (!quic_poll) {
             log(LOG_QUIC, "Initing listener\n");
             SSL_CTX_set_alpn_select_cb(quic_ssl_ctx, alpn_callback, NULL);
+            SSL_CTX_set_new_pending_conn_cb(quic_ssl_ctx, onNewPendingConnection, NULL);
 
             quic_poll = SSL_new_listener(quic_ssl_ctx, 0);
             if (!quic_poll) {
@@ -1125,21 +1738,23 @@ static void onIceReceive(NiceAgent *agent, guint _stream_id, guint component_id,
             SSL_set_blocking_mode(quic_poll, 0);
 
 
-            BIO *dgram_for_ossl = nullptr;
-            if (!BIO_new_bio_dgram_pair(&quic_dgram_bio, 1024 * 1024, &dgram_for_ossl, 1024 * 1024)) {
-                fatal_ossl("BIO_new_bio_dgram_pair failed:\n");
-            }
+            BIO *dgram_for_ossl = NiceDatagramBio::instance().newBio(0);
 
             // TODO possibly add capabilities?
 
             SSL_set_bio(quic_poll, dgram_for_ossl, dgram_for_ossl);
         }
+    }
+
+    queueIngressDatagram(buf, len);
 
+    if (std::holds_alternative<RoleInitiator>(role)) {
         if (!quic_connection) {
             log(LOG_QUIC, "trying to accept connection\n");
             quic_connection = SSL_accept_connection(quic_poll, 0);
             if (quic_connection) {
                 log(LOG_QUIC, "got connection\n");
+                useQuicThread(quic_connection);
             }
         }
 
@@ -1148,6 +1763,8 @@ static void onIceReceive(NiceAgent *agent, guint _stream_id, guint component_id,
                 log(LOG_QUIC, "connection handshaked\n");
                 SSL_set_default_stream_mode(quic_connection, SSL_DEFAULT_STREAM_MODE_NONE);
                 quicConnectionUp = true;
+                BufferAutotuner::instance().start(quic_connection, requestDatagramResize);
+                startPathMtuDiscovery();
 
                 constexpr int exportLen = 32;
                 guchar buf[exportLen];
@@ -1169,21 +1786,40 @@ static void onIceReceive(NiceAgent *agent, guint _stream_id, guint component_id,
             }
         }
     }
-    iceStreamId = _stream_id;
-    quicPoll();
+    if (iceStreamId == -1) {
+        // later datagrams may arrive on the stream of an ICE restart before this side moved to it
+        iceStreamId = _stream_id;
+    }
+    if (QuicThread::instance().hasConnection()) {
+        QuicThread::instance().requestTick();
+    } else if (quicTimerSource) {
+        requestIngressPoll();
+    } else {
+        quicPoll();
+    }
+}
+
+static void quit() {
+    writeUserMessage({
+                         {"event", "quit"},
+                     },
+                     "Quitting\n");
+    // the QUIC thread may be inside SSL_handle_events
+    QuicThread::instance().stop();
+    exit(0);
 }
 
 static void quicPoll() {
+    ++quicPolls;
+    ingressPollRequested = false;
     if (in_shutdown == ShutdownState::shutdownDone) {
-        writeUserMessage({
-                             {"event", "quit"},
-                         },
-                         "Quitting\n");
-        exit(0);
+        quit();
         return;
     }
 
-    if (quic_client) {
+    if (QuicThread::instance().hasConnection()) {
+        // events are handled by the QUIC thread
+    } else if (quic_client) {
         // TODO(openssl-branch) crashes or errors out if quic_poll is listener
         int ret0 = SSL_handle_events(quic_poll);
         if (!ret0) {
@@ -1202,18 +1838,17 @@ static void quicPoll() {
     }
 
     if (in_shutdown == ShutdownState::shutdownPending) {
-        int ret = SSL_shutdown(quic_client ? quic_client : quic_connection);
+        int ret = 0;
+        if (ParallelConnections::instance().shutdown()) {
+            ret = SSL_shutdown(quic_client ? quic_client : quic_connection);
+        }
         if (ret < 0) {
             fatal_ossl("SSL_shutdown failed:\n");
         }
         in_shutdown = ret ? in_shutdown = ShutdownState::shutdownDone : ShutdownState::shutdownPending;
 
         if (in_shutdown == ShutdownState::shutdownDone) {
-            writeUserMessage({
-                                 {"event", "quit"},
-                             },
-                             "Quitting\n");
-            exit(0);
+            quit();
             return;
         }
     } else if ((shutdown & (SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN)) == (SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN)) {
@@ -1223,11 +1858,7 @@ static void quicPoll() {
             fatal_ossl("SSL_shutdown failed:\n");
         }
         if (ret) {
-            writeUserMessage({
-                                 {"event", "quit"},
-                             },
-                             "Quitting\n");
-            exit(0);
+            quit();
             return;
         }
     } else if (shutdown == 0) {
@@ -1248,6 +1879,8 @@ static void quicPoll() {
                     SSL_set_default_stream_mode(quic_client, SSL_DEFAULT_STREAM_MODE_NONE);
 
                     quicConnectionUp = true;
+                    BufferAutotuner::instance().start(quic_client, requestDatagramResize);
+                    startPathMtuDiscovery();
 
                     constexpr int exportLen = 32;
                     guchar buf[exportLen];
@@ -1273,8 +1906,8 @@ static void quicPoll() {
                 }
 
             } else {
-                SSL *new_stream = SSL_accept_stream(quic_client, 0);
-                if (new_stream) {
+                SSL *new_stream;
+                while ((new_stream = SSL_accept_stream(quic_client, 0))) {
                     log(LOG_QUIC, "quic on_stream_open: {}\n", SSL_get_stream_id(new_stream));
                     std::visit([&] (auto &role) {
                         if constexpr (std::is_same_v<typeof(role), std::monostate>) {
@@ -1288,8 +1921,8 @@ static void quicPoll() {
         }
 
         if (quic_connection && quicConnectionUp) {
-            SSL *new_stream = SSL_accept_stream(quic_connection, 0);
-            if (new_stream) {
+            SSL *new_stream;
+            while ((new_stream = SSL_accept_stream(quic_connection, 0))) {
                 log(LOG_QUIC, "quic on_stream_open: {}\n", SSL_get_stream_id(new_stream));
                 std::visit([&] (auto &role) {
                     if constexpr (std::is_same_v<typeof(role), std::monostate>) {
@@ -1301,6 +1934,11 @@ static void quicPoll() {
             }
         }
 
+        // the extra connections are only set up after authentication, their streams go to the mode directly
+        ParallelConnections::instance().poll([] (SSL *stream) {
+            mode->handleQuicStreamOpened(stream);
+        });
+
         std::visit([&] (auto &role) {
             if constexpr (std::is_same_v<typeof(role), std::monostate>) {
                 fatal("Bad role\n");
@@ -1310,43 +1948,16 @@ static void quicPoll() {
         }, role);
     }
 
-    constexpr int buf_size = 1024*64;
-    char buf[buf_size] = {0};
-
-    int res = 0;
-    do {
-        res = BIO_read(quic_dgram_bio, buf, buf_size);
-        if (res > 0) {
-            log(LOG_QUIC, "sending datagrams with len {}\n", res);
-            NiceOutputMessage msg;
-            GOutputVector vec;
-            msg.n_buffers = 1;
-            msg.buffers = &vec;
-            vec.size = res;
-            vec.buffer = buf;
-            //nice_agent_send_messages_nonblocking(iceAgent, iceStreamId, 1, &msg, 1, nullptr, nullptr);
-            int ret = nice_agent_send(iceAgent, iceStreamId, 1, res, buf);
-            if (ret <= 0) {
-                log(LOG_ICE, "failed to send dgram {:x}\n", ret);
-            }
-        }
-
-    } while (res > 0);
-
-    struct timeval tv;
-    int is_infinite;
-
-    if (SSL_get_event_timeout(quic_connection ? quic_connection : quic_poll, &tv, &is_infinite)) {
-        if (tv.tv_sec == 0 && tv.tv_usec == 0) {
-            // immediate processing needed
-        } else if (!is_infinite) {
-            int milli_seconds = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-            log(LOG_QUIC, "quicPoll rescheduled in {}ms\n", milli_seconds);
-            ++timer_generation;
-            // TODO: Remove older timeout sources by id? see g_source_remove()
-            g_timeout_add(milli_seconds, &onQuicPollTimeout, (void*)(intptr_t)timer_generation);
-        }
+    if (QuicThread::instance().hasConnection()) {
+        // sends what was written to streams above
+        QuicThread::instance().requestTick();
+        return;
     }
+    if (!quicTimerSource) {
+        createQuicTimer();
+    }
+    // an expired timeout makes the source ready right away, it is dispatched in the next main loop iteration
+    armQuicTimer();
 }
 
 
@@ -1452,10 +2063,6 @@ Ckoxer9nbxHB68Fok8EBk0nA
     EVP_PKEY_free(pkey);
     SSL_CTX_use_certificate_ASN1(quic_ssl_ctx, dummyCert.size(), dummyCert.data());
 
-    /*
-    TODO set transport_params max_idle_timeout
-    */
-
     X509_STORE *store = X509_STORE_new();
     auto *dummyCertPemBio = BIO_new(BIO_s_mem());
     BIO_puts(dummyCertPemBio, dummyCertPem);
@@ -1504,19 +2111,61 @@ void applyConfigDefaults(PeersockConfig &config) {
     if (config.turnPassword.empty()) {
         config.turnPassword = "free";
     }
+
+    if (!config.keepaliveInterval || *config.keepaliveInterval <= 0) {
+        config.keepaliveInterval = 15;
+    }
+}
+
+static void applyRuntimeConfig(const PeersockConfig &config) {
+    keepaliveInterval = *config.keepaliveInterval;
+    compressionWanted = config.compressStreams;
+    multipathWanted = config.multipath;
+    pathMtuDiscoveryWanted = config.pathMtuDiscovery;
+    parallelWanted = config.parallelConnections;
+    SessionCache::instance().setEnabled(config.resumeSessions);
+    if (config.quicThread && !QuicThread::instance().started()) {
+        NiceDatagramBio::instance().enableThreaded([] {
+            QuicThread::instance().wakeMain(false);
+        });
+        QuicThread::instance().start(onQuicThreadEvents);
+        atexit([] {
+            QuicThread::instance().logStats();
+        });
+    }
+
+    if (config.forwarderBufferSize) {
+        bufferSizes.localToQuic = *config.forwarderBufferSize;
+        bufferSizes.quicToLocal = *config.forwarderBufferSize;
+    }
+    if (config.datagramBufferSize) {
+        bufferSizes.datagram = *config.datagramBufferSize;
+    }
+    NiceDatagramBio::instance().setQueueLimit(bufferSizes.datagram);
+    BufferAutotuner &tuner = BufferAutotuner::instance();
+    tuner.setEnabled(config.autotuneBuffers);
+    tuner.setForwarderFixed(config.forwarderBufferSize.has_value());
+    tuner.setDatagramFixed(config.datagramBufferSize.has_value());
+    tuner.setRttSource([] {
+        return ControlChannel::instance().smoothedRtt();
+    });
 }
 
 void startFromCode(const std::string &code, std::unique_ptr<ModeBase> &&mode_, PeersockConfig config) {
     init();
     applyConfigDefaults(config);
+    applyRuntimeConfig(config);
     mode = std::move(mode_);
     role = RoleFromCode{code, config};
+    SessionCache::instance().prepareClient(quic_ssl_ctx);
 }
 
 void startGeneratingCode(std::function<void(std::string)> codeCallback_, std::unique_ptr<ModeBase> &&mode_, PeersockConfig config) {
     init();
     applyConfigDefaults(config);
+    applyRuntimeConfig(config);
     mode = std::move(mode_);
     codeCallback = codeCallback_;
     role = RoleInitiator(config);
+    SessionCache::instance().prepareServer(quic_ssl_ctx);
 }
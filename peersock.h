@@ -2,12 +2,15 @@
 
 #include <string>
 #include <functional>
+#include <vector>
 
 #include <openssl/ssl.h>
 
 #include "utils.h"
 
 
+static constexpr unsigned maxParallelConnections = 8;
+
 struct PeersockConfig {
     std::string stunServer;
     std::optional<int> stunPort;
@@ -15,6 +18,24 @@ struct PeersockConfig {
     std::optional<int> turnPort;
     std::string turnUser;
     std::string turnPassword;
+    // fixed buffer sizes in bytes, autotuned or defaults if unset
+    std::optional<size_t> forwarderBufferSize;
+    std::optional<size_t> datagramBufferSize;
+    bool autotuneBuffers = false;
+    // seconds between keepalives on the keepalive stream
+    std::optional<int> keepaliveInterval;
+    // run QUIC event processing on its own thread
+    bool quicThread = false;
+    // stripe datagrams over a second ICE path if the other side agrees
+    bool multipath = false;
+    // probe the path MTU of the ICE path if the other side agrees
+    bool pathMtuDiscovery = false;
+    // QUIC connections to stripe bulk streams over, including the primary one, if the other side agrees
+    unsigned parallelConnections = 1;
+    // compress payload streams if the other side agrees
+    bool compressStreams = false;
+    // resume the TLS session of an earlier connection with the same peer, tickets are cached on disk
+    bool resumeSessions = false;
 };
 
 
@@ -22,6 +43,9 @@ class RemoteConnection {
 public:
     virtual SSL *ssl() = 0;
     virtual void shutdown() = 0;
+    // the extra parallel connections are set up after connectionMade, lanes() is final once lanesSettled()
+    virtual bool lanesSettled() = 0;
+    virtual std::vector<SSL*> lanes() = 0;
 };
 
 struct ModeBase {
@@ -0,0 +1,187 @@
+#include "pmtud.h"
+
+#include <cstring>
+#include <vector>
+
+#include "utils.h"
+
+
+// UDP payload of IPv4 and IPv6 with the common link MTUs of 1280 (IPv6 minimum), 1500 and 9000 bytes
+static const size_t candidateSizes[] = {1232, 1252, 1452, 1472, 8952, 8972};
+static constexpr size_t ethernetPayload = 1472;
+
+static constexpr char probeType = 0;
+static constexpr char ackType = 1;
+static constexpr size_t headerSize = 7;
+
+PathMtuProber &PathMtuProber::instance() {
+    static PathMtuProber prober;
+    return prober;
+}
+
+void PathMtuProber::start(bool relayed, bool probe, std::function<void(size_t)> applyMtu) {
+    if (_started || !_send) {
+        return;
+    }
+    _started = true;
+    _relayed = relayed;
+    _applyMtu = applyMtu;
+    if (!probe) {
+        return;
+    }
+    log(LOG_ICE, "pmtud: searching{}\n", relayed ? " on relayed path" : "");
+    probeNext();
+}
+
+void PathMtuProber::pathChanged(bool relayed, bool probe) {
+    if (!_started) {
+        return;
+    }
+    stopSearch();
+    _relayed = relayed;
+    _confirmed = baseSize;
+    _failed = 0;
+    if (_reported) {
+        // nothing is known about the new path yet
+        _reported = 0;
+        _applyMtu(baseSize);
+    }
+    if (!probe) {
+        log(LOG_ICE, "pmtud: path changed, not probing\n");
+        return;
+    }
+    log(LOG_ICE, "pmtud: path changed, searching{}\n", relayed ? " on relayed path" : "");
+    probeNext();
+}
+
+void PathMtuProber::stopSearch() {
+    if (_timer) {
+        g_source_remove(_timer);
+        _timer = 0;
+    }
+    if (_researchTimer) {
+        g_source_remove(_researchTimer);
+        _researchTimer = 0;
+    }
+}
+
+bool PathMtuProber::handleDatagram(const char *buf, size_t len) {
+    if (!len || (buf[0] & 0x40)) {
+        // QUIC packets have the fixed bit set
+        return false;
+    }
+    if (len < headerSize || !_send) {
+        return true;
+    }
+
+    size_t size = ((guint8)buf[1] << 8) | (guint8)buf[2];
+    if (buf[0] == probeType) {
+        if (size != len) {
+            log(LOG_ICE, "pmtud: probe of {} bytes claims {}\n", len, size);
+            return true;
+        }
+        char ack[headerSize];
+        memcpy(ack, buf, headerSize);
+        ack[0] = ackType;
+        _send(ack, headerSize);
+    } else if (buf[0] == ackType) {
+        uint32_t id = ((guint8)buf[3] << 24) | ((guint8)buf[4] << 16) | ((guint8)buf[5] << 8) | (guint8)buf[6];
+        // an acknowledgement of an earlier attempt of the current size counts too
+        if (!_timer || size != _probeSize || id > _probeId || _probeId - id >= (uint32_t)_attempts) {
+            return true;
+        }
+        g_source_remove(_timer);
+        _timer = 0;
+        _confirmed = size;
+        log(LOG_ICE, "pmtud: {} bytes confirmed\n", size);
+        probeNext();
+    }
+    return true;
+}
+
+gboolean PathMtuProber::wrap_probeTimeout(gpointer user_data) {
+    reinterpret_cast<PathMtuProber*>(user_data)->probeTimeout();
+    return G_SOURCE_REMOVE;
+}
+
+gboolean PathMtuProber::wrap_research(gpointer user_data) {
+    PathMtuProber *prober = reinterpret_cast<PathMtuProber*>(user_data);
+    prober->_researchTimer = 0;
+    prober->_confirmed = baseSize;
+    prober->_failed = 0;
+    prober->probeNext();
+    return G_SOURCE_REMOVE;
+}
+
+void PathMtuProber::probeTimeout() {
+    _timer = 0;
+    if (_attempts < _maxProbes) {
+        sendProbe();
+        return;
+    }
+    log(LOG_ICE, "pmtud: {} bytes failed\n", _probeSize);
+    _failed = _probeSize;
+    probeNext();
+}
+
+void PathMtuProber::probeNext() {
+    size_t next = 0;
+    if (!_failed) {
+        for (size_t candidate : candidateSizes) {
+            if (_relayed && candidate > ethernetPayload) {
+                // TURN servers are reached over the internet
+                break;
+            }
+            size_t size = _relayed ? candidate - _turnOverhead : candidate;
+            if (size > _confirmed) {
+                next = size;
+                break;
+            }
+        }
+    } else if (_failed - _confirmed > _granularity) {
+        next = (_confirmed + _failed) / 2;
+    }
+
+    if (!next) {
+        finishSearch();
+        return;
+    }
+    _probeSize = next;
+    _attempts = 0;
+    sendProbe();
+}
+
+void PathMtuProber::sendProbe() {
+    _attempts++;
+    _probeId++;
+
+    std::vector<char> probe(_probeSize, 0);
+    probe[0] = probeType;
+    probe[1] = (char)(_probeSize >> 8);
+    probe[2] = (char)_probeSize;
+    probe[3] = (char)(_probeId >> 24);
+    probe[4] = (char)(_probeId >> 16);
+    probe[5] = (char)(_probeId >> 8);
+    probe[6] = (char)_probeId;
+    if (!_send(probe.data(), probe.size())) {
+        log(LOG_ICE, "pmtud: {} bytes can not be sent\n", _probeSize);
+        _failed = _probeSize;
+        probeNext();
+        return;
+    }
+    _timer = g_timeout_add(_probeTimeoutMs, wrap_probeTimeout, this);
+}
+
+void PathMtuProber::finishSearch() {
+    if (_confirmed != _reported) {
+        _reported = _confirmed;
+        writeUserMessage({
+                             {"event", "path-mtu"},
+                             {"mtu", _confirmed},
+                             {"relayed", _relayed},
+                         },
+                         "Path MTU: {} bytes{}\n", _confirmed, _relayed ? " (relayed)" : "");
+        _applyMtu(_confirmed);
+    }
+    _researchTimer = g_timeout_add_seconds(_researchSeconds, wrap_research, this);
+}
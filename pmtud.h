@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include <glib.h>
+
+// Datagram packetization layer path MTU discovery (RFC 8899) on the ICE path, run after the QUIC handshake if both
+// sides enable it.
+// Probes are sent between the QUIC datagrams and are told apart by the QUIC fixed bit being clear: a type byte
+// (0 probe, 1 acknowledgement), the 16 bit big endian probe size and a 32 bit probe id, probes are padded with zero
+// bytes like QUIC PADDING frames. A size is confirmed by an acknowledgement and failed after 3 probes without one.
+// Sizes are UDP payload sizes. The search walks common link MTUs upwards and bisects after the first failure, it is
+// repeated every 10 minutes in case the path changed.
+class PathMtuProber {
+public:
+    static PathMtuProber &instance();
+
+    // Set once both sides support probing, probes of the other side are only acknowledged after that. send returns
+    // false if the datagram could not be sent, e.g. it exceeds the MTU of the local interface.
+    void setSender(std::function<bool(const char*, size_t)> send) { _send = send; }
+
+    // Relayed paths are limited to the sizes of a 1500 byte MTU, less the TURN header. Without probe the path can't be
+    // probed and the QUIC minimum is kept. applyMtu is called with each new search result.
+    void start(bool relayed, bool probe, std::function<void(size_t)> applyMtu);
+    // After an ICE restart moved the datagrams to another path: ends the search on the old path and searches the new
+    // one right away if it can be probed.
+    void pathChanged(bool relayed, bool probe);
+
+    // true if the datagram was a probe or an acknowledgement, not a QUIC packet
+    bool handleDatagram(const char *buf, size_t len);
+
+    // result of the last search, the QUIC minimum before
+    size_t mtu() const { return _reported ? _reported : baseSize; }
+
+    static constexpr size_t baseSize = 1200;
+
+private:
+    PathMtuProber() = default;
+
+    static gboolean wrap_probeTimeout(gpointer user_data);
+    static gboolean wrap_research(gpointer user_data);
+    void probeTimeout();
+    void probeNext();
+    void sendProbe();
+    void finishSearch();
+    void stopSearch();
+
+    static constexpr int _maxProbes = 3;
+    static constexpr guint _probeTimeoutMs = 500;
+    static constexpr guint _researchSeconds = 600;
+    // a bisection step smaller than this ends the search
+    static constexpr size_t _granularity = 16;
+    // ChannelData is 4 bytes, a Send indication 36
+    static constexpr size_t _turnOverhead = 36;
+
+    std::function<bool(const char*, size_t)> _send;
+    std::function<void(size_t)> _applyMtu;
+    bool _started = false;
+    bool _relayed = false;
+    // largest size confirmed by the running search
+    size_t _confirmed = baseSize;
+    // smallest size known to fail, 0 if none
+    size_t _failed = 0;
+    size_t _probeSize = 0;
+    uint32_t _probeId = 0;
+    int _attempts = 0;
+    guint _timer = 0;
+    guint _researchTimer = 0;
+    size_t _reported = 0;
+};
@@ -0,0 +1,149 @@
+#include "quicthread.h"
+
+#include <openssl/err.h>
+
+#include "nicebio.h"
+#include "utils.h"
+
+
+QuicThread &QuicThread::instance() {
+    static QuicThread thread;
+    return thread;
+}
+
+void QuicThread::start(std::function<void(bool)> mainEvents) {
+    static GSourceFuncs tickFuncs = {
+        nullptr,
+        nullptr,
+        wrap_dispatchTick,
+        nullptr,
+        nullptr,
+        nullptr,
+    };
+    static GSourceFuncs mainFuncs = {
+        nullptr,
+        nullptr,
+        wrap_dispatchMain,
+        nullptr,
+        nullptr,
+        nullptr,
+    };
+
+    _mainEvents = mainEvents;
+
+    _mainSource = g_source_new(&mainFuncs, sizeof(GSource));
+    g_source_set_name(_mainSource, "quic thread events");
+    g_source_attach(_mainSource, g_main_context_get_thread_default());
+
+    _context = g_main_context_new();
+    _tickSource = g_source_new(&tickFuncs, sizeof(GSource));
+    g_source_set_name(_tickSource, "quic thread tick");
+    g_source_attach(_tickSource, _context);
+
+    _thread = std::thread([this] { run(); });
+    atexit([] {
+        instance().stop();
+    });
+}
+
+void QuicThread::stop() {
+    if (!_thread.joinable()) {
+        return;
+    }
+    if (_thread.get_id() == std::this_thread::get_id()) {
+        // exit from the thread itself, e.g. through fatal
+        _thread.detach();
+        return;
+    }
+    _quit.store(true);
+    g_main_context_wakeup(_context);
+    _thread.join();
+}
+
+void QuicThread::run() {
+    g_main_context_push_thread_default(_context);
+    while (!_quit.load()) {
+        g_main_context_iteration(_context, TRUE);
+    }
+    g_main_context_pop_thread_default(_context);
+}
+
+void QuicThread::setConnection(SSL *connection) {
+    _connection.store(connection, std::memory_order_release);
+    requestTick();
+}
+
+void QuicThread::requestTick() {
+    _tickRequested.store(true);
+    g_source_set_ready_time(_tickSource, 0);
+}
+
+void QuicThread::wakeMain(bool poll) {
+    if (poll) {
+        _mainPollRequested.store(true);
+    }
+    g_source_set_ready_time(_mainSource, 0);
+}
+
+gboolean QuicThread::wrap_dispatchTick(GSource *source, GSourceFunc callback, gpointer user_data) {
+    (void)source;
+    (void)callback;
+    (void)user_data;
+    instance().dispatchTick();
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean QuicThread::wrap_dispatchMain(GSource *source, GSourceFunc callback, gpointer user_data) {
+    (void)source;
+    (void)callback;
+    (void)user_data;
+    instance().dispatchMain();
+    return G_SOURCE_CONTINUE;
+}
+
+void QuicThread::dispatchTick() {
+    _tickRequested.store(false);
+    SSL *connection = _connection.load(std::memory_order_acquire);
+    if (!connection) {
+        g_source_set_ready_time(_tickSource, -1);
+        return;
+    }
+
+    bool timerReached = _deadline != -1 && g_get_monotonic_time() >= _deadline;
+    uint64_t received = NiceDatagramBio::instance().receivedCount();
+    ++_ticks;
+    if (!SSL_handle_events(connection)) {
+        ERR_print_errors_fp(stderr);
+    }
+    bool consumed = NiceDatagramBio::instance().receivedCount() != received;
+
+    struct timeval tv;
+    int is_infinite = 0;
+    if (!SSL_get_event_timeout(connection, &tv, &is_infinite) || is_infinite) {
+        _deadline = -1;
+    } else {
+        _deadline = g_get_monotonic_time() + tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+    }
+    g_source_set_ready_time(_tickSource, _deadline);
+    // a request that arrived during the tick must not be lost by arming the deadline
+    if (_tickRequested.load()) {
+        g_source_set_ready_time(_tickSource, 0);
+    }
+
+    if (consumed || timerReached) {
+        wakeMain(true);
+    }
+}
+
+void QuicThread::dispatchMain() {
+    g_source_set_ready_time(_mainSource, -1);
+    bool poll = _mainPollRequested.exchange(false);
+    if (poll) {
+        ++_mainPolls;
+    }
+    _mainEvents(poll);
+}
+
+void QuicThread::logStats() const {
+    log(LOG_QUIC, "quic thread ticks: {}, main polls requested: {}\n", _ticks.load(), _mainPolls.load());
+}
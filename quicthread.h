@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+#include <openssl/ssl.h>
+
+#include <glib.h>
+
+// Runs SSL_handle_events, and with it packet protection and the QUIC timers, on a dedicated thread with its own main
+// context. libnice, the forwarders and all other calls on the SSL objects stay on the main thread, OpenSSL serializes
+// them with the lock of the connection. The connection has to use explicit event handling so no call on the main
+// thread processes datagrams.
+class QuicThread {
+public:
+    static QuicThread &instance();
+
+    // mainEvents(poll) runs on the main context after the thread queued datagrams for sending, poll is set when a
+    // tick consumed received datagrams or reached a QUIC timer, so streams may have become readable or writable.
+    void start(std::function<void(bool)> mainEvents);
+    bool started() const { return _context != nullptr; }
+    // ends and joins the thread, the process must not exit while it is inside SSL_handle_events, which uses the
+    // queues of the datagram BIO. Also registered with atexit for exits through fatal.
+    void stop();
+
+    // the thread only processes events once it knows the connection
+    void setConnection(SSL *connection);
+    bool hasConnection() const { return _connection.load(std::memory_order_acquire) != nullptr; }
+
+    // any thread
+    void requestTick();
+    void wakeMain(bool poll);
+
+    void logStats() const;
+
+private:
+    QuicThread() = default;
+
+    static gboolean wrap_dispatchTick(GSource *source, GSourceFunc callback, gpointer user_data);
+    static gboolean wrap_dispatchMain(GSource *source, GSourceFunc callback, gpointer user_data);
+    void dispatchTick();
+    void dispatchMain();
+    void run();
+
+    std::function<void(bool)> _mainEvents;
+    std::thread _thread;
+    std::atomic<bool> _quit{false};
+    GMainContext *_context = nullptr;
+    GSource *_tickSource = nullptr;
+    GSource *_mainSource = nullptr;
+    std::atomic<SSL*> _connection{nullptr};
+    std::atomic<bool> _tickRequested{false};
+    std::atomic<bool> _mainPollRequested{false};
+    // monotonic time of the next QUIC timer, -1 for none, only used on the thread
+    gint64 _deadline = -1;
+
+    std::atomic<uint64_t> _ticks{0};
+    std::atomic<uint64_t> _mainPolls{0};
+};
@@ -0,0 +1,279 @@
+#include "resumption.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <utility>
+#include <vector>
+
+#include <openssl/rand.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+
+
+static std::string joinPath(const std::string &directory, const std::string &name) {
+    gchar *path = g_build_filename(directory.data(), name.data(), nullptr);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
+
+static bool readFile(const std::string &path, std::string &contents) {
+    gchar *data = nullptr;
+    gsize len = 0;
+    if (!g_file_get_contents(path.data(), &data, &len, nullptr)) {
+        return false;
+    }
+    contents.assign(data, len);
+    g_free(data);
+    return true;
+}
+
+static void writeFile(const std::string &path, const std::string &contents) {
+    GError *error = nullptr;
+    if (!g_file_set_contents_full(path.data(), contents.data(), contents.size(), G_FILE_SET_CONTENTS_CONSISTENT,
+                                  0600, &error)) {
+        log(LOG_QUIC, "resumption: can not write {}: {}\n", path, error->message);
+        g_error_free(error);
+    }
+}
+
+static std::string hexNonce() {
+    unsigned char nonce[16];
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1) {
+        fatal_ossl("RAND_bytes failed:\n");
+    }
+    std::string hex;
+    for (unsigned char c : nonce) {
+        hex += fmt::format("{:02x}", c);
+    }
+    return hex;
+}
+
+static std::string pairingHmac(const std::string &pairingKey, const std::string &nonce) {
+    gchar *hmac = g_compute_hmac_for_data(G_CHECKSUM_SHA256, (const guchar*)pairingKey.data(), pairingKey.size(),
+                                          (const guchar*)nonce.data(), nonce.size());
+    std::string result = hmac;
+    g_free(hmac);
+    return result;
+}
+
+SessionCache &SessionCache::instance() {
+    static SessionCache cache;
+    return cache;
+}
+
+std::string SessionCache::directory(const char *name) const {
+    gchar *path = g_build_filename(g_get_user_cache_dir(), "peersock", name, nullptr);
+    std::string result = path;
+    g_free(path);
+    if (g_mkdir_with_parents(result.data(), 0700) != 0) {
+        log(LOG_QUIC, "resumption: can not create {}\n", result);
+    }
+    return result;
+}
+
+bool SessionCache::expired(const std::string &path) const {
+    GStatBuf buf;
+    if (g_stat(path.data(), &buf) != 0) {
+        return true;
+    }
+    return time(nullptr) - buf.st_mtime > _lifetimeSeconds;
+}
+
+void SessionCache::prepareServer(SSL_CTX *ctx) {
+    if (!_enabled) {
+        return;
+    }
+    // tickets of earlier runs have to decrypt, the keys are replaced when their tickets expired
+    std::string path = joinPath(directory(""), "ticket-keys");
+    std::string keys;
+    if (expired(path) || !readFile(path, keys) || keys.size() != 80) {
+        keys.resize(80);
+        if (RAND_bytes((unsigned char*)keys.data(), keys.size()) != 1) {
+            fatal_ossl("RAND_bytes failed:\n");
+        }
+        writeFile(path, keys);
+    }
+    if (!SSL_CTX_set_tlsext_ticket_keys(ctx, keys.data(), keys.size())) {
+        fatal_ossl("setting session ticket keys failed:\n");
+    }
+    SSL_CTX_set_timeout(ctx, _lifetimeSeconds);
+}
+
+void SessionCache::prepareClient(SSL_CTX *ctx) {
+    if (!_enabled) {
+        return;
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, wrap_newSession);
+}
+
+void SessionCache::announce(nlohmann::json &ice) {
+    if (!_enabled) {
+        return;
+    }
+    std::string dir = directory("pairings");
+    std::vector<std::pair<time_t, std::string>> pairings;
+    GDir *entries = g_dir_open(dir.data(), 0, nullptr);
+    if (!entries) {
+        return;
+    }
+    while (const gchar *name = g_dir_read_name(entries)) {
+        std::string path = joinPath(dir, name);
+        GStatBuf buf;
+        std::string key;
+        if (expired(path)) {
+            g_remove(path.data());
+        } else if (g_stat(path.data(), &buf) == 0 && readFile(path, key) && key.size() == _pairingKeySize) {
+            pairings.emplace_back(buf.st_mtime, key);
+        }
+    }
+    g_dir_close(entries);
+
+    std::sort(pairings.begin(), pairings.end(), [] (const auto &a, const auto &b) {
+        return a.first > b.first;
+    });
+    pairings.resize(std::min(pairings.size(), _maxAnnounced));
+
+    std::string nonce = hexNonce();
+    std::vector<std::string> announced;
+    for (const auto &pairing : pairings) {
+        announced.push_back(pairingHmac(pairing.second, nonce));
+    }
+    ice["r"] = nonce;
+    ice["k"] = announced;
+}
+
+void SessionCache::selectSession(const nlohmann::json &ice) {
+    if (!_enabled || !ice.contains("r") || !ice.contains("k")) {
+        return;
+    }
+    std::string nonce = ice["r"];
+    std::vector<std::string> announced = ice["k"];
+
+    std::string dir = directory("sessions");
+    GDir *entries = g_dir_open(dir.data(), 0, nullptr);
+    if (!entries) {
+        return;
+    }
+    while (const gchar *name = g_dir_read_name(entries)) {
+        std::string path = joinPath(dir, name);
+        std::string contents;
+        if (expired(path)) {
+            g_remove(path.data());
+            continue;
+        }
+        if (!readFile(path, contents) || contents.size() <= _pairingKeySize) {
+            continue;
+        }
+        std::string hmac = pairingHmac(contents.substr(0, _pairingKeySize), nonce);
+        if (std::find(announced.begin(), announced.end(), hmac) == announced.end()) {
+            continue;
+        }
+        const unsigned char *der = (const unsigned char*)contents.data() + _pairingKeySize;
+        SSL_SESSION *session = d2i_SSL_SESSION(nullptr, &der, contents.size() - _pairingKeySize);
+        if (!session) {
+            ERR_clear_error();
+            g_remove(path.data());
+            continue;
+        }
+        log(LOG_QUIC, "resumption: found session of an earlier connection\n");
+        _resumeSession = session;
+        _resumeFile = path;
+        break;
+    }
+    g_dir_close(entries);
+}
+
+void SessionCache::prepareConnection(SSL *connection) {
+    if (!_enabled) {
+        return;
+    }
+    _connection = connection;
+    if (!_resumeSession) {
+        return;
+    }
+    if (!SSL_set_session(connection, _resumeSession)) {
+        log(LOG_QUIC, "resumption: session not usable\n");
+        ERR_clear_error();
+    }
+    SSL_SESSION_free(_resumeSession);
+    _resumeSession = nullptr;
+}
+
+int SessionCache::wrap_newSession(SSL *ssl, SSL_SESSION *session) {
+    SessionCache &cache = instance();
+    if (ssl != cache._connection) {
+        // tickets of the extra parallel connections
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(cache._mutex);
+    if (cache._session) {
+        SSL_SESSION_free(cache._session);
+    }
+    cache._session = session;
+    if (!cache._pairingKey.empty()) {
+        cache.storeClientSession();
+    }
+    return 1;
+}
+
+void SessionCache::authenticated(SSL *connection, bool server) {
+    if (!_enabled) {
+        return;
+    }
+    if (SSL_session_reused(connection)) {
+        log(LOG_QUIC, "resumption: resumed the session of an earlier connection\n");
+    }
+
+    std::string key(_pairingKeySize, '\0');
+    const char *label = "exporter pairing peersock";
+    if (SSL_export_keying_material(connection, (unsigned char*)key.data(), key.size(), label, strlen(label), NULL, 0,
+                                   0) != 1) {
+        fatal_ossl("SSL_export_keying_material failed:\n");
+    }
+
+    if (server) {
+        gchar *name = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key.data(), key.size());
+        writeFile(joinPath(directory("pairings"), name), key);
+        g_free(name);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pairingKey = key;
+    if (_session) {
+        storeClientSession();
+    }
+}
+
+void SessionCache::storeClientSession() {
+    if (!SSL_SESSION_is_resumable(_session)) {
+        return;
+    }
+    int len = i2d_SSL_SESSION(_session, nullptr);
+    if (len <= 0) {
+        ERR_clear_error();
+        return;
+    }
+    std::string contents = _pairingKey;
+    contents.resize(_pairingKeySize + len);
+    unsigned char *der = (unsigned char*)contents.data() + _pairingKeySize;
+    i2d_SSL_SESSION(_session, &der);
+
+    gchar *name = g_compute_checksum_for_string(G_CHECKSUM_SHA256, _pairingKey.data(), _pairingKey.size());
+    std::string path = joinPath(directory("sessions"), name);
+    g_free(name);
+    writeFile(path, contents);
+    log(LOG_QUIC, "resumption: stored session ticket\n");
+
+    // the resumed pairing is replaced by the one of this connection
+    if (!_resumeFile.empty() && _resumeFile != path) {
+        g_remove(_resumeFile.data());
+        _resumeFile.clear();
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+
+#include <openssl/ssl.h>
+
+#include <nlohmann/json.hpp>
+
+// Resumption of the TLS session of an earlier connection between the same two machines, if both sides enable it.
+// After the SMP authentication both sides derive a pairing key from the exporter "exporter pairing peersock" of the
+// connection. The initiator keeps the pairing keys, the code side keeps each pairing key with the last session ticket
+// of that connection. Both live in $XDG_CACHE_HOME/peersock and expire after 7 days, like the ticket keys of the
+// initiator.
+// The initiator announces its pairings in the rendezvous message as random nonce "r" and HMAC-SHA256(pairing key, r)
+// for each pairing in "k", so the rendezvous server can not link connections. The code side resumes the session of
+// the matching pairing.
+// Resumed handshakes use a fresh (EC)DHE exchange, so the exporter that binds the SMP authentication to the connection
+// stays unique per connection and the SMP authentication with the connection code is done as before.
+class SessionCache {
+public:
+    static SessionCache &instance();
+
+    void setEnabled(bool enabled) { _enabled = enabled; }
+    bool enabled() const { return _enabled; }
+
+    // set up the context of the role before the first connection
+    void prepareServer(SSL_CTX *ctx);
+    void prepareClient(SSL_CTX *ctx);
+
+    // the initiator adds its pairings to its rendezvous message, the code side looks for its session in the message
+    // of the initiator
+    void announce(nlohmann::json &ice);
+    void selectSession(const nlohmann::json &ice);
+
+    // sets the selected session on the primary client connection before the handshake
+    void prepareConnection(SSL *connection);
+
+    // remembers the pairing once the SMP authentication of connection succeeded
+    void authenticated(SSL *connection, bool server);
+
+private:
+    SessionCache() = default;
+
+    static int wrap_newSession(SSL *ssl, SSL_SESSION *session);
+    void storeClientSession();
+    std::string directory(const char *name) const;
+    bool expired(const std::string &path) const;
+
+    static constexpr size_t _pairingKeySize = 32;
+    static constexpr long _lifetimeSeconds = 7 * 24 * 3600;
+    static constexpr size_t _maxAnnounced = 16;
+
+    bool _enabled = false;
+    SSL *_connection = nullptr;
+    SSL_SESSION *_resumeSession = nullptr;
+    // file of the resumed pairing, replaced by the pairing of the new connection
+    std::string _resumeFile;
+
+    // the ticket may arrive on the QUIC thread
+    std::mutex _mutex;
+    SSL_SESSION *_session = nullptr;
+    std::string _pairingKey;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producing and one consuming thread. Items are filled and consumed in
+// place, so slots keep their allocations when reused.
+template<typename T>
+class SpscQueue {
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        _slots.resize(size);
+        _mask = size - 1;
+    }
+
+    // producer side: fill(T&) is called on a free slot, false if the queue is full
+    template<typename F>
+    bool push(F &&fill) {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) == _slots.size()) {
+            return false;
+        }
+        fill(_slots[tail & _mask]);
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side: number of items ready to be consumed
+    size_t available() const {
+        return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_relaxed);
+    }
+
+    // consumer side: the i-th ready item, valid until it is released by pop
+    T &front(size_t i) {
+        return _slots[(_head.load(std::memory_order_relaxed) + i) & _mask];
+    }
+
+    // consumer side: releases the first count ready items
+    void pop(size_t count) {
+        _head.store(_head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> _slots;
+    size_t _mask = 0;
+    // written by the consumer
+    alignas(64) std::atomic<size_t> _head{0};
+    // written by the producer
+    alignas(64) std::atomic<size_t> _tail{0};
+};
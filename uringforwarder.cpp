@@ -0,0 +1,567 @@
+#include "uringforwarder.h"
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include <liburing.h>
+
+#include "buffers.h"
+#include "utils.h"
+
+
+static constexpr unsigned ringEntries = 256;
+static constexpr unsigned maxFixedBuffers = 1024;
+// the provided buffer ring needs a power of two number of entries
+static constexpr unsigned inputBufferCount = 16;
+static constexpr unsigned inputBufferSize = 64 * 1024;
+static constexpr size_t outputBufferSize = 2 * 1024 * 1024;
+// smaller sends are cheaper to copy than to pin pages and wait for the completion notification
+static constexpr size_t zeroCopyThreshold = 16 * 1024;
+
+class UringLoop {
+public:
+    static UringLoop *instance();
+
+    io_uring_sqe *getSqe();
+    void flush();
+
+    int allocBufferGroup();
+    void freeBufferGroup(int bgid);
+
+    int registerBuffer(void *data, size_t size);
+    void unregisterBuffer(int index);
+
+    io_uring ring;
+    bool zeroCopySupported = false;
+    std::function<void()> tick;
+
+private:
+    bool init();
+
+    static gboolean wrap_eventfdReady(gint fd, GIOCondition condition, gpointer user_data);
+    void eventfdReady();
+
+    int _eventfd = -1;
+    bool _fixedBuffers = false;
+    std::vector<bool> _bufferSlotUsed;
+    std::vector<int> _freeBufferGroups;
+    int _nextBufferGroup = 0;
+};
+
+struct UringForwarderImpl {
+    struct Op {
+        enum Kind {
+            recv,
+            send,
+            cancel,
+        };
+
+        UringForwarderImpl *impl;
+        Kind kind;
+    };
+
+    struct Chunk {
+        unsigned short bid;
+        size_t offset;
+        size_t len;
+    };
+
+    UringForwarderImpl(UringLoop *loop, UringForwarder *owner, SSL *ssl_stream, int fd);
+    ~UringForwarderImpl();
+
+    // returns true if the completion needs a quic poll
+    bool complete(Op::Kind kind, io_uring_cqe *cqe);
+    void detach();
+
+    void quicPoll();
+    void armRecv();
+    void transmitBuffered();
+    void returnBuffer(unsigned short bid);
+    void startSend();
+    void finishSend();
+    void closeInput();
+    void closeOutput();
+
+    UringLoop *loop = nullptr;
+    UringForwarder *owner = nullptr;
+    SSL *ssl_stream = nullptr;
+    int fd = -1;
+    int inFlight = 0;
+
+    Op recvOp{this, Op::recv};
+    Op sendOp{this, Op::send};
+    Op cancelOp{this, Op::cancel};
+
+    // local socket to quic
+    int bgid = -1;
+    io_uring_buf_ring *bufRing = nullptr;
+    std::unique_ptr<std::byte[]> inputMemory;
+    unsigned freeInputBuffers = 0;
+    std::deque<Chunk> inputChunks;
+    bool recvArmed = false;
+    bool inputEof = false;
+    bool inputClosed = false;
+    ThroughputCounter inputThroughput;
+
+    // quic to local socket
+    RingBuffer outputBuffer{outputBufferSize};
+    int bufIndex = -1;
+    bool sendBusy = false;
+    // cleared when the socket type doesn't support zero copy sends (e.g. unix sockets)
+    bool zeroCopy = false;
+    bool sendWasZeroCopy = false;
+    int sendResult = 0;
+    bool remoteConcluded = false;
+    bool outputClosed = false;
+    ThroughputCounter outputThroughput;
+};
+
+
+UringLoop *UringLoop::instance() {
+    static UringLoop *loop = nullptr;
+    static bool tried = false;
+
+    if (!tried) {
+        tried = true;
+        loop = new UringLoop();
+        if (!loop->init()) {
+            delete loop;
+            loop = nullptr;
+        }
+    }
+
+    return loop;
+}
+
+bool UringLoop::init() {
+    int ret = io_uring_queue_init(ringEntries, &ring, 0);
+    if (ret < 0) {
+        log(LOG_FWD, "io_uring_queue_init failed: {}\n", strerror(-ret));
+        return false;
+    }
+
+    // multishot receive needs provided buffer rings, probe with a throw away ring
+    io_uring_buf_ring *probeRing = io_uring_setup_buf_ring(&ring, 1, 0, 0, &ret);
+    if (!probeRing) {
+        log(LOG_FWD, "io_uring provided buffer rings not supported: {}\n", strerror(-ret));
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+    io_uring_free_buf_ring(&ring, probeRing, 1, 0);
+
+    io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+    if (probe) {
+        zeroCopySupported = io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+        io_uring_free_probe(probe);
+    }
+
+    if (io_uring_register_buffers_sparse(&ring, maxFixedBuffers) == 0) {
+        _fixedBuffers = true;
+        _bufferSlotUsed.resize(maxFixedBuffers);
+    }
+
+    _eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_eventfd < 0) {
+        log(LOG_FWD, "eventfd failed: {}\n", strerror(errno));
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+    ret = io_uring_register_eventfd(&ring, _eventfd);
+    if (ret < 0) {
+        log(LOG_FWD, "io_uring_register_eventfd failed: {}\n", strerror(-ret));
+        close(_eventfd);
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+    g_unix_fd_add(_eventfd, G_IO_IN, wrap_eventfdReady, this);
+
+    log(LOG_FWD, "io_uring ready, zero copy send: {}, fixed buffers: {}\n", zeroCopySupported, _fixedBuffers);
+    return true;
+}
+
+io_uring_sqe *UringLoop::getSqe() {
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    if (!sqe) {
+        fatal("io_uring submission queue full\n");
+    }
+    return sqe;
+}
+
+void UringLoop::flush() {
+    int ret = io_uring_submit(&ring);
+    if (ret < 0 && ret != -EBUSY && ret != -EAGAIN) {
+        fatal("io_uring_submit failed: {}\n", strerror(-ret));
+    }
+}
+
+int UringLoop::allocBufferGroup() {
+    if (_freeBufferGroups.size()) {
+        int bgid = _freeBufferGroups.back();
+        _freeBufferGroups.pop_back();
+        return bgid;
+    }
+    return _nextBufferGroup++;
+}
+
+void UringLoop::freeBufferGroup(int bgid) {
+    _freeBufferGroups.push_back(bgid);
+}
+
+int UringLoop::registerBuffer(void *data, size_t size) {
+    if (!_fixedBuffers) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < _bufferSlotUsed.size(); i++) {
+        if (!_bufferSlotUsed[i]) {
+            iovec iov = { data, size };
+            __u64 tag = 0;
+            if (io_uring_register_buffers_update_tag(&ring, i, &iov, &tag, 1) < 0) {
+                // most likely RLIMIT_MEMLOCK, the forwarder falls back to normal buffers
+                return -1;
+            }
+            _bufferSlotUsed[i] = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void UringLoop::unregisterBuffer(int index) {
+    iovec iov = { nullptr, 0 };
+    __u64 tag = 0;
+    io_uring_register_buffers_update_tag(&ring, index, &iov, &tag, 1);
+    _bufferSlotUsed[index] = false;
+}
+
+gboolean UringLoop::wrap_eventfdReady(gint fd, GIOCondition condition, gpointer user_data) {
+    (void)fd;
+    (void)condition;
+    reinterpret_cast<UringLoop*>(user_data)->eventfdReady();
+    return G_SOURCE_CONTINUE;
+}
+
+void UringLoop::eventfdReady() {
+    uint64_t counter;
+    if (read(_eventfd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+        fatal("eventfd read failed: {}\n", strerror(errno));
+    }
+
+    bool needTick = false;
+    io_uring_cqe *cqe = nullptr;
+    while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+        auto op = reinterpret_cast<UringForwarderImpl::Op*>(io_uring_cqe_get_data(cqe));
+        needTick |= op->impl->complete(op->kind, cqe);
+        io_uring_cqe_seen(&ring, cqe);
+    }
+    flush();
+
+    if (needTick && tick) {
+        tick();
+    }
+}
+
+
+UringForwarderImpl::UringForwarderImpl(UringLoop *loop, UringForwarder *owner, SSL *ssl_stream, int fd)
+    : loop(loop), owner(owner), ssl_stream(ssl_stream), fd(fd) {
+
+    bgid = loop->allocBufferGroup();
+    int ret = 0;
+    bufRing = io_uring_setup_buf_ring(&loop->ring, inputBufferCount, bgid, 0, &ret);
+    if (!bufRing) {
+        fatal("io_uring_setup_buf_ring failed: {}\n", strerror(-ret));
+    }
+    inputMemory.reset(new std::byte[inputBufferCount * inputBufferSize]);
+    for (unsigned short bid = 0; bid < inputBufferCount; bid++) {
+        returnBuffer(bid);
+    }
+
+    bufIndex = loop->registerBuffer(outputBuffer.data(), outputBuffer.size());
+    zeroCopy = loop->zeroCopySupported;
+}
+
+UringForwarderImpl::~UringForwarderImpl() {
+    io_uring_free_buf_ring(&loop->ring, bufRing, inputBufferCount, bgid);
+    loop->freeBufferGroup(bgid);
+    if (bufIndex >= 0) {
+        loop->unregisterBuffer(bufIndex);
+    }
+}
+
+bool UringForwarderImpl::complete(Op::Kind kind, io_uring_cqe *cqe) {
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (kind == Op::recv) {
+        if (!more) {
+            recvArmed = false;
+            --inFlight;
+        }
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            --freeInputBuffers;
+            if (owner && !inputEof) {
+                log(LOG_FWD, "read local input: {}\n", cqe->res);
+                inputChunks.push_back({bid, 0, (size_t)cqe->res});
+            } else {
+                returnBuffer(bid);
+            }
+        } else if (cqe->res == 0) {
+            inputEof = true;
+        } else if (cqe->res == -ENOBUFS) {
+            // all buffers are waiting for the quic stream, rearmed once buffers are returned
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            log(LOG_FWD, "local read failed: {}\n", strerror(-cqe->res));
+            inputEof = true;
+        }
+    } else if (kind == Op::send) {
+        if (cqe->flags & IORING_CQE_F_NOTIF) {
+            // zero copy send: the buffer can be reused now
+            --inFlight;
+            finishSend();
+        } else {
+            sendResult = cqe->res;
+            if (!more) {
+                --inFlight;
+                finishSend();
+            }
+        }
+    } else {
+        --inFlight;
+    }
+
+    if (!owner) {
+        if (!inFlight) {
+            delete this;
+        }
+        return false;
+    }
+
+    transmitBuffered();
+    armRecv();
+    return true;
+}
+
+void UringForwarderImpl::detach() {
+    owner = nullptr;
+    if (!inFlight) {
+        delete this;
+        return;
+    }
+
+    // needs to be submitted before the socket is closed
+    io_uring_sqe *sqe = loop->getSqe();
+    io_uring_prep_cancel_fd(sqe, fd, IORING_ASYNC_CANCEL_ALL);
+    io_uring_sqe_set_data(sqe, &cancelOp);
+    ++inFlight;
+    loop->flush();
+}
+
+void UringForwarderImpl::quicPoll() {
+    if (!outputClosed) {
+        while (!remoteConcluded && !outputBuffer.full()) {
+            auto [ptr, len] = outputBuffer.writable();
+            int read = quicReadOrEof(ssl_stream, (char*)ptr, len);
+            if (read < 0) {
+                log(LOG_FWD, "Bridge stream closed by remote.\n");
+                remoteConcluded = true;
+            } else if (read) {
+                log(LOG_FWD, "Got {} bytes data from bridge.\n", read);
+                outputBuffer.commit(read);
+            } else {
+                break;
+            }
+        }
+        startSend();
+        if (remoteConcluded && !sendBusy && outputBuffer.empty()) {
+            closeOutput();
+        }
+    }
+
+    transmitBuffered();
+    armRecv();
+    loop->flush();
+}
+
+void UringForwarderImpl::armRecv() {
+    if (recvArmed || inputEof || !freeInputBuffers) {
+        return;
+    }
+
+    io_uring_sqe *sqe = loop->getSqe();
+    io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    io_uring_sqe_set_data(sqe, &recvOp);
+    recvArmed = true;
+    ++inFlight;
+}
+
+void UringForwarderImpl::transmitBuffered() {
+    while (!inputClosed && inputChunks.size()) {
+        Chunk &chunk = inputChunks.front();
+        std::byte *data = inputMemory.get() + chunk.bid * inputBufferSize + chunk.offset;
+        size_t written = -1;
+        int ret = SSL_write_ex(ssl_stream, data, chunk.len - chunk.offset, &written);
+        if (ret > 0) {
+            if (!written) {
+                // Workaround for https://github.com/openssl/openssl/issues/23606
+                break;
+            }
+            inputThroughput.add(written);
+            chunk.offset += written;
+            if (chunk.offset == chunk.len) {
+                returnBuffer(chunk.bid);
+                inputChunks.pop_front();
+            }
+        } else {
+            int ssl_error = SSL_get_error(ssl_stream, ret);
+            if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE) {
+                break;
+            }
+            if (SSL_get_stream_write_state(ssl_stream) == SSL_STREAM_STATE_RESET_REMOTE) {
+                ERR_clear_error();
+                log(LOG_FWD, "Bridge stream stopped by remote, dropping buffered data\n");
+                for (const Chunk &dropped : inputChunks) {
+                    returnBuffer(dropped.bid);
+                }
+                inputChunks.clear();
+                inputEof = true;
+                if (recvArmed) {
+                    io_uring_sqe *sqe = loop->getSqe();
+                    io_uring_prep_cancel(sqe, &recvOp, 0);
+                    io_uring_sqe_set_data(sqe, &cancelOp);
+                    ++inFlight;
+                }
+                break;
+            }
+            fatal_ossl("write failed:\n");
+        }
+    }
+
+    if (inputEof && inputChunks.empty() && !recvArmed) {
+        closeInput();
+    }
+}
+
+void UringForwarderImpl::returnBuffer(unsigned short bid) {
+    io_uring_buf_ring_add(bufRing, inputMemory.get() + bid * inputBufferSize, inputBufferSize, bid,
+                          io_uring_buf_ring_mask(inputBufferCount), 0);
+    io_uring_buf_ring_advance(bufRing, 1);
+    ++freeInputBuffers;
+}
+
+void UringForwarderImpl::startSend() {
+    if (sendBusy || outputClosed || outputBuffer.empty()) {
+        return;
+    }
+
+    auto [ptr, len] = outputBuffer.readable();
+    io_uring_sqe *sqe = loop->getSqe();
+    sendWasZeroCopy = zeroCopy && len >= zeroCopyThreshold;
+    if (sendWasZeroCopy) {
+        if (bufIndex >= 0) {
+            io_uring_prep_send_zc_fixed(sqe, fd, ptr, len, MSG_NOSIGNAL, 0, bufIndex);
+        } else {
+            io_uring_prep_send_zc(sqe, fd, ptr, len, MSG_NOSIGNAL, 0);
+        }
+    } else {
+        if (bufIndex >= 0) {
+            io_uring_prep_write_fixed(sqe, fd, ptr, len, 0, bufIndex);
+        } else {
+            io_uring_prep_send(sqe, fd, ptr, len, MSG_NOSIGNAL);
+        }
+    }
+    io_uring_sqe_set_data(sqe, &sendOp);
+    sendBusy = true;
+    ++inFlight;
+}
+
+void UringForwarderImpl::finishSend() {
+    sendBusy = false;
+    if (!owner) {
+        return;
+    }
+
+    if (sendResult == -EOPNOTSUPP && sendWasZeroCopy) {
+        log(LOG_FWD, "zero copy send not supported on this socket\n");
+        zeroCopy = false;
+        startSend();
+        return;
+    }
+
+    if (sendResult < 0) {
+        log(LOG_FWD, "local write failed: {}\n", strerror(-sendResult));
+        closeOutput();
+        return;
+    }
+
+    outputBuffer.consume(sendResult);
+    outputThroughput.add(sendResult);
+    startSend();
+    if (remoteConcluded && !sendBusy && outputBuffer.empty()) {
+        closeOutput();
+    }
+}
+
+void UringForwarderImpl::closeInput() {
+    if (inputClosed) {
+        return;
+    }
+    inputClosed = true;
+    inputThroughput.logSummary("local to bridge");
+    if (owner->onInputClose) {
+        owner->onInputClose();
+    }
+}
+
+void UringForwarderImpl::closeOutput() {
+    if (outputClosed) {
+        return;
+    }
+    outputClosed = true;
+    outputThroughput.logSummary("bridge to local");
+    if (owner->onOutputClose) {
+        owner->onOutputClose();
+    }
+}
+
+
+bool UringForwarder::available() {
+    return UringLoop::instance() != nullptr;
+}
+
+UringForwarder::UringForwarder(std::function<void()> tick, SSL *ssl_stream, int fd) {
+    UringLoop *loop = UringLoop::instance();
+    loop->tick = tick;
+    _impl = new UringForwarderImpl(loop, this, ssl_stream, fd);
+}
+
+UringForwarder::~UringForwarder() {
+    _impl->detach();
+}
+
+void UringForwarder::quicPoll() {
+    _impl->quicPoll();
+}
+
+bool UringForwarder::inputClosed() const {
+    return _impl->inputClosed;
+}
+
+bool UringForwarder::outputClosed() const {
+    return _impl->outputClosed;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#ifdef PEERSOCK_HAVE_IO_URING
+
+#include <functional>
+
+#include <openssl/ssl.h>
+
+struct UringForwarderImpl;
+
+// Forwards both directions between a local socket and a QUIC stream using io_uring.
+// Local data is received with a multishot receive into a provided buffer ring, data from the QUIC stream is sent
+// from a registered fixed buffer, using zero copy sends for large chunks. Completions are signaled via an eventfd
+// watched by the glib main loop.
+// Has the same interface as FdForwarder.
+class UringForwarder {
+public:
+    // false if io_uring (or one of the needed features) is not usable on this system
+    static bool available();
+
+    UringForwarder(std::function<void()> tick, SSL *ssl_stream, int fd);
+    ~UringForwarder();
+
+    UringForwarder(const UringForwarder&) = delete;
+    UringForwarder &operator=(const UringForwarder&) = delete;
+
+    void quicPoll();
+
+    bool inputClosed() const;
+    bool outputClosed() const;
+
+    // same semantics as InputStreamToSslForwarder::onClose
+    std::function<void()> onInputClose;
+    // same semantics as SslToOutputStreamForwarder::onClose
+    std::function<void()> onOutputClose;
+
+private:
+    // outlives the forwarder until all submitted operations completed
+    UringForwarderImpl *_impl = nullptr;
+};
+
+#endif
@@ -37,6 +37,29 @@ int quicReadOrDie(SSL *stream, char *buf, int len) {
     return ret;
 }
 
+int quicReadOrEof(SSL *stream, char *buf, int len) {
+    int ret = 0;
+
+    ret = SSL_read(stream, buf, len);
+    if (ret <= 0) {
+        int ssl_error = SSL_get_error(stream, ret);
+        if (ssl_error == SSL_ERROR_WANT_READ) {
+            return 0;
+        } else if (ssl_error == SSL_ERROR_WANT_WRITE) {
+            return 0;
+        } else if (ssl_error == SSL_ERROR_ZERO_RETURN) {
+            return -1;
+        } else if (SSL_get_stream_read_state(stream) == SSL_STREAM_STATE_RESET_REMOTE) {
+            ERR_clear_error();
+            return -1;
+        } else {
+            fatal_ossl("quicReadOrEof failed\n");
+        }
+    }
+
+    return ret;
+}
+
 void printToStdErr(char *data, int len) {
     write(2, data, len);
 }
@@ -110,6 +110,9 @@ void writeUserMessage(nlohmann::json machineReadable, T &&format, P &&... params
 
 int quicReadOrDie(SSL *stream, char *buf, int len);
 
+// returns -1 if the remote side concluded or reset the stream instead of terminating the process.
+int quicReadOrEof(SSL *stream, char *buf, int len);
+
 template <typename F>
 void quicReadFramedMessageOrDie(SSL *stream, std::string &buf, F f) {
 